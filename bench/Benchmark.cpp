@@ -0,0 +1,126 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <chrono>
+#include <iostream>
+
+#include "Crc32c.hpp"
+#include "Filesystem.hpp"
+#include "Topic.hpp"
+
+#define BENCH_MESSAGES 200000
+
+using bench_clock = std::chrono::steady_clock;
+
+/**
+ * @brief Return the seconds that passed since the specified moment
+ */
+double elapsed(const bench_clock::time_point& start) {
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+/**
+ * @brief Build a message similar to the ones received by the server
+ */
+std::string make_message(const uint i, const uint payload) {
+    return "127.0.0.1:1234 - bench/topic - STRING - " +
+           std::string(payload, 'a' + i % 26);
+}
+
+/**
+ * @brief Measure the throughput of the checksum implementations
+ */
+void bench_checksums() {
+    const application::Crc32c& crc = application::Crc32c::get();
+
+    for (uint size : {64, 256, 1600}) {
+        std::string data(size, 'x');
+        uint sink = 0;
+
+        auto start = bench_clock::now();
+        for (uint i = 0; i < BENCH_MESSAGES; ++i) {
+            sink += crc.compute(data.c_str(), data.size());
+        }
+        double hw = elapsed(start);
+
+        start = bench_clock::now();
+        for (uint i = 0; i < BENCH_MESSAGES; ++i) {
+            sink += crc.compute_sw(data.c_str(), data.size());
+        }
+        double sw = elapsed(start);
+
+        std::cout << "crc32c " << size << " bytes: "
+                  << (crc.is_hardware() ? "hardware " : "(no hardware) ")
+                  << BENCH_MESSAGES * size / hw / 1e9 << " GB/s, table "
+                  << BENCH_MESSAGES * size / sw / 1e9 << " GB/s"
+                  << (sink == 0 ? " " : "") << "\n";
+    }
+}
+
+/**
+ * @brief Measure how much of the ingest time is spent on checksums
+ * The ingest stores the messages in a topic (which writes them to its file,
+ * with a checksum for each record)
+ */
+void bench_ingest() {
+    application::Filesystem fs;
+
+    for (uint payload : {16, 1500}) {
+        auto start = bench_clock::now();
+        {
+            application::Topic topic(0, "bench/topic");
+            for (uint i = 0; i < BENCH_MESSAGES; ++i) {
+                topic.add_message(make_message(i, payload));
+            }
+            topic.save();
+        }
+        double ingest = elapsed(start);
+        fs.deleteDirectory(std::string(DATABASE_FOLDER) + "bench");
+
+        // The checksums are computed when the messages are received, so the
+        // cost is measured the same way (on messages that were just built)
+        uint sink = 0;
+        start = bench_clock::now();
+        for (uint i = 0; i < BENCH_MESSAGES; ++i) {
+            sink += make_message(i, payload).size();
+        }
+        double build = elapsed(start);
+
+        start = bench_clock::now();
+        for (uint i = 0; i < BENCH_MESSAGES; ++i) {
+            sink += application::crc32c(make_message(i, payload));
+        }
+        double checksums = std::max(elapsed(start) - build, 0.0);
+
+        std::cout << "ingest (payload " << payload
+                  << " bytes): " << BENCH_MESSAGES / ingest
+                  << " msg/s, checksums are " << 100 * checksums / ingest
+                  << "% of the ingest time" << (sink == 0 ? " " : "")
+                  << "\n";
+    }
+}
+
+int main() {
+    bench_checksums();
+    bench_ingest();
+    return 0;
+}
@@ -0,0 +1,302 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <cmath>
+
+#include "Messages.hpp"
+
+#define AGGREGATE_SEPARATOR '#'  // "temp/room1#avg:10s"
+#define AGGREGATE_DECIMALS 4     // The precision of the FLOAT results
+
+namespace application {
+/**
+ * @brief The functions of the aggregate topics
+ */
+enum aggregate_op { AGG_COUNT, AGG_SUM, AGG_MIN, AGG_MAX, AGG_AVG };
+
+/**
+ * @brief An aggregate of the values of a topic, over a window of time. The
+ * windows are consecutive (each one starts when the last one closes), and they
+ * are aligned to multiples of their size. Only the count, sum, min and max of
+ * the current window are kept, so an update is O(1)
+ */
+struct window_aggregate {
+    std::string name;  // The name of the aggregate topic
+    bint op;           // aggregate_op
+    lint window;       // The size of the windows (ns)
+    lint start;        // When the current window started (ns, see time_ns)
+    lint count;
+    double sum, min, max;
+
+    /**
+     * @brief Get the result of the current window
+     */
+    double result() const {
+        switch (op) {
+            case AGG_COUNT:
+                return count;
+            case AGG_SUM:
+                return sum;
+            case AGG_MIN:
+                return min;
+            case AGG_MAX:
+                return max;
+            default:
+                return sum / count;
+        }
+    }
+
+    /**
+     * @brief Start a new window (the one that contains "now")
+     * @param now The current time (ns)
+     */
+    void reset(const lint now) {
+        start = now - now % window;
+        count = 0;
+        sum = min = max = 0;
+    }
+
+    /**
+     * @brief Add a value to the current window
+     * @param value The value
+     */
+    void add(const double value) {
+        min = count == 0 ? value : std::min(min, value);
+        max = count == 0 ? value : std::max(max, value);
+        sum += value;
+        count++;
+    }
+};
+
+/**
+ * @brief The result of a window that was closed
+ */
+struct aggregate_result {
+    std::string name;
+    bint op;
+    double value;
+};
+
+/**
+ * @brief Computes the aggregate topics ("topic#function:window", for example
+ * "temp/room1#avg:10s"), from the numeric messages of their topics. The
+ * function is one of count, sum, min, max or avg, and the window is a number
+ * of seconds, minutes or hours ("10s", "5m", "1h"). The result of a window is
+ * published on the aggregate topic when it closes (nothing is published for a
+ * window without values). An aggregate is computed by the shard that owns its
+ * topic.
+ */
+class Aggregator {
+   private:
+    // The aggregates of the topics, by the name of the topic
+    std::unordered_map<std::string, std::vector<window_aggregate>> topics;
+    std::unordered_map<std::string, std::string> names;  // Aggregate to topic
+
+    /**
+     * @brief Close the current window of an aggregate, if it has ended
+     * @param aggregate The aggregate
+     * @param now The current time (ns)
+     * @param closed Will contain its result (if it had values)
+     */
+    static void close(window_aggregate &aggregate, const lint now,
+                      std::vector<aggregate_result> &closed) {
+        if (now < aggregate.start + aggregate.window) {
+            return;
+        }
+        if (aggregate.count != 0) {
+            closed.push_back(aggregate_result{
+                aggregate.name, aggregate.op, aggregate.result()});
+        }
+        aggregate.reset(now);
+    }
+
+   public:
+    /**
+     * @brief Parse the name of an aggregate topic
+     * @param name The name
+     * @param topic Will contain the name of its topic
+     * @param aggregate Will contain the function and the window
+     * @return true It is an aggregate topic
+     * @return false It is not (or it is malformed)
+     */
+    static bool parse(const std::string &name, std::string &topic,
+                      window_aggregate &aggregate) {
+        size_t hash = name.rfind(AGGREGATE_SEPARATOR);
+        size_t colon = name.find(':', hash);
+        if (hash == std::string::npos || hash == 0 ||
+            colon == std::string::npos) {
+            return false;
+        }
+
+        static const char *ops[] = {"count", "sum", "min", "max", "avg"};
+        std::string op = name.substr(hash + 1, colon - hash - 1);
+        auto it = std::find(ops, ops + 5, op);
+        if (it == ops + 5) {
+            return false;
+        }
+
+        char *end;
+        lint window = strtoul(name.c_str() + colon + 1, &end, 10);
+        std::string unit(end);
+        if (window == 0 || end == name.c_str() + colon + 1) {
+            return false;
+        } else if (unit == "s") {
+            window *= NS_PER_SECOND;
+        } else if (unit == "m") {
+            window *= 60 * NS_PER_SECOND;
+        } else if (unit == "h") {
+            window *= 3600 * NS_PER_SECOND;
+        } else {
+            return false;
+        }
+
+        topic = name.substr(0, hash);
+        aggregate = window_aggregate();
+        aggregate.name = name;
+        aggregate.op = it - ops;
+        aggregate.window = window;
+        return true;
+    }
+
+    /**
+     * @brief Check if a topic is an aggregate topic (see parse)
+     */
+    static bool is_aggregate(const std::string &name) {
+        std::string topic;
+        window_aggregate aggregate;
+        return name.find(AGGREGATE_SEPARATOR) != std::string::npos &&
+               parse(name, topic, aggregate);
+    }
+
+    /**
+     * @brief Start computing an aggregate topic (if it isn't computed already)
+     * @param name The name of the aggregate topic
+     * @param now The current time (ns)
+     * @return true The aggregate is computed
+     * @return false The name is malformed
+     */
+    bool add(const std::string &name, const lint now) {
+        if (names.count(name) != 0) {
+            return true;
+        }
+
+        std::string topic;
+        window_aggregate aggregate;
+        if (!parse(name, topic, aggregate)) {
+            return false;
+        }
+        aggregate.reset(now);
+        topics[topic].push_back(aggregate);
+        names[name] = topic;
+        return true;
+    }
+
+    /**
+     * @brief A message was received on a topic. If the topic has aggregates,
+     * its value is decoded and added to them
+     * @param topic The topic
+     * @param text The message
+     * @param now The current time (ns)
+     * @param closed Will contain the results of the windows that were closed
+     */
+    void update(const std::string &topic, const std::string &text,
+                const lint now, std::vector<aggregate_result> &closed) {
+        auto it = topics.find(topic);
+        message_value value;
+        if (it == topics.end() || !decode_message(text, topic, value) ||
+            value.type == STRING) {
+            return;
+        }
+
+        for (window_aggregate &aggregate : it->second) {
+            close(aggregate, now, closed);
+            aggregate.add(value.number);
+        }
+    }
+
+    /**
+     * @brief Close the windows that have ended
+     * @param now The current time (ns)
+     * @param closed Will contain their results
+     */
+    void close_windows(const lint now, std::vector<aggregate_result> &closed) {
+        for (auto &i : topics) {
+            for (window_aggregate &aggregate : i.second) {
+                close(aggregate, now, closed);
+            }
+        }
+    }
+
+    /**
+     * @brief Get the time when the next window closes
+     * @return lint The time (ns), 0 if there are no aggregates
+     */
+    lint next_close() const {
+        lint next = 0;
+        for (auto &i : topics) {
+            for (const window_aggregate &aggregate : i.second) {
+                lint end = aggregate.start + aggregate.window;
+                next = next == 0 ? end : std::min(next, end);
+            }
+        }
+        return next;
+    }
+
+    bool empty() const { return topics.empty(); }
+
+    /**
+     * @brief Build the message of a result, like a datagram that was sent on
+     * the aggregate topic (an INT for count, a FLOAT for the others)
+     * @param result The result
+     * @param msg Will contain the message
+     * @return ssize_t The size of the message
+     */
+    static ssize_t make_message(const aggregate_result &result,
+                                udp_message &msg) {
+        bzero(&msg, UDP_MSG_SIZE);
+        safe_cpy(msg.topic, result.name.c_str(),
+                 std::min(result.name.size(), (size_t)TOPIC_LENGTH - 1));
+        msg.payload[0] = result.value < 0;
+        double value = std::fabs(result.value);
+
+        if (result.op == AGG_COUNT) {
+            msg.type = INT;
+            *(uint *)(msg.payload + 1) = htonl((uint)value);
+            return TOPIC_LENGTH + 6;
+        }
+
+        // The most decimals that fit in the value
+        bint exp = AGGREGATE_DECIMALS;
+        while (exp > 0 && value * power(10, exp) >= UINT32_MAX) {
+            exp--;
+        }
+        value = std::min(std::round(value * power(10, exp)), 4294967295.0);
+        msg.type = FLOAT;
+        *(uint *)(msg.payload + 1) = htonl((uint)value);
+        msg.payload[5] = exp;
+        return TOPIC_LENGTH + 7;
+    }
+};
+}  // namespace application
\ No newline at end of file
@@ -0,0 +1,204 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <deque>
+
+#include "Utils.hpp"
+
+namespace application {
+/**
+ * @brief Keeps the messages of the conflated subscriptions, that could not be
+ * sent yet (the socket of the client can't take more data)
+ * For every client, only the newest message of each topic is kept: a newer
+ * message replaces the one that is waiting (which keeps its place, so the
+ * topics are sent in the order they first waited). The server sends them when
+ * the client can receive data again.
+ * A message is never split: if only a part of it was sent, the rest (the
+ * "partial" data) is sent before anything else on that socket. The server
+ * also keeps there the other data a socket can't take now.
+ */
+class Conflator {
+   private:
+    struct outbox {
+        std::string partial;                           // The rest of a message
+        std::deque<uint> order;                        // Topics, in order
+        std::unordered_map<uint, std::string> latest;  // Topic to message
+    };
+
+    std::unordered_map<uint, outbox> outboxes;  // By socket
+    lint replaced;                              // Messages that were dropped
+    uint partials;  // The number of sockets with partial data
+
+    void erase_if_empty(std::unordered_map<uint, outbox>::iterator it) {
+        if (it->second.order.empty() && it->second.partial.empty()) {
+            outboxes.erase(it);
+        }
+    }
+
+   public:
+    Conflator() : replaced(0), partials(0) {}
+
+    /**
+     * @brief Keep a message until the socket can take it
+     * @param sockfd The socket of the client
+     * @param topic The topic of the message
+     * @param frame The message (as it is sent)
+     */
+    void hold(const uint sockfd, const uint topic, const std::string &frame) {
+        outbox &box = outboxes[sockfd];
+        auto it = box.latest.find(topic);
+        if (it != box.latest.end()) {
+            it->second = frame;
+            replaced++;
+        } else {
+            box.order.push_back(topic);
+            box.latest.insert(std::make_pair(topic, frame));
+        }
+    }
+
+    /**
+     * @brief Checks if a socket has messages that wait (the new ones must wait
+     * after them)
+     */
+    bool holds(const uint sockfd) const { return outboxes.count(sockfd) != 0; }
+
+    /**
+     * @brief Get the next message that waits for a socket (see pop)
+     * @param sockfd The socket
+     * @return const std::string* The message, NULL if there is none
+     */
+    const std::string *peek(const uint sockfd) const {
+        auto it = outboxes.find(sockfd);
+        if (it == outboxes.end() || it->second.order.empty()) {
+            return NULL;
+        }
+        return &it->second.latest.at(it->second.order.front());
+    }
+
+    /**
+     * @brief Remove the message returned by peek (it was sent)
+     * @param sockfd The socket
+     */
+    void pop(const uint sockfd) {
+        auto it = outboxes.find(sockfd);
+        if (it == outboxes.end() || it->second.order.empty()) {
+            return;
+        }
+        outbox &box = it->second;
+        box.latest.erase(box.order.front());
+        box.order.pop_front();
+        erase_if_empty(it);
+    }
+
+    /**
+     * @brief Get the rest of a message that was partly sent on a socket
+     * @param sockfd The socket
+     * @return std::string* The data (can be changed), NULL if there is none
+     */
+    std::string *get_partial(const uint sockfd) {
+        if (partials == 0) {
+            return NULL;
+        }
+        auto it = outboxes.find(sockfd);
+        if (it == outboxes.end() || it->second.partial.empty()) {
+            return NULL;
+        }
+        return &it->second.partial;
+    }
+
+    /**
+     * @brief Keep the rest of a message that was partly sent
+     * @param sockfd The socket
+     * @param rest The data that was not sent
+     */
+    void set_partial(const uint sockfd, const std::string &rest) {
+        outbox &box = outboxes[sockfd];
+        if (box.partial.empty()) {
+            partials++;
+        }
+        box.partial = rest;
+    }
+
+    /**
+     * @brief The partial data of a socket was sent
+     * @param sockfd The socket
+     */
+    void clear_partial(const uint sockfd) {
+        auto it = outboxes.find(sockfd);
+        if (it != outboxes.end() && !it->second.partial.empty()) {
+            it->second.partial.clear();
+            partials--;
+            erase_if_empty(it);
+        }
+    }
+
+    /**
+     * @brief Checks if any socket has partial data
+     */
+    bool has_partials() const { return partials > 0; }
+
+    /**
+     * @brief Drop everything that waits for a socket (it was closed)
+     * @param sockfd The socket
+     */
+    void forget(const uint sockfd) {
+        auto it = outboxes.find(sockfd);
+        if (it != outboxes.end()) {
+            partials -= !it->second.partial.empty();
+            outboxes.erase(it);
+        }
+    }
+
+    /**
+     * @brief Get the sockets that have messages waiting
+     */
+    std::vector<uint> get_sockets() const {
+        std::vector<uint> v;
+        for (auto &i : outboxes) {
+            v.push_back(i.first);
+        }
+        return v;
+    }
+
+    /**
+     * @brief Check if no message waits
+     */
+    bool empty() const { return outboxes.empty(); }
+
+    /**
+     * @brief Get the number of messages that are waiting, and how many were
+     * replaced
+     * @return std::string The statistics
+     */
+    std::string get_stats() const {
+        lint waiting = 0;
+        for (auto &i : outboxes) {
+            waiting += i.second.order.size();
+        }
+        return "conflation: " + std::to_string(waiting) + " waiting, " +
+               std::to_string(replaced) + " replaced\n";
+    }
+};
+}  // namespace application
\ No newline at end of file
@@ -0,0 +1,215 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>  // _mm_crc32_u64 (SSE4.2)
+#include <wmmintrin.h>  // _mm_clmulepi64_si128 (PCLMUL)
+#endif
+
+#include "Utils.hpp"
+
+#define CRC32C_POLY 0x82f63b78  // Castagnoli polynomial, reflected
+#define CRC32C_BLOCK 128        // Size of a stream, for the 3-way hardware crc
+
+namespace application {
+
+/**
+ * @brief This class computes CRC32C checksums (the ones used to check the
+ * records stored by the topics).
+ * If the CPU has SSE4.2, the crc32 instruction is used. Long buffers are split
+ * into 3 streams that are computed in parallel, and then combined using
+ * carry-less multiplication (PCLMUL). Otherwise, a table based (slicing by 8)
+ * implementation is used.
+ */
+class Crc32c {
+   private:
+    uint table[8][256];
+    bool hardware;
+    uint shift_one, shift_two;  // x^(8 * len - 33) for 1 and 2 blocks
+
+    /**
+     * @brief Compute x^n modulo the polynomial (reflected)
+     * @param n The power
+     * @return uint The result
+     */
+    static uint xpow_mod(uint n) {
+        uint r = 0x80000000;  // x^0
+        while (n--) {
+            r = (r & 1) ? (r >> 1) ^ CRC32C_POLY : r >> 1;
+        }
+        return r;
+    }
+
+#if defined(__x86_64__)
+    /**
+     * @brief Multiply a crc by the constant k (see xpow_mod) and reduce it
+     * The result is the crc "moved" over the bytes that k was computed for
+     */
+    __attribute__((target("sse4.2,pclmul"))) static uint shift(const uint crc,
+                                                              const uint k) {
+        __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+                                               _mm_cvtsi32_si128(k), 0);
+        return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+    }
+
+    __attribute__((target("sse4.2,pclmul"))) uint compute_hw(const char *data,
+                                                            size_t len,
+                                                            uint crc) const {
+        lint crc0 = crc;
+
+        // Three streams, the crc32 instruction has a latency of 3 cycles and
+        // a throughput of 1
+        while (len >= 3 * CRC32C_BLOCK) {
+            lint crc1 = 0, crc2 = 0;
+            for (uint i = 0; i < CRC32C_BLOCK; i += 8) {
+                lint a, b, c;
+                memcpy(&a, data + i, 8);
+                memcpy(&b, data + CRC32C_BLOCK + i, 8);
+                memcpy(&c, data + 2 * CRC32C_BLOCK + i, 8);
+                crc0 = _mm_crc32_u64(crc0, a);
+                crc1 = _mm_crc32_u64(crc1, b);
+                crc2 = _mm_crc32_u64(crc2, c);
+            }
+            crc0 = shift(crc0, shift_two) ^ shift(crc1, shift_one) ^ crc2;
+            data += 3 * CRC32C_BLOCK;
+            len -= 3 * CRC32C_BLOCK;
+        }
+
+        while (len >= 8) {
+            lint a;
+            memcpy(&a, data, 8);
+            crc0 = _mm_crc32_u64(crc0, a);
+            data += 8;
+            len -= 8;
+        }
+
+        while (len > 0) {
+            crc0 = _mm_crc32_u8(crc0, *data);
+            data++;
+            len--;
+        }
+        return crc0;
+    }
+#endif
+
+   public:
+    Crc32c() : hardware(false) {
+        for (uint i = 0; i < 256; ++i) {
+            uint crc = i;
+            for (int j = 0; j < 8; ++j) {
+                crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+            }
+            table[0][i] = crc;
+        }
+        for (uint i = 0; i < 256; ++i) {
+            for (int j = 1; j < 8; ++j) {
+                table[j][i] =
+                    (table[j - 1][i] >> 8) ^ table[0][table[j - 1][i] & 0xff];
+            }
+        }
+
+        shift_one = xpow_mod(8 * CRC32C_BLOCK - 33);
+        shift_two = xpow_mod(16 * CRC32C_BLOCK - 33);
+
+#if defined(__x86_64__)
+        hardware = __builtin_cpu_supports("sse4.2") &&
+                   __builtin_cpu_supports("pclmul");
+#endif
+    }
+
+    /**
+     * @brief Get the instance used by the application (the tables are built
+     * only once)
+     * @return const Crc32c& The instance
+     */
+    static const Crc32c &get() {
+        static const Crc32c instance;
+        return instance;
+    }
+
+    /**
+     * @brief Checks if the checksums are computed using the CPU instructions
+     * @return true SSE4.2 and PCLMUL are used
+     * @return false The table implementation is used
+     */
+    bool is_hardware() const { return hardware; }
+
+    /**
+     * @brief Compute the checksum of a buffer, using the table implementation
+     * @param data The data
+     * @param len The size of the data
+     * @return uint The checksum
+     */
+    uint compute_sw(const char *data, size_t len) const {
+        uint crc = 0xffffffff;
+        const uchar *p = (const uchar *)data;
+
+        while (len >= 8) {
+            uint low, high;
+            memcpy(&low, p, 4);
+            memcpy(&high, p + 4, 4);
+            low ^= crc;
+            crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^
+                  table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+                  table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^
+                  table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+            p += 8;
+            len -= 8;
+        }
+
+        while (len > 0) {
+            crc = (crc >> 8) ^ table[0][(crc ^ *p) & 0xff];
+            p++;
+            len--;
+        }
+        return ~crc;
+    }
+
+    /**
+     * @brief Compute the checksum of a buffer
+     * @param data The data
+     * @param len The size of the data
+     * @return uint The checksum
+     */
+    uint compute(const char *data, const size_t len) const {
+#if defined(__x86_64__)
+        if (hardware) {
+            return ~compute_hw(data, len, 0xffffffff);
+        }
+#endif
+        return compute_sw(data, len);
+    }
+
+    uint compute(const std::string &data) const {
+        return compute(data.c_str(), data.size());
+    }
+};
+
+/**
+ * @brief Compute the CRC32C checksum of a string
+ * @param data The string
+ * @return uint The checksum
+ */
+uint crc32c(const std::string &data) { return Crc32c::get().compute(data); }
+}  // namespace application
\ No newline at end of file
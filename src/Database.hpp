@@ -22,12 +22,68 @@
 
 #pragma once
 
+#include <deque>
+#include <map>
+
 #include "Filesystem.hpp"
+#include "LogWriter.hpp"
+#include "Shards.hpp"
+#include "Subscribers.hpp"
 #include "Topic.hpp"
+#include "TopicTrie.hpp"
 #include "User.hpp"
 #include "Utils.hpp"
 
+#define WILDCARD_ID 0x80000000u  // The ids of the patterns have this bit set
+
 namespace application {
+/**
+ * @brief The data of a topic that is used for every message it receives
+ * (kept apart from the rest of the topic, in a dense array)
+ */
+struct topic_entry {
+    Topic* topic;      // The topic (stable, stored in Database::topic_data)
+    uint subscribers;  // The number of users subscribed to the topic
+    lint shards;       // The other shards that have subscribers (bit mask)
+    const subscriber_list* online;  // The online subscribers (NULL if none)
+};
+
+/**
+ * @brief A change of the subscriber list of a topic that is not published yet
+ * (see Database::publish_lists): a socket is added, with the options of its
+ * subscription (the limit is NULL if it has none), or removed
+ */
+struct list_change {
+    bool add;
+    limited_subscriber sub;
+};
+
+/**
+ * @brief A topic owned by another shard, that users of this shard are
+ * subscribed to
+ */
+struct remote_topic {
+    std::string name;
+    uint subscribers;  // The number of users (of this shard) subscribed to it
+    long last_id;      // The last message received from its shard
+    const subscriber_list* online;  // The online subscribers (NULL if none)
+};
+
+/**
+ * @brief A subscription to the topics that match a pattern (see TopicTrie).
+ * Every shard keeps the patterns of all the clients, so the topics it owns
+ * (also the ones added later) are subscribed to by the shard of the client
+ */
+struct wildcard_subscription {
+    std::string pattern;
+    std::string user;
+    uint shard;  // The shard of the user
+    bool sf;
+    bint options;
+    content_filter filter;
+    rate_limit limit;
+};
+
 /**
  * @brief This class manages the Database of the application
  * Users (CLIENT_ID's) and their data, topic data, and some other data used by
@@ -36,8 +92,38 @@ namespace application {
 class Database {
    private:
     std::map<std::string, User> userList;
-    std::map<uint, Topic> topics;
-    uint max_topic_id;
+
+    /**
+     * @brief The topics. The id of a topic is its index in "topics", and the
+     * ids are assigned in order, so a lookup is a single array index. The
+     * topics themselves are stored in a deque, so they never move (the
+     * references to them remain valid when new topics are added).
+     * When the server is sharded, each shard has its own database, and the
+     * id of a topic is "index * shard_count + shard" (the ids are unique, and
+     * the shard that owns a topic is known from its id).
+     */
+    std::vector<topic_entry> topics;
+    std::deque<Topic> topic_data;
+    std::unordered_map<std::string, uint> topic_ids;  // Name to id
+    uint shard, shard_count;
+
+    // The topics of other shards (by id), and the users of other shards that
+    // are subscribed to the topics of this one (by topic id and shard)
+    std::unordered_map<uint, remote_topic> remote_topics;
+    std::unordered_map<lint, uint> shard_subscribers;
+
+    /**
+     * @brief The subscriber lists are copied when they change, and the old
+     * ones are freed when the threads that send the messages are done with
+     * them. The changes are kept (by topic, and socket) until the list is
+     * needed, or the end of the loop iteration, so many changes of a list
+     * (a reconnect storm) copy it once. A subscription is paused while its
+     * user waits for the messages it has missed (replayed by another shard),
+     * so the new ones are sent after them.
+     */
+    EpochReclaimer<subscriber_list> lists;
+    std::unordered_map<uint, std::vector<list_change>> changes;
+    std::set<std::pair<std::string, uint>> paused;  // User id, topic id
 
     /**
      * @brief When a new connections is established, the server must wait the
@@ -46,15 +132,193 @@ class Database {
      */
     std::map<uint, sockaddr_in> reservedAdresses;
 
+    // Used by the topics to write their files (if any)
+    LogWriter* writer;
+
+    /**
+     * @brief The names of the topics of this shard, and the wildcard
+     * subscriptions (by id), with their patterns, so the topics that match a
+     * pattern, and the patterns that match a topic, are found by walking the
+     * levels of the name
+     */
+    TopicTrie topic_index;
+    TopicTrie pattern_index;
+    std::unordered_map<uint, wildcard_subscription> wildcards;
+    uint next_wildcard;
+
+    /**
+     * @brief Get the index of a topic of this shard (see "topics")
+     */
+    uint index(const uint id) const { return id / shard_count; }
+
+    /**
+     * @brief Get the subscriber list of a topic (of this shard, or a remote
+     * one)
+     * @param id The id of the topic
+     * @return const subscriber_list** Where the list is stored (NULL if the
+     * topic doesn't exist)
+     */
+    const subscriber_list** list_of(const uint id) {
+        if (topic_exists(id)) {
+            return &topics[index(id)].online;
+        }
+        auto it = remote_topics.find(id);
+        return it != remote_topics.end() ? &it->second.online : NULL;
+    }
+
+    /**
+     * @brief Change the subscriber list of a topic: the socket of a user is
+     * added or removed. The change is published later (see publish_lists)
+     * @param id The id of the topic
+     * @param user The user (subscribed to the topic)
+     * @param add If the socket is added, or removed
+     */
+    void update_list(const uint id, User& user, const bool add) {
+        if (list_of(id) == NULL) {
+            return;
+        }
+
+        changes[id].push_back(list_change{
+            add, limited_subscriber{user.get_socket(), user.is_conflated(id),
+                                    user.get_filter(id), user.get_limit(id)}});
+    }
+
+    /**
+     * @brief Publish a new subscriber list for a topic, with its changes (the
+     * current list is not changed, it is replaced)
+     * @param id The id of the topic
+     * @param pending The changes, in order
+     */
+    void publish_list(const uint id, const std::vector<list_change>& pending) {
+        const subscriber_list** slot = list_of(id);
+        if (slot == NULL) {
+            return;
+        }
+
+        // The sockets that changed are removed, then added again (in order),
+        // if their last change is an add
+        std::unordered_map<uint, size_t> changed;  // Socket to its last change
+        for (size_t i = 0; i < pending.size(); ++i) {
+            changed[pending[i].sub.sockfd] = i;
+        }
+
+        subscriber_list* list = new subscriber_list();
+        if (*slot != NULL) {
+            copy_without((*slot)->sockets, changed, list->sockets);
+            copy_without((*slot)->conflated, changed, list->conflated);
+            for (const filter_group& group : (*slot)->filtered) {
+                filter_group copy{group.filter, {}, {}};
+                copy_without(group.sockets, changed, copy.sockets);
+                copy_without(group.conflated, changed, copy.conflated);
+                if (!copy.sockets.empty() || !copy.conflated.empty()) {
+                    list->filtered.push_back(std::move(copy));
+                }
+            }
+            for (const limited_subscriber& other : (*slot)->limited) {
+                if (changed.count(other.sockfd) == 0) {
+                    list->limited.push_back(other);
+                }
+            }
+        }
+
+        for (size_t i = 0; i < pending.size(); ++i) {
+            const limited_subscriber& sub = pending[i].sub;
+            if (!pending[i].add || changed[sub.sockfd] != i) {
+                continue;
+            }
+            if (sub.limit != NULL) {
+                // Checked for every message, with its filter
+                list->limited.push_back(sub);
+                continue;
+            }
+
+            std::vector<uint>* sockets = &list->sockets;
+            std::vector<uint>* conflated = &list->conflated;
+            if (sub.filter != NULL) {
+                // With the subscribers that have the same filter
+                auto it = std::find_if(
+                    list->filtered.begin(), list->filtered.end(),
+                    [&](const filter_group& g) {
+                        return g.filter == *sub.filter;
+                    });
+                if (it == list->filtered.end()) {
+                    list->filtered.push_back(filter_group{*sub.filter, {}, {}});
+                    it = list->filtered.end() - 1;
+                }
+                sockets = &it->sockets;
+                conflated = &it->conflated;
+            }
+            (sub.conflated ? conflated : sockets)->push_back(sub.sockfd);
+        }
+        if (list->sockets.empty() && list->conflated.empty() &&
+            list->filtered.empty() && list->limited.empty()) {
+            delete list;
+            list = NULL;
+        }
+
+        const subscriber_list* old = *slot;
+        *slot = list;
+        lists.retire(old);
+    }
+
+    /**
+     * @brief Copy a list of sockets, without the ones that changed
+     */
+    static void copy_without(const std::vector<uint>& from,
+                             const std::unordered_map<uint, size_t>& changed,
+                             std::vector<uint>& to) {
+        to.reserve(from.size() + changed.size());
+        for (uint other : from) {
+            if (changed.count(other) == 0) {
+                to.push_back(other);
+            }
+        }
+    }
+
+    /**
+     * @brief Checks if the messages of a subscription are not sent (while the
+     * missed ones are replayed)
+     */
+    bool is_paused(const User& user, const uint id) const {
+        return !paused.empty() &&
+               paused.count(std::make_pair(user.get_id(), id)) != 0;
+    }
+
    public:
     /**
-     * @brief Default constructor
+     * @brief Construct a new database
+     * @param shard The shard that uses it (if the server is sharded)
+     * @param shard_count The number of shards
      */
-    Database()
+    explicit Database(const uint shard = 0, const uint shard_count = 1)
         : userList(std::map<std::string, User>()),
-          topics(std::map<uint, Topic>()),
-          max_topic_id(0),
-          reservedAdresses(std::map<uint, sockaddr_in>()) {}
+          topics(std::vector<topic_entry>()),
+          topic_data(std::deque<Topic>()),
+          topic_ids(std::unordered_map<std::string, uint>()),
+          shard(shard),
+          shard_count(shard_count),
+          reservedAdresses(std::map<uint, sockaddr_in>()),
+          writer(NULL),
+          next_wildcard(0) {}
+
+    Database(const Database& other) = delete;
+    Database& operator=(const Database& other) = delete;
+
+    ~Database() {
+        for (auto& entry : topics) {
+            delete entry.online;
+        }
+        for (auto& i : remote_topics) {
+            delete i.second.online;
+        }
+    }
+
+    /**
+     * @brief Set the writer the topics will use to write their files (the
+     * io_uring engine or the pipeline)
+     * @param log_writer The writer (NULL for normal I/O)
+     */
+    void set_writer(LogWriter* log_writer) { writer = log_writer; }
 
     /**
      * @brief Add a new user to the database
@@ -76,28 +340,30 @@ class Database {
     }
 
     /**
-     * @brief Returns the user with the specified socket (!check if user_exists
-     * before!)
+     * @brief Returns the online user with the specified socket (!check if
+     * user_exists before!)
      * @param sockfd The socket
      * @return User& The user
      */
     User& get_user(const uint sockfd) {
+        // An offline user can have the same (old) socket
         auto it = std::find_if(userList.begin(), userList.end(),
                                [&sockfd](auto&& pair) {
-                                   return pair.second.get_socket() == sockfd;
+                                   return pair.second.get_socket() == sockfd &&
+                                          pair.second.is_online();
                                });
 
         return it->second;
     }
 
     /**
-     * @brief Get a vector with all users
-     * @return std::vector<User&> All users
+     * @brief Get a vector with all users (the users are not copied)
+     * @return std::vector<User*> All users
      */
-    std::vector<User> get_users() {
-        std::vector<User> v;
-        for (auto i : userList) {
-            v.push_back(i.second);
+    std::vector<User*> get_users() {
+        std::vector<User*> v;
+        for (auto& i : userList) {
+            v.push_back(&i.second);
         }
         return v;
     }
@@ -105,13 +371,13 @@ class Database {
     /**
      * @brief Get a vector with all online users
      *
-     * @return std::vector<User> The online users
+     * @return std::vector<User*> The online users
      */
-    std::vector<User> get_online_users() {
-        std::vector<User> v;
-        for (auto i : userList) {
+    std::vector<User*> get_online_users() {
+        std::vector<User*> v;
+        for (auto& i : userList) {
             if (i.second.is_online()) {
-                v.push_back(i.second);
+                v.push_back(&i.second);
             }
         }
         return v;
@@ -120,13 +386,13 @@ class Database {
     /**
      * @brief Get a vector with all users subscribed to the specified topic
      * @param topic The topic
-     * @return std::vector<User> The subscribed users
+     * @return std::vector<User*> The subscribed users
      */
-    std::vector<User> get_subscribed_users(const uint topic) {
-        std::vector<User> v;
-        for (auto i : userList) {
+    std::vector<User*> get_subscribed_users(const uint topic) {
+        std::vector<User*> v;
+        for (auto& i : userList) {
             if (i.second.is_subscribed(topic)) {
-                v.push_back(i.second);
+                v.push_back(&i.second);
             }
         }
         return v;
@@ -148,7 +414,9 @@ class Database {
     }
 
     /**
-     * @brief Check if a user with the specified socket exists
+     * @brief Check if an online user has the specified socket (an offline user
+     * can have the same old socket, and a client that hasn't connected has
+     * none)
      * @param sockfd The socket of the user
      * @return true The user exists
      * @return false The user doesn't exist
@@ -156,7 +424,8 @@ class Database {
     bool user_exists(const uint sockfd) const {
         auto it = std::find_if(userList.begin(), userList.end(),
                                [&sockfd](auto&& pair) {
-                                   return pair.second.get_socket() == sockfd;
+                                   return pair.second.get_socket() == sockfd &&
+                                          pair.second.is_online();
                                });
         if (it != userList.end()) {
             return true;
@@ -172,10 +441,82 @@ class Database {
      */
     void user_disconnect(const uint sockfd) {
         for (auto& i : userList) {
-            if (i.second.get_socket() == sockfd) {
-                i.second.disconnect();
+            User& user = i.second;
+            if (user.get_socket() != sockfd || !user.is_online()) {
+                continue;
+            }
+
+            // The user has received every message of its topics, until now
+            // (the messages of a paused subscription are sent by the replay,
+            // and the acknowledged ones are known from the client)
+            for (const subscription& s : user.get_subscriptions()) {
+                if (!is_paused(user, s.topic)) {
+                    if (!(s.options & SUB_ACK)) {
+                        user.sent_message_set(s.topic, last_known_id(s.topic));
+                    }
+                    update_list(s.topic, user, false);
+                }
+            }
+            user.disconnect();
+        }
+    }
+
+    /**
+     * @brief A user is online (a new connection, or it has reconnected). Its
+     * socket is added to the lists of the topics it is subscribed to
+     * @param user The user
+     */
+    void user_connect(User& user) {
+        for (const subscription& s : user.get_subscriptions()) {
+            if (!is_paused(user, s.topic)) {
+                update_list(s.topic, user, true);
+            }
+        }
+    }
+
+    /**
+     * @brief Get the id of the last message of a topic (the last one this
+     * shard knows about, for a remote topic)
+     */
+    long last_known_id(const uint id) const {
+        if (topic_exists(id)) {
+            return topics[index(id)].topic->get_last_id();
+        }
+        auto it = remote_topics.find(id);
+        return it != remote_topics.end() ? it->second.last_id : -1;
+    }
+
+    /**
+     * @brief Get the number of messages an offline user has missed on its
+     * store-forward subscriptions (the messages of an online user are sent
+     * as they are received)
+     * @param user The user
+     * @return std::pair<lint, lint> The number of messages, and how many of
+     * them are within the limits and will be sent when it reconnects (without
+     * SF_MAX_BYTES, and only SF_MAX_MESSAGES for the topics of other shards)
+     */
+    std::pair<lint, lint> get_backlog(const User& user) const {
+        lint missed = 0, kept = 0;
+        if (user.is_online()) {
+            return std::make_pair(missed, kept);
+        }
+
+        for (const subscription& s : user.get_subscriptions()) {
+            long last = last_known_id(s.topic);
+            long first = (long)s.next_id;
+            if (!s.sf || first > last) {
+                continue;
+            }
+            missed += last + 1 - first;
+            if (topic_exists(s.topic)) {
+                first = topics[index(s.topic)].topic->get_backlog_start(
+                    first - 1);
+            } else if (SF_MAX_MESSAGES > 0) {
+                first = std::max(first, last + 1 - (long)SF_MAX_MESSAGES);
             }
+            kept += last + 1 - std::min(first, last + 1);
         }
+        return std::make_pair(missed, kept);
     }
 
     /**
@@ -208,38 +549,57 @@ class Database {
         }
     }
 
+    /**
+     * @brief Forget the data reserved for a socket (the client was closed
+     * before it sent its id)
+     * @param sockfd The socket
+     */
+    void release_adress(const uint sockfd) { reservedAdresses.erase(sockfd); }
+
     /**
      * @brief Return the id's of all existing topics
      * @return std::vector<uint> The vector of id's
      */
     std::vector<uint> get_topics() {
-        std::vector<uint> v;
-        for (auto& i : topics) {
-            v.push_back(i.first);
+        std::vector<uint> v(topics.size());
+        for (uint i = 0; i < v.size(); ++i) {
+            v[i] = i * shard_count + shard;
         }
         return v;
     }
 
     /**
-     * @brief Get the topic with the specified id
+     * @brief Checks if a topic with the specified id exists
+     * @param id The id
+     * @return true The topic exists
+     * @return false The topic doesn't exist
+     */
+    bool topic_exists(const uint id) const {
+        return id % shard_count == shard && index(id) < topics.size();
+    }
+
+    /**
+     * @brief Get the topic with the specified id (!check if topic_exists
+     * before!)
      * @param id The id
      * @return Topic& The topic
      */
-    Topic& get_topic(const uint id) { return topics[id]; }
+    Topic& get_topic(const uint id) { return *topics[index(id)].topic; }
 
     /**
-     * @brief Return the name of a topic
+     * @brief Return the name of a topic (of this shard, or a remote one)
      * @param id The id of the topic
      * @return std::string The name of the topic
      */
     std::string get_topic_name(uint id) {
-        auto it = topics.find(id);
-
-        if (it == topics.end()) {
-            return " ";
-        } else {
-            return it->second.get_name();
+        if (topic_exists(id)) {
+            return topics[index(id)].topic->get_name();
         }
+        auto it = remote_topics.find(id);
+        if (it != remote_topics.end()) {
+            return it->second.name;
+        }
+        return " ";
     }
 
     /**
@@ -248,14 +608,251 @@ class Database {
      * @return uint The id of the topic
      */
     int get_topic_id(const std::string& name) {
-        auto it = std::find_if(
-            topics.begin(), topics.end(),
-            [&name](auto&& pair) { return pair.second.get_name() == name; });
+        auto it = topic_ids.find(name);
 
-        if (it == topics.end()) {
+        if (it == topic_ids.end()) {
             return -1;
         }
-        return it->first;
+        return it->second;
+    }
+
+    /**
+     * @brief Get the online users subscribed to a topic (the list is valid
+     * until the readers have finished the epoch taken after this, see
+     * next_list_epoch)
+     * @param id The id of the topic
+     * @return const subscriber_list* The list (NULL if there are none)
+     */
+    const subscriber_list* get_subscriber_list(const uint id) {
+        auto it = changes.find(id);
+        if (it != changes.end()) {
+            publish_list(id, it->second);
+            changes.erase(it);
+        }
+
+        const subscriber_list** slot = list_of(id);
+        return slot != NULL ? *slot : NULL;
+    }
+
+    /**
+     * @brief Publish the subscriber lists that have changed since they were
+     * last published (once per loop iteration)
+     */
+    void publish_lists() {
+        for (auto& i : changes) {
+            publish_list(i.first, i.second);
+        }
+        changes.clear();
+    }
+
+    /**
+     * @brief Take the epoch for a subscriber list that is given to another
+     * thread (see EpochReclaimer)
+     * @return lint The epoch
+     */
+    lint next_list_epoch() { return lists.next_epoch(); }
+
+    /**
+     * @brief Add a thread that reads the subscriber lists
+     * @param finished The epoch of the last list it has finished
+     */
+    void add_list_reader(const std::atomic<lint>* finished) {
+        lists.add_reader(finished);
+    }
+
+    /**
+     * @brief Get the number of old subscriber lists that are not freed yet
+     */
+    size_t get_retired_lists() const { return lists.pending(); }
+
+    /**
+     * @brief Get the number of users subscribed to a topic
+     * @param id The id of the topic
+     * @return uint The number of subscribers
+     */
+    uint get_subscriber_count(const uint id) const {
+        if (topic_exists(id)) {
+            return topics[index(id)].subscribers;
+        }
+        auto it = remote_topics.find(id);
+        return it != remote_topics.end() ? it->second.subscribers : 0;
+    }
+
+    /**
+     * @brief Subscribe a user to a topic (see User::subscribe)
+     * @param user The user
+     * @param id The id of the topic
+     * @param store If the user will receive the messages sent while he is
+     * offline
+     * @param options The other options of the subscription
+     * @param filter The filter of the messages (if options has SUB_FILTER)
+     * @param limit The rate of the messages (if options has SUB_LIMIT)
+     */
+    void subscribe(User& user, const uint id, const bool store,
+                   const bint options = 0, const content_filter* filter = NULL,
+                   const rate_limit* limit = NULL) {
+        if (topic_exists(id) && !user.is_subscribed(id)) {
+            topic_entry& entry = topics[index(id)];
+            user.subscribe(id, store, entry.topic->get_last_id(), options,
+                           filter, limit);
+            entry.subscribers++;
+            if (user.is_online()) {
+                update_list(id, user, true);
+            }
+        }
+    }
+
+    /**
+     * @brief Subscribe a user to a topic of another shard
+     * @param user The user
+     * @param id The id of the topic
+     * @param store If the user will receive the messages sent while he is
+     * offline
+     * @param last_id The id of the last message on the topic
+     * @param options The other options of the subscription
+     * @param filter The filter of the messages (if options has SUB_FILTER)
+     * @param limit The rate of the messages (if options has SUB_LIMIT)
+     * @return true The user was subscribed
+     * @return false The user was already subscribed
+     */
+    bool subscribe_remote(User& user, const uint id, const bool store,
+                          const long last_id, const bint options = 0,
+                          const content_filter* filter = NULL,
+                          const rate_limit* limit = NULL) {
+        auto it = remote_topics.find(id);
+        if (it == remote_topics.end() || user.is_subscribed(id)) {
+            return false;
+        }
+        user.subscribe(id, store, last_id, options, filter, limit);
+        it->second.subscribers++;
+        if (user.is_online()) {
+            update_list(id, user, true);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Unsubscribe a user from a topic (of this shard, or a remote one)
+     * @param user The user
+     * @param id The id of the topic
+     * @return true The user was subscribed
+     * @return false The user wasn't subscribed
+     */
+    bool unsubscribe(User& user, const uint id) {
+        if (!user.is_subscribed(id)) {
+            return false;
+        }
+
+        if (topic_exists(id)) {
+            topics[index(id)].subscribers--;
+        } else {
+            auto it = remote_topics.find(id);
+            if (it == remote_topics.end()) {
+                return false;
+            }
+            it->second.subscribers--;
+        }
+        if (user.is_online() && !is_paused(user, id)) {
+            update_list(id, user, false);
+        }
+        paused.erase(std::make_pair(user.get_id(), id));
+        user.unsubcribe(id);
+        return true;
+    }
+
+    /**
+     * @brief Add a topic of another shard (its users can subscribe to it)
+     * @param id The id of the topic
+     * @param name The name of the topic
+     * @param last_id The id of the last message on the topic
+     */
+    void add_remote_topic(const uint id, const std::string& name,
+                          const long last_id) {
+        auto res = remote_topics.insert(
+            std::make_pair(id, remote_topic{name, 0, last_id, NULL}));
+        if (res.second) {
+            topic_ids.insert(std::make_pair(name, id));
+        }
+        remote_message(id, last_id);
+    }
+
+    /**
+     * @brief A message was received from the shard of a remote topic
+     * @param id The id of the topic
+     * @param msg_id The id of the message
+     */
+    void remote_message(const uint id, const long msg_id) {
+        auto it = remote_topics.find(id);
+        if (it != remote_topics.end() && it->second.last_id < msg_id) {
+            it->second.last_id = msg_id;
+        }
+    }
+
+    /**
+     * @brief Stop sending the messages of a topic to a user, until
+     * resume_subscription is called
+     * @param user The user
+     * @param id The id of the topic
+     */
+    void pause_subscription(User& user, const uint id) {
+        if (paused.insert(std::make_pair(user.get_id(), id)).second &&
+            user.is_online() && user.is_subscribed(id)) {
+            update_list(id, user, false);
+        }
+    }
+
+    /**
+     * @brief Send the messages of a topic to a user again
+     * @param user_id The id of the user
+     * @param id The id of the topic
+     */
+    void resume_subscription(const std::string& user_id, const uint id) {
+        if (paused.erase(std::make_pair(user_id, id)) == 0 ||
+            !user_exists(user_id)) {
+            return;
+        }
+        User& user = get_user(user_id);
+        if (user.is_online() && user.is_subscribed(id)) {
+            update_list(id, user, true);
+        }
+    }
+
+    /**
+     * @brief Another shard has a new user subscribed to a topic of this shard
+     * @param id The id of the topic
+     * @param from The other shard
+     */
+    void add_shard_subscriber(const uint id, const uint from) {
+        if (topic_exists(id)) {
+            shard_subscribers[(lint)id * MAX_SHARDS + from]++;
+            topics[index(id)].shards |= (lint)1 << from;
+        }
+    }
+
+    /**
+     * @brief Another shard has one less user subscribed to a topic of this
+     * shard
+     * @param id The id of the topic
+     * @param from The other shard
+     */
+    void remove_shard_subscriber(const uint id, const uint from) {
+        auto it = shard_subscribers.find((lint)id * MAX_SHARDS + from);
+        if (!topic_exists(id) || it == shard_subscribers.end()) {
+            return;
+        }
+        if (--it->second == 0) {
+            shard_subscribers.erase(it);
+            topics[index(id)].shards &= ~((lint)1 << from);
+        }
+    }
+
+    /**
+     * @brief Get the other shards that have users subscribed to a topic
+     * @param id The id of the topic
+     * @return lint The shards (bit mask)
+     */
+    lint get_subscribed_shards(const uint id) const {
+        return topic_exists(id) ? topics[index(id)].shards : 0;
     }
 
     /**
@@ -264,9 +861,8 @@ class Database {
      * @param message The message
      */
     void topic_new_message(uint id, std::string message) {
-        auto it = topics.find(id);
-        if (it != topics.end()) {
-            it->second.add_message(message);
+        if (topic_exists(id)) {
+            topics[index(id)].topic->add_message(message);
         }
     }
 
@@ -274,25 +870,112 @@ class Database {
      * @brief Save all the topics messages from memory to the files
      */
     void save_topics() {
-        for (auto& i : topics) {
-            i.second.save();
+        for (auto& topic : topic_data) {
+            topic.save();
         }
     }
 
     /**
      * @brief Add a new topic to the list
-     * @param name The name of the topic
+     * @param name The name of the topic (owned by this shard)
      * The id is automatically assigned
-     * @return int The id of the new topic
+     * @return int The id of the topic (the existing one, if there is a topic
+     * with this name already)
      */
     uint add_topic(const std::string& name) {
-        // If the topic doesn't exist already
-        if (get_topic_id(name) == -1) {
-            topics.insert(
-                std::make_pair(max_topic_id, Topic(max_topic_id, name)));
-            max_topic_id++;
+        auto it = topic_ids.find(name);
+        if (it != topic_ids.end()) {
+            return it->second;
+        }
+
+        uint id = topics.size() * shard_count + shard;
+        topic_data.emplace_back(id, name, writer);
+        topics.push_back({&topic_data.back(), 0, 0, NULL});
+        topic_ids.insert(std::make_pair(name, id));
+        topic_index.insert(name, id);
+        return id;
+    }
+
+    /**
+     * @brief Get an id for a new wildcard subscription of a user of this shard
+     * (unique across the shards, and never the id of a topic)
+     */
+    uint next_wildcard_id() {
+        return WILDCARD_ID | (next_wildcard++ * shard_count + shard);
+    }
+
+    /**
+     * @brief Add a wildcard subscription
+     * @param id The id of the subscription
+     * @param wildcard The subscription
+     */
+    void add_wildcard(const uint id, const wildcard_subscription& wildcard) {
+        if (wildcards.insert(std::make_pair(id, wildcard)).second) {
+            pattern_index.insert(wildcard.pattern, id);
+        }
+    }
+
+    /**
+     * @brief Remove a wildcard subscription (the subscriptions to the topics
+     * it has matched are not changed)
+     * @param id The id of the subscription
+     */
+    void remove_wildcard(const uint id) {
+        auto it = wildcards.find(id);
+        if (it != wildcards.end()) {
+            pattern_index.erase(it->second.pattern, id);
+            wildcards.erase(it);
+        }
+    }
+
+    /**
+     * @brief Get a wildcard subscription
+     * @param id The id of the subscription
+     * @return const wildcard_subscription* The subscription (NULL if it
+     * doesn't exist)
+     */
+    const wildcard_subscription* get_wildcard(const uint id) const {
+        auto it = wildcards.find(id);
+        return it != wildcards.end() ? &it->second : NULL;
+    }
+
+    /**
+     * @brief Get the wildcard subscriptions of a user (by id)
+     * @param user The id of the user
+     */
+    std::vector<std::pair<uint, const wildcard_subscription*>> get_wildcards(
+        const std::string& user) const {
+        std::vector<std::pair<uint, const wildcard_subscription*>> found;
+        for (auto& i : wildcards) {
+            if (i.second.user == user) {
+                found.push_back(std::make_pair(i.first, &i.second));
+            }
+        }
+        return found;
+    }
+
+    /**
+     * @brief Get the topics of this shard that match a pattern
+     * @param pattern The pattern
+     * @return std::vector<uint> The ids of the topics
+     */
+    std::vector<uint> match_topics(const std::string& pattern) const {
+        std::vector<uint> ids;
+        topic_index.find_matching(pattern, ids);
+        return ids;
+    }
+
+    /**
+     * @brief Get the wildcard subscriptions that match a topic
+     * @param name The name of the topic
+     * @return std::vector<uint> The ids of the subscriptions
+     */
+    std::vector<uint> match_wildcards(const std::string& name) const {
+        std::vector<uint> ids;
+        if (!wildcards.empty()) {
+            pattern_index.find_patterns(name, ids);
         }
-        return max_topic_id - 1;
+        return ids;
     }
 };
 }  // namespace application
\ No newline at end of file
@@ -0,0 +1,316 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <thread>
+
+#include "SpscRing.hpp"
+#include "Utils.hpp"
+
+#define FANOUT_INLINE_LIMIT 512  // Smaller subscriber lists are sent inline
+#define FANOUT_CHUNK 64          // The number of sockets in a chunk
+
+namespace application {
+/**
+ * @brief A part of the subscriber list of a message (indexes in the list)
+ */
+struct fanout_chunk {
+    uint begin, end;
+};
+
+/**
+ * @brief A socket that could not take the whole message, and how much of it
+ * was sent
+ */
+struct fanout_unsent {
+    uint sockfd;
+    size_t sent;
+};
+
+/**
+ * @brief The chunks that belong to a thread. The range of chunks that were
+ * not sent yet is packed in a single word (first | end << 32): the owner
+ * takes chunks from the front, the other threads steal them from the back.
+ */
+struct alignas(CACHE_LINE) fanout_queue {
+    std::atomic<lint> range;
+    std::vector<fanout_chunk> chunks;
+    std::vector<fanout_unsent> unsent;  // Written by the thread that owns it
+    Doorbell bell;
+
+    fanout_queue() : range(0) {}
+};
+
+/**
+ * @brief Sends a message to a big list of sockets, using multiple threads
+ * Every thread owns the sockets with "sockfd % threads == index" (the thread
+ * that calls "send" is index 0). Their sockets are split into chunks, and when
+ * a thread has sent all of its chunks, it steals chunks from the others. The
+ * sockets are never waited for: what a socket can't take now is returned to
+ * the caller, that keeps it. "send" returns after all the chunks were sent, so
+ * messages are sent one after another, in order.
+ */
+class FanoutPool {
+   private:
+    uint thread_count;
+    std::vector<fanout_queue> queues;
+    std::vector<std::thread> threads;
+    std::atomic<bool> running;
+
+    // The message that is sent now
+    const std::string *frame;
+    std::vector<uint> sockets;
+    std::atomic<uint> generation, pending;
+
+    // Statistics
+    std::atomic<lint> messages, chunks_stolen;
+
+    static lint pack(const uint first, const uint end) {
+        return (lint)first | ((lint)end << 32);
+    }
+
+    /**
+     * @brief Take a chunk from the front (owner) or the back (other threads)
+     * @param queue The queue
+     * @param chunk Will contain the chunk
+     * @param steal If the chunk is taken from the back
+     * @return true A chunk was taken
+     * @return false The queue is empty
+     */
+    static bool take(fanout_queue &queue, fanout_chunk &chunk,
+                     const bool steal) {
+        lint range = queue.range.load(std::memory_order_acquire);
+        FOREVER {
+            uint first = range & 0xffffffff, end = range >> 32;
+            if (first >= end) {
+                return false;
+            }
+
+            lint next = steal ? pack(first, end - 1) : pack(first + 1, end);
+            if (queue.range.compare_exchange_weak(range, next,
+                                                  std::memory_order_acq_rel)) {
+                chunk = queue.chunks[steal ? end - 1 : first];
+                return true;
+            }
+        }
+    }
+
+    /**
+     * @brief Send the chunks of a thread, then steal from the others
+     * @param index The index of the thread
+     */
+    void work(const uint index) {
+        fanout_chunk chunk;
+        while (take(queues[index], chunk, false)) {
+            send_chunk(chunk, queues[index].unsent);
+        }
+
+        for (uint i = 1; i < thread_count; ++i) {
+            fanout_queue &victim = queues[(index + i) % thread_count];
+            while (take(victim, chunk, true)) {
+                send_chunk(chunk, queues[index].unsent);
+                chunks_stolen.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void send_chunk(const fanout_chunk &chunk,
+                    std::vector<fanout_unsent> &unsent) {
+        for (uint i = chunk.begin; i < chunk.end; ++i) {
+            size_t sent = send_some(sockets[i], frame->data(), frame->size());
+            if (sent < frame->size()) {
+                unsent.push_back({sockets[i], sent});
+            }
+        }
+        pending.fetch_sub(1, std::memory_order_acq_rel);
+    }
+
+    void worker_loop(const uint index) {
+        uint seen = 0;
+        while (running.load(std::memory_order_acquire)) {
+            queues[index].bell.wait([&] {
+                return generation.load(std::memory_order_acquire) != seen ||
+                       !running.load(std::memory_order_acquire);
+            });
+
+            uint current = generation.load(std::memory_order_acquire);
+            if (current != seen) {
+                seen = current;
+                work(index);
+            }
+        }
+    }
+
+   public:
+    FanoutPool()
+        : thread_count(1),
+          queues(1),
+          running(false),
+          frame(NULL),
+          generation(0),
+          pending(0),
+          messages(0),
+          chunks_stolen(0) {}
+
+    FanoutPool(const FanoutPool &other) = delete;
+    FanoutPool &operator=(const FanoutPool &other) = delete;
+
+    ~FanoutPool() { stop(); }
+
+    /**
+     * @brief Send as much data as a socket can take now, without waiting
+     * @param sockfd The socket
+     * @param data The data
+     * @param len The size of the data
+     * @return size_t The number of bytes that were sent (all of them if the
+     * socket is broken, nothing more can be sent on it)
+     */
+    static size_t send_some(const uint sockfd, const char *data,
+                            const size_t len) {
+        size_t sent = 0;
+        while (sent < len) {
+            ssize_t res = ::send(sockfd, data + sent, len - sent,
+                                 MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            CERR(res < 0);
+            if (res < 0) {
+                return len;
+            }
+            sent += res;
+        }
+        return sent;
+    }
+
+    /**
+     * @brief Start the sender threads
+     * @param count The number of threads (besides the one calling "send")
+     */
+    void start(const uint count) {
+        if (is_active() || count == 0) {
+            return;
+        }
+
+        thread_count = count + 1;
+        queues = std::vector<fanout_queue>(thread_count);
+        running.store(true, std::memory_order_release);
+        for (uint i = 1; i < thread_count; ++i) {
+            threads.emplace_back(&FanoutPool::worker_loop, this, i);
+        }
+    }
+
+    void stop() {
+        if (!is_active()) {
+            return;
+        }
+
+        running.store(false, std::memory_order_release);
+        for (uint i = 1; i < thread_count; ++i) {
+            queues[i].bell.ring();
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+        threads.clear();
+    }
+
+    bool is_active() const { return !threads.empty(); }
+
+    /**
+     * @brief Send a message to all the sockets (returns after it was sent)
+     * @param data The message
+     * @param list The sockets
+     * @param unsent Will contain the sockets that could not take all of it
+     */
+    void send(const std::string &data, const std::vector<uint> &list,
+              std::vector<fanout_unsent> &unsent) {
+        // Group the sockets by the thread that owns them
+        sockets.resize(list.size());
+        std::vector<uint> offset(thread_count + 1, 0);
+        for (uint sockfd : list) {
+            offset[sockfd % thread_count + 1]++;
+        }
+        for (uint i = 1; i <= thread_count; ++i) {
+            offset[i] += offset[i - 1];
+        }
+        std::vector<uint> position(offset.begin(), offset.end() - 1);
+        for (uint sockfd : list) {
+            sockets[position[sockfd % thread_count]++] = sockfd;
+        }
+
+        // Split the sockets of every thread into chunks
+        uint total = 0;
+        for (uint i = 0; i < thread_count; ++i) {
+            std::vector<fanout_chunk> &chunks = queues[i].chunks;
+            chunks.clear();
+            queues[i].unsent.clear();
+            for (uint s = offset[i]; s < offset[i + 1]; s += FANOUT_CHUNK) {
+                uint end = std::min(s + FANOUT_CHUNK, offset[i + 1]);
+                chunks.push_back({s, end});
+            }
+            total += chunks.size();
+        }
+
+        frame = &data;
+        pending.store(total, std::memory_order_release);
+        for (uint i = 0; i < thread_count; ++i) {
+            queues[i].range.store(pack(0, queues[i].chunks.size()),
+                                  std::memory_order_release);
+        }
+        generation.fetch_add(1, std::memory_order_acq_rel);
+        for (uint i = 1; i < thread_count; ++i) {
+            queues[i].bell.ring();
+        }
+
+        // This thread works too, then waits for the others
+        work(0);
+        while (pending.load(std::memory_order_acquire) != 0) {
+            std::this_thread::yield();
+        }
+        unsent.clear();
+        for (uint i = 0; i < thread_count; ++i) {
+            unsent.insert(unsent.end(), queues[i].unsent.begin(),
+                          queues[i].unsent.end());
+        }
+        messages.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Get the statistics of the pool
+     * @return std::string A line with the number of messages and the number of
+     * chunks that were stolen
+     */
+    std::string get_stats() const {
+        std::stringstream ss;
+        ss << "parallel fan-out: " << messages.load(std::memory_order_relaxed)
+           << " messages, " << thread_count << " threads, "
+           << chunks_stolen.load(std::memory_order_relaxed)
+           << " chunks stolen\n";
+        return ss.str();
+    }
+};
+}  // namespace application
\ No newline at end of file
@@ -22,14 +22,21 @@
 
 #pragma once
 
+#include <fcntl.h>     // openat
 #include <libgen.h>    // dirname, basename
 #include <sys/stat.h>  // mkdir
 #include <unistd.h>    // unlink, rmdir
 
 #include <experimental/filesystem>  // remove_all
+#include <list>
+#include <mutex>
 
+#include "LogWriter.hpp"
 #include "Utils.hpp"
 
+#define DATA_OPEN_FILES 64  // Files kept open for appends (the others are
+                            // closed, the least recently used first)
+
 namespace application {
 
 /**
@@ -56,7 +63,6 @@ class Filesystem {
     // that don't exist.
     void _createFolders(const std::string& _path) {
         struct stat st;
-        stat(_path.c_str(), &st);
         std::stack<std::string> paths;
 
         // Create a copy of the full path (must be done, as dirname
@@ -64,11 +70,11 @@ class Filesystem {
         char* path = (char*)malloc((_path.size() + 1) * sizeof(char));
         memcpy(path, _path.c_str(), (_path.size() + 1) * sizeof(char));
 
-        // Check if directory tree doesn't exist
-        while (!S_ISDIR(st.st_mode)) {
+        // Check if directory tree doesn't exist (st is not set when stat
+        // fails)
+        while (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
             paths.push(std::string(path));
             dirname(path);
-            stat(path, &st);
         }
         // We found a path that does exist
 
@@ -163,8 +169,9 @@ class Filesystem {
 
         if (_path.at(_path.size() - 1) != '/') {
             // If we may need to create directories, but definetely a file
+            // (an existing file is not truncated)
             _createFolders(dirname(path));
-            std::ofstream out{_path.c_str()};
+            std::ofstream out{_path.c_str(), std::ios_base::app};
         }
         free(path);
     }
@@ -237,4 +244,314 @@ class Filesystem {
         return _isValidPath(_path, true);
     }
 };
+/**
+ * @brief The folder where the topics are stored (DATABASE_FOLDER)
+ * The folder is opened once and the files are created relative to it (openat,
+ * mkdirat), so the paths are not resolved again for every file. The subfolders
+ * that were checked (or created) are remembered, and the last DATA_OPEN_FILES
+ * files that were used are kept open (the server would run out of file
+ * descriptors if every topic kept its file open). The names of the files that
+ * already exist are read once, at startup, so a new topic doesn't need any
+ * system call to find out it has no file.
+ */
+class DataFolder {
+   private:
+    /**
+     * @brief A file that is open for appends, and the writer that queues its
+     * appends (NULL if they are written directly)
+     */
+    struct open_file_entry {
+        int fd;
+        LogWriter* writer;
+        std::list<std::string>::iterator used;  // Its place in "recent"
+    };
+
+    int dir_fd;
+    std::unordered_set<std::string> folders;  // Checked subfolders
+    std::unordered_set<std::string> files;    // Existing files
+    std::unordered_map<std::string, open_file_entry> opened;
+    std::list<std::string> recent;  // The open files, most recently used first
+    mutable std::mutex lock;  // The shards of the server share the folder
+
+    // Read the existing files and folders
+    void _scan() {
+        using namespace std::experimental::filesystem;
+        const std::string root = DATABASE_FOLDER;
+        std::error_code ec;
+
+        for (recursive_directory_iterator it(root, ec), end; !ec && it != end;
+             it.increment(ec)) {
+            file_status st = it->symlink_status();
+            std::string name = it->path().string().substr(root.size());
+            if (is_directory(st)) {
+                folders.insert(name);
+            } else if (is_regular_file(st)) {
+                files.insert(name);
+            }
+        }
+    }
+
+    // Close a file, after its queued appends are written
+    void _closeFile(const open_file_entry& file) {
+        if (file.writer != NULL) {
+            file.writer->close_file(file.fd);
+        }
+        close(file.fd);
+    }
+
+    void _closeFiles() {
+        for (auto& i : opened) {
+            _closeFile(i.second);
+        }
+        opened.clear();
+        recent.clear();
+    }
+
+    // Create the folders of a file, if they don't exist. A folder must not be
+    // a symbolic link (so the file can't end up outside the data folder)
+    bool _createFolders(const std::string& name) {
+        for (size_t pos = name.find('/'); pos != std::string::npos;
+             pos = name.find('/', pos + 1)) {
+            std::string folder = name.substr(0, pos);
+            if (folders.count(folder) != 0) {
+                continue;
+            }
+
+            struct stat st;
+            if (fstatat(dir_fd, folder.c_str(), &st, AT_SYMLINK_NOFOLLOW) ==
+                0) {
+                if (!S_ISDIR(st.st_mode)) {
+                    return false;
+                }
+            } else if (mkdirat(dir_fd, folder.c_str(),
+                               S_IRWXU | S_IRWXG | S_IROTH) != 0 &&
+                       errno != EEXIST) {
+                return false;
+            }
+            folders.insert(folder);
+        }
+        return true;
+    }
+
+    // Open a file for appends (see open_file), the lock must be held
+    int _openFile(const std::string& name, LogWriter* writer) {
+        auto it = opened.find(name);
+        if (it != opened.end()) {
+            recent.splice(recent.begin(), recent, it->second.used);
+            it->second.writer = writer;
+            return it->second.fd;
+        }
+
+        if (!is_valid_name(name) || !_createFolders(name)) {
+            console_log("Invalid file name: " + name + "\n");
+            return -1;
+        }
+
+        // Not O_APPEND, the io_uring engine writes at explicit offsets
+        int fd = openat(dir_fd, name.c_str(),
+                        O_WRONLY | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0644);
+        if (fd < 0) {
+            console_log("Could not open " + name + ": " +
+                        std::strerror(errno) + "\n");
+            return -1;
+        }
+        lseek(fd, 0, SEEK_END);
+        files.insert(name);
+
+        if (opened.size() >= DATA_OPEN_FILES) {
+            auto oldest = opened.find(recent.back());
+            _closeFile(oldest->second);
+            opened.erase(oldest);
+            recent.pop_back();
+        }
+        recent.push_front(name);
+        opened.insert(
+            std::make_pair(name, open_file_entry{fd, writer, recent.begin()}));
+        return fd;
+    }
+
+   public:
+    DataFolder() {
+        Filesystem fs;
+        fs.createDirectory(DATABASE_FOLDER);
+        dir_fd = open(DATABASE_FOLDER, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        MUST(dir_fd >= 0, "Could not open the data folder\n");
+        _scan();
+    }
+
+    DataFolder(const DataFolder& other) = delete;
+    DataFolder& operator=(const DataFolder& other) = delete;
+
+    ~DataFolder() {
+        // The writers are stopped already, everything they queued is written
+        for (auto& i : opened) {
+            close(i.second.fd);
+        }
+        close(dir_fd);
+    }
+
+    /**
+     * @brief Get the data folder used by the application
+     * @return DataFolder& The instance
+     */
+    static DataFolder& get() {
+        static DataFolder instance;
+        return instance;
+    }
+
+    /**
+     * @brief Checks if a name can be used for a file in the data folder
+     * It must be relative and must not contain empty, "." or ".." folders
+     * @param name The name (path relative to the data folder)
+     * @return true The name is valid
+     * @return false The file would be outside the data folder
+     */
+    static bool is_valid_name(const std::string& name) {
+        if (name.empty() || name[0] == '/') {
+            return false;
+        }
+
+        size_t start = 0;
+        while (start <= name.size()) {
+            size_t end = std::min(name.find('/', start), name.size());
+            std::string part = name.substr(start, end - start);
+            if (part.empty() || part == "." || part == "..") {
+                return false;
+            }
+            start = end + 1;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Checks if a file exists (it existed when the server started, or
+     * it was created since then)
+     * @param name The name of the file
+     */
+    bool contains(const std::string& name) const {
+        std::lock_guard<std::mutex> guard(lock);
+        return files.count(name) != 0;
+    }
+
+    /**
+     * @brief Get the path of a file
+     * @param name The name of the file
+     * @return std::string The path
+     */
+    std::string get_path(const std::string& name) const {
+        return DATABASE_FOLDER + name;
+    }
+
+    /**
+     * @brief Open an existing file to read it (relative to the data folder)
+     * @param name The name of the file
+     * @return int The fd, that must be closed by the caller (-1 if the file
+     * can't be opened)
+     */
+    int open_read(const std::string& name) const {
+        if (!is_valid_name(name)) {
+            return -1;
+        }
+        return openat(dir_fd, name.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    }
+
+    /**
+     * @brief Get the status of a file (relative to the data folder)
+     * @param name The name of the file
+     * @param st Will contain the status
+     * @return true The file exists
+     * @return false It doesn't, or it can't be read
+     */
+    bool stat_file(const std::string& name, struct stat& st) const {
+        return is_valid_name(name) &&
+               fstatat(dir_fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0;
+    }
+
+    /**
+     * @brief Get a file descriptor to append to a file
+     * The file (and its folders) is created the first time it is needed. It
+     * is kept open until DATA_OPEN_FILES other files are used after it, so
+     * the fd must not be kept by the caller (the shards use append_file, a
+     * file can't be closed by another shard while they write it)
+     * @param name The name of the file
+     * @param writer The writer that will queue the appends (NULL if they are
+     * written directly), it finishes them before the file is closed
+     * @return int The fd, -1 if the file could not be opened
+     */
+    int open_file(const std::string& name, LogWriter* writer = NULL) {
+        std::lock_guard<std::mutex> guard(lock);
+        return _openFile(name, writer);
+    }
+
+    /**
+     * @brief Append data to a file (see open_file)
+     * @param name The name of the file
+     * @param data The data
+     * @return true The data was written
+     * @return false The file couldn't be opened, or written
+     */
+    bool append_file(const std::string& name, const std::string& data) {
+        std::lock_guard<std::mutex> guard(lock);
+        int fd = _openFile(name, NULL);
+        if (fd < 0) {
+            return false;
+        }
+
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t res =
+                write(fd, data.c_str() + written, data.size() - written);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            CERR(res < 0);
+            if (res < 0) {
+                return false;
+            }
+            written += res;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Get the number of files that are open for appends
+     */
+    size_t open_files() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return opened.size();
+    }
+
+    /**
+     * @brief Truncate an existing file
+     * @param name The name of the file
+     * @param size The new size
+     */
+    void truncate_file(const std::string& name, const off_t size) {
+        std::lock_guard<std::mutex> guard(lock);
+        int fd = openat(dir_fd, name.c_str(),
+                        O_WRONLY | O_CLOEXEC | O_NOFOLLOW);
+        CERR(fd < 0);
+        if (fd >= 0) {
+            CERR(ftruncate(fd, size) != 0);
+            close(fd);
+        }
+
+        auto it = opened.find(name);
+        if (it != opened.end()) {
+            lseek(it->second.fd, 0, SEEK_END);
+        }
+    }
+
+    /**
+     * @brief Close all files and read the data folder again (to be used after
+     * the folder was changed by something else)
+     */
+    void reload() {
+        std::lock_guard<std::mutex> guard(lock);
+        _closeFiles();
+        folders.clear();
+        files.clear();
+        _scan();
+    }
+};
 }  // namespace application
\ No newline at end of file
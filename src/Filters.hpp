@@ -0,0 +1,185 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "Utils.hpp"
+
+#define FILTER_PREFIX_SIZE 32  // The longest prefix of a STRING filter
+
+namespace application {
+/**
+ * @brief The types of content filters
+ * - FILTER_ABOVE / FILTER_BELOW: the number is greater / smaller than "low"
+ * - FILTER_INSIDE / FILTER_OUTSIDE: the number is in [low, high] / not in it
+ * - FILTER_PREFIX: the STRING starts with "prefix"
+ * The numeric filters match only INT, SHORT_REAL and FLOAT messages
+ */
+enum filter_op {
+    FILTER_NONE,
+    FILTER_ABOVE,
+    FILTER_BELOW,
+    FILTER_INSIDE,
+    FILTER_OUTSIDE,
+    FILTER_PREFIX
+};
+
+/**
+ * @brief The value of a message, decoded from its text
+ */
+struct message_value {
+    bint type;      // udp_msg_type
+    double number;  // The value of a INT, SHORT_REAL or FLOAT
+    size_t offset;  // Where the value starts in the text
+};
+
+/**
+ * @brief A predicate over the value of the messages of a subscription (sent
+ * with SUBSCRIBE). Only the messages that match it are sent
+ */
+struct content_filter {
+    bint op;  // filter_op
+    double low, high;
+    char prefix[FILTER_PREFIX_SIZE];
+
+    bool operator==(const content_filter &other) const {
+        return op == other.op && low == other.low && high == other.high &&
+               strncmp(prefix, other.prefix, FILTER_PREFIX_SIZE) == 0;
+    }
+
+    /**
+     * @brief Check if a message matches the filter
+     * @param value The decoded value of the message
+     * @param text The text of the message
+     */
+    bool matches(const message_value &value, const std::string &text) const {
+        if (op == FILTER_PREFIX) {
+            size_t size = strnlen(prefix, FILTER_PREFIX_SIZE);
+            return value.type == STRING &&
+                   text.compare(value.offset, size, prefix, size) == 0;
+        }
+        if (value.type == STRING) {
+            return op == FILTER_NONE;
+        }
+
+        switch (op) {
+            case FILTER_ABOVE:
+                return value.number > low;
+            case FILTER_BELOW:
+                return value.number < low;
+            case FILTER_INSIDE:
+                return value.number >= low && value.number <= high;
+            case FILTER_OUTSIDE:
+                return value.number < low || value.number > high;
+            default:
+                return true;
+        }
+    }
+
+    /**
+     * @brief Parse a filter, as it is written by the user: "gt:X", "lt:X",
+     * "in:A:B", "out:A:B" or "prefix:S"
+     * @param text The filter
+     * @param filter Will contain the filter
+     * @return true The filter is valid
+     * @return false The filter is invalid
+     */
+    static bool parse(const std::string &text, content_filter &filter) {
+        bzero(&filter, sizeof(filter));
+        size_t colon = text.find(':');
+        if (colon == std::string::npos) {
+            return false;
+        }
+        std::string name = text.substr(0, colon), args = text.substr(colon + 1);
+
+        if (name == "prefix") {
+            filter.op = FILTER_PREFIX;
+            safe_cpy(filter.prefix, args.c_str(),
+                     std::min(args.size(), (size_t)FILTER_PREFIX_SIZE - 1));
+            return !args.empty();
+        }
+
+        char *end;
+        filter.low = strtod(args.c_str(), &end);
+        if (end == args.c_str()) {
+            return false;
+        }
+        if (name == "gt" || name == "lt") {
+            filter.op = name == "gt" ? FILTER_ABOVE : FILTER_BELOW;
+            return *end == '\0';
+        }
+
+        const char *second = end + 1;
+        filter.high = strtod(second, &end);
+        if (*(second - 1) != ':' || end == second || *end != '\0' ||
+            filter.high < filter.low) {
+            return false;
+        }
+        if (name == "in" || name == "out") {
+            filter.op = name == "in" ? FILTER_INSIDE : FILTER_OUTSIDE;
+            return true;
+        }
+        return false;
+    }
+};
+
+/**
+ * @brief Decode the value of a message, from the text that is sent to the
+ * clients ("ip:port - topic - TYPE - value", see format_udp_message)
+ * @param text The text
+ * @param topic The name of the topic
+ * @param value Will contain the value
+ * @return true The message was decoded
+ * @return false The text is malformed
+ */
+bool decode_message(const std::string &text, const std::string &topic,
+                    message_value &value) {
+    size_t pos = text.find(" - ");
+    if (pos == std::string::npos) {
+        return false;
+    }
+    pos += topic.size() + 6;
+    size_t end = text.find(" - ", pos);
+    if (pos > text.size() || end == std::string::npos) {
+        return false;
+    }
+
+    value.offset = end + 3;
+    value.number = 0;
+    std::string type = text.substr(pos, end - pos);
+    if (type == "STRING") {
+        value.type = STRING;
+        return true;
+    } else if (type == "INT") {
+        value.type = INT;
+    } else if (type == "SHORT_REAL") {
+        value.type = SHORT_REAL;
+    } else if (type == "FLOAT") {
+        value.type = FLOAT;
+    } else {
+        return false;
+    }
+    value.number = strtod(text.c_str() + value.offset, NULL);
+    return true;
+}
+}  // namespace application
\ No newline at end of file
@@ -0,0 +1,982 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <fcntl.h>            // open
+#include <linux/io_uring.h>   // io_uring structures and opcodes
+#include <sys/mman.h>         // mmap
+#include <sys/syscall.h>      // io_uring_setup, io_uring_enter, etc.
+
+#include <deque>
+
+#include "LogWriter.hpp"
+#include "Utils.hpp"
+
+#define IO_URING_ENTRIES 256     // Submission queue size
+#define IO_URING_CQ_ENTRIES 4096  // Completion queue size (more than the slots)
+#define IO_URING_SLOTS 1024      // Number of (registered) send/append slots
+#define IO_URING_SLOT_SIZE 2048  // Size of a slot, fits a whole tcp_message
+#define IO_URING_OUTBOX_SLOTS 8192  // Sends waiting for a socket before it
+                                    // is dropped (a whole replay can wait)
+#define IO_URING_RECV_BUFS 64    // Buffers provided for multishot receive
+#define IO_URING_RECV_GROUP 0    // The id of the provided buffers group
+
+namespace application {
+
+/**
+ * @brief A datagram received through the io_uring engine
+ */
+struct io_datagram {
+    sockaddr_in addr;
+    ssize_t size;
+    char data[UDP_MSG_SIZE];
+};
+
+/**
+ * @brief This class is a small io_uring engine, used to batch the network and
+ * file I/O of the server. It talks directly to the kernel, using the raw
+ * system calls (liburing is not required).
+ * - UDP datagrams are received with a multishot RECVMSG into a ring of
+ * provided buffers (or a re-armed single RECVMSG on older kernels)
+ * - TCP sends and log appends are copied into slots of a registered memory
+ * region and queued. Everything queued is submitted with one io_uring_enter
+ * call, when "submit" is called (once per event loop iteration).
+ * Sends on the same socket are linked, so they are delivered in order.
+ * The engine never blocks the event loop: when the slots are all taken, the
+ * data is kept in its own buffer, and a socket that has too many sends
+ * waiting (a client that doesn't read) is reported, so it can be dropped.
+ */
+class IoUring : public LogWriter {
+   private:
+    // The type of an operation is stored in the high byte of its user_data
+    enum io_op : lint {
+        OP_SEND = 1,
+        OP_APPEND = 2,
+        OP_RECV = 3,
+        OP_CANCEL = 4
+    };
+
+    /**
+     * @brief A send that waits (or is in flight) for a socket
+     */
+    struct io_send {
+        int slot;     // The slot that contains the data (-1 if it is in "data")
+        uint len;     // The total length of the data
+        uint offset;  // How much was already sent
+        std::string data;
+    };
+
+    /**
+     * @brief An append that is in flight
+     * Small appends use a registered slot, bigger ones their own buffer
+     */
+    struct io_append {
+        int fd;
+        off_t offset;
+        uint len;
+        int slot;  // -1 if the data is in "data"
+        std::string data;
+    };
+
+    /**
+     * @brief The outgoing data of a socket. The first "inflight" sends are
+     * already submitted, the others wait for them to finish. An outbox is
+     * kept until its sends in flight complete, even after its socket is
+     * forgotten (a new socket with the same fd gets a new outbox)
+     */
+    struct io_outbox {
+        int fd;
+        std::deque<io_send> sends;
+        uint inflight = 0;
+        bool broken = false;
+    };
+
+    int ring_fd;
+    bool active;
+
+    // Submission queue
+    uint *sq_head, *sq_tail, *sq_mask, *sq_array, *sq_flags;
+    io_uring_sqe *sqes;
+    uint sq_entries, queued;
+
+    // Completion queue
+    uint *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe *cqes;
+
+    // The memory mappings of the rings
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+
+    // The registered memory region, split into slots
+    char *region;
+    std::vector<uint> free_slots;
+
+    // Sends, grouped by socket (the outboxes have their own ids)
+    std::unordered_map<lint, io_outbox> outboxes;
+    std::unordered_map<int, lint> socket_outboxes;
+    std::unordered_set<int> dirty;
+    std::vector<int> stalled;  // The sockets with too many sends waiting
+    lint outbox_id;
+
+    // Appends
+    std::unordered_map<lint, io_append> appends;
+    std::unordered_map<int, off_t> log_offsets;
+    lint append_id;
+
+    // Receiving datagrams
+    int recv_fd;
+    bool multishot, recv_armed;
+    msghdr recv_hdr;
+    iovec recv_iov;
+    sockaddr_in recv_addr;
+    io_uring_buf_ring *buf_ring;
+    char *recv_bufs;
+    std::vector<io_datagram> received;
+
+    int io_uring_setup(uint entries, io_uring_params *p) {
+        return (int)syscall(__NR_io_uring_setup, entries, p);
+    }
+
+    int io_uring_enter(uint to_submit, uint min_complete, uint flags) {
+        return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                            min_complete, flags, NULL, 0);
+    }
+
+    int io_uring_register(uint opcode, void *arg, uint nr_args) {
+        return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg,
+                            nr_args);
+    }
+
+    static lint tag(const io_op op, const lint value) {
+        return (op << 56) | value;
+    }
+
+    char *slot_ptr(const uint slot) {
+        return region + (size_t)slot * IO_URING_SLOT_SIZE;
+    }
+
+    /**
+     * @brief Get the number of submission entries that are free
+     */
+    uint free_sqes() const {
+        uint head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        return sq_entries - (*sq_tail + queued - head);
+    }
+
+    /**
+     * @brief Get a free submission entry. If the queue is full, the queued
+     * entries are submitted first
+     * @return io_uring_sqe* The (cleared) entry
+     */
+    io_uring_sqe *get_sqe() {
+        uint head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (*sq_tail + queued - head >= sq_entries) {
+            flush_queue(0);
+            head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        }
+
+        uint index = (*sq_tail + queued) & *sq_mask;
+        io_uring_sqe *sqe = &sqes[index];
+        bzero(sqe, sizeof(io_uring_sqe));
+        sq_array[index] = index;
+        queued++;
+        return sqe;
+    }
+
+    /**
+     * @brief Publish the queued entries to the kernel and submit them
+     * @param wait_for How many completions to wait for
+     */
+    void flush_queue(const uint wait_for) {
+        __atomic_store_n(sq_tail, *sq_tail + queued, __ATOMIC_RELEASE);
+        uint to_submit = queued;
+        queued = 0;
+
+        while (to_submit > 0 || wait_for > 0) {
+            int res = io_uring_enter(to_submit, wait_for,
+                                     wait_for ? IORING_ENTER_GETEVENTS : 0);
+            if (res < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                CERR(true);
+                return;
+            }
+            to_submit -= std::min((uint)res, to_submit);
+            if (wait_for > 0 || res == 0) {
+                return;
+            }
+        }
+    }
+
+    /**
+     * @brief If some completions didn't fit in the completion queue, ask the
+     * kernel to move them there (the ring fd isn't readable for them)
+     * @return uint The new tail of the completion queue
+     */
+    uint flush_overflow() {
+        if (__atomic_load_n(sq_flags, __ATOMIC_ACQUIRE) &
+            IORING_SQ_CQ_OVERFLOW) {
+            io_uring_enter(0, 0, IORING_ENTER_GETEVENTS);
+        }
+        return __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    /**
+     * @brief Take a free slot, if there is one (the operations that have
+     * finished already give theirs back, but it never waits for them)
+     * @return int The slot, -1 if there are none
+     */
+    int take_slot() {
+        if (free_slots.empty()) {
+            reap();
+        }
+        if (free_slots.empty()) {
+            return -1;
+        }
+        uint slot = free_slots.back();
+        free_slots.pop_back();
+        return slot;
+    }
+
+    /**
+     * @brief Give back the slots of the sends of an outbox, from the first
+     * one that is not in flight
+     * @param box The outbox
+     */
+    void drop_waiting(io_outbox &box) {
+        while (box.sends.size() > box.inflight) {
+            release(box.sends.back());
+            box.sends.pop_back();
+        }
+    }
+
+    /**
+     * @brief Give back the slot of a send (if it has one)
+     */
+    void release(const io_send &s) {
+        if (s.slot >= 0) {
+            free_slots.push_back(s.slot);
+        }
+    }
+
+    /**
+     * @brief Get the data of a send
+     */
+    const char *send_ptr(const io_send &s) {
+        return s.slot >= 0 ? slot_ptr(s.slot) : s.data.c_str();
+    }
+
+    /**
+     * @brief Submit the waiting sends of a socket, as a chain of linked
+     * entries (the kernel will execute them in order)
+     * @param fd The socket
+     * @return true Nothing is left to submit now
+     * @return false The queue had no room, the sends must be submitted later
+     */
+    bool submit_sends(const int fd) {
+        auto id = socket_outboxes.find(fd);
+        if (id == socket_outboxes.end()) {
+            return true;
+        }
+
+        io_outbox &box = outboxes[id->second];
+        if (box.inflight > 0 || box.sends.empty()) {
+            // The next chain starts after the current one finishes
+            return true;
+        }
+
+        // A chain must be submitted at once (the kernel ends a link at the
+        // end of a submission, and its two parts could run in any order)
+        uint count = std::min((uint)box.sends.size(), sq_entries / 2);
+        if (free_sqes() < count) {
+            flush_queue(0);
+            count = std::min(count, free_sqes());
+            if (count == 0) {
+                return false;
+            }
+        }
+        for (uint i = 0; i < count; ++i) {
+            io_send &s = box.sends[i];
+            io_uring_sqe *sqe = get_sqe();
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = fd;
+            sqe->addr = (lint)(send_ptr(s) + s.offset);
+            sqe->len = s.len - s.offset;
+            sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+            sqe->user_data = tag(OP_SEND, id->second);
+            if (i + 1 < count) {
+                sqe->flags = IOSQE_IO_LINK;
+            }
+        }
+        box.inflight = count;
+        return true;
+    }
+
+    /**
+     * @brief Handle the completion of a send
+     * The completions of a chain arrive in order, so it always refers to the
+     * first send of the socket
+     * @param id The outbox of the socket
+     * @param res The result of the send
+     */
+    void complete_send(const lint id, const int res) {
+        auto it = outboxes.find(id);
+        if (it == outboxes.end()) {
+            return;
+        }
+
+        io_outbox &box = it->second;
+        box.inflight--;
+
+        if (res >= 0 && !box.broken) {
+            io_send &s = box.sends.front();
+            s.offset += res;
+            if (s.offset >= s.len) {
+                release(s);
+                box.sends.pop_front();
+            }
+        } else if (res != -ECANCELED) {
+            // The connection has a problem, drop everything it still has
+            box.broken = true;
+        }
+
+        if (box.inflight == 0) {
+            if (box.broken || box.sends.empty()) {
+                for (auto &s : box.sends) {
+                    release(s);
+                }
+                box.sends.clear();
+
+                // A stalled socket keeps its (empty) outbox until it is
+                // forgotten, so nothing else is sent on it
+                auto owner = socket_outboxes.find(box.fd);
+                bool owned = owner != socket_outboxes.end() &&
+                             owner->second == id;
+                if (owned && box.broken) {
+                    return;
+                }
+                if (owned) {
+                    socket_outboxes.erase(owner);
+                }
+                outboxes.erase(it);
+            } else {
+                // Short send or cancelled chain, continue from where it stopped
+                dirty.insert(box.fd);
+            }
+        }
+    }
+
+    /**
+     * @brief Handle the completion of a log append
+     */
+    void complete_append(const lint id, const int res) {
+        auto it = appends.find(id);
+        if (it == appends.end()) {
+            return;
+        }
+
+        io_append a = it->second;
+        appends.erase(it);
+        CERR(res < 0);
+
+        const char *data = a.slot >= 0 ? slot_ptr(a.slot) : a.data.c_str();
+        if (res > 0 && (uint)res < a.len) {
+            // Short write, write the rest of the data
+            queue_append(a.fd, a.offset + res,
+                         std::string(data + res, a.len - res));
+        }
+
+        if (a.slot >= 0) {
+            free_slots.push_back(a.slot);
+        }
+    }
+
+    /**
+     * @brief Queue a write at the specified offset of a file
+     * Small writes use a registered slot (WRITE_FIXED), bigger ones are kept
+     * in their own buffer
+     */
+    void queue_append(const int fd, const off_t offset,
+                      const std::string &data) {
+        io_append a;
+        a.fd = fd;
+        a.offset = offset;
+        a.len = data.size();
+        a.slot = -1;
+
+        lint id = append_id++;
+        io_uring_sqe *sqe;
+        if (data.size() <= IO_URING_SLOT_SIZE) {
+            a.slot = take_slot();
+        }
+        if (a.slot >= 0) {
+            memcpy(slot_ptr(a.slot), data.c_str(), data.size());
+
+            sqe = get_sqe();
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->addr = (lint)slot_ptr(a.slot);
+            sqe->buf_index = 0;
+        } else {
+            a.data = data;
+            sqe = get_sqe();
+            sqe->opcode = IORING_OP_WRITE;
+        }
+
+        auto &stored = appends.insert(std::make_pair(id, a)).first->second;
+        if (stored.slot < 0) {
+            sqe->addr = (lint)stored.data.c_str();
+        }
+        sqe->fd = fd;
+        sqe->off = offset;
+        sqe->len = data.size();
+        sqe->user_data = tag(OP_APPEND, id);
+    }
+
+    /**
+     * @brief Arm the receive operation on the udp socket
+     */
+    void arm_recv() {
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = recv_fd;
+        sqe->addr = (lint)&recv_hdr;
+        sqe->user_data = tag(OP_RECV, 0);
+
+        if (multishot) {
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = IO_URING_RECV_GROUP;
+        } else {
+            recv_hdr.msg_namelen = sizeof(recv_addr);
+        }
+        recv_armed = true;
+    }
+
+    /**
+     * @brief Give a receive buffer back to the kernel
+     * @param bid The id of the buffer
+     */
+    void recycle_buffer(const sint bid) {
+        // The entries are indexed by hand, as the flexible array member of
+        // io_uring_buf_ring doesn't start at offset 0 when compiled as C++
+        sint tail = buf_ring->tail;
+        io_uring_buf *buf =
+            (io_uring_buf *)buf_ring + (tail & (IO_URING_RECV_BUFS - 1));
+        buf->addr = (lint)(recv_bufs + (size_t)bid * IO_URING_SLOT_SIZE);
+        buf->len = IO_URING_SLOT_SIZE;
+        buf->bid = bid;
+        __atomic_store_n(&buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    /**
+     * @brief Handle the completion of a receive
+     */
+    void complete_recv(const int res, const uint flags) {
+        if (!(flags & IORING_CQE_F_MORE)) {
+            recv_armed = false;
+        }
+
+        if (res == -EINVAL && multishot) {
+            // The kernel doesn't know multishot receive
+            multishot = false;
+            recv_hdr.msg_iov = &recv_iov;
+            recv_hdr.msg_iovlen = 1;
+            console_log("Multishot receive unavailable, using single shot\n");
+        }
+
+        if (res >= 0) {
+            io_datagram d;
+            bzero(&d, sizeof(io_datagram));
+
+            if (multishot) {
+                // The buffer contains a header, the name, and the payload
+                sint bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                char *buf = recv_bufs + (size_t)bid * IO_URING_SLOT_SIZE;
+                io_uring_recvmsg_out *out = (io_uring_recvmsg_out *)buf;
+                char *name = buf + sizeof(io_uring_recvmsg_out);
+                char *payload = name + recv_hdr.msg_namelen;
+
+                memcpy(&d.addr, name, std::min(out->namelen,
+                                               (uint)sizeof(sockaddr_in)));
+                d.size = std::min(out->payloadlen, (uint)UDP_MSG_SIZE);
+                memcpy(d.data, payload, d.size);
+                recycle_buffer(bid);
+            } else {
+                d.addr = recv_addr;
+                d.size = std::min(res, UDP_MSG_SIZE);
+                memcpy(d.data, recv_iov.iov_base, d.size);
+            }
+            received.push_back(d);
+        } else if (flags & IORING_CQE_F_BUFFER) {
+            recycle_buffer(flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+
+        if (!recv_armed && recv_fd >= 0) {
+            arm_recv();
+        }
+    }
+
+    /**
+     * @brief Cancel the receive on the udp socket, and wait for it. The ring
+     * keeps the socket until then, even after the process has closed it (so
+     * its port couldn't be bound again right after the server stops)
+     */
+    void stop_recv() {
+        recv_fd = -1;
+        if (!recv_armed) {
+            return;
+        }
+
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = tag(OP_RECV, 0);
+        sqe->user_data = tag(OP_CANCEL, 0);
+        while (recv_armed) {
+            flush_queue(1);
+            reap();
+        }
+    }
+
+    /**
+     * @brief Register the memory region that contains the slots
+     * @return true The region could be registered
+     * @return false Registration failed
+     */
+    bool register_region() {
+        size_t size = (size_t)IO_URING_SLOTS * IO_URING_SLOT_SIZE;
+        void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            return false;
+        }
+        region = (char *)mem;
+
+        iovec iov;
+        iov.iov_base = region;
+        iov.iov_len = size;
+        if (io_uring_register(IORING_REGISTER_BUFFERS, &iov, 1) != 0) {
+            CERR(true);
+            return false;
+        }
+
+        for (uint i = 0; i < IO_URING_SLOTS; ++i) {
+            free_slots.push_back(IO_URING_SLOTS - 1 - i);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Register the ring of buffers used by the multishot receive
+     * @return true The kernel supports provided buffer rings
+     * @return false The receive must use a single buffer
+     */
+    bool register_recv_buffers() {
+        size_t ring_size = IO_URING_RECV_BUFS * sizeof(io_uring_buf);
+        size_t bufs_size = (size_t)IO_URING_RECV_BUFS * IO_URING_SLOT_SIZE;
+
+        void *mem = mmap(NULL, ring_size + bufs_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            return false;
+        }
+        buf_ring = (io_uring_buf_ring *)mem;
+        recv_bufs = (char *)mem + ring_size;
+
+        io_uring_buf_reg reg;
+        bzero(&reg, sizeof(reg));
+        reg.ring_addr = (lint)buf_ring;
+        reg.ring_entries = IO_URING_RECV_BUFS;
+        reg.bgid = IO_URING_RECV_GROUP;
+        if (io_uring_register(IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+            return false;
+        }
+
+        for (sint i = 0; i < IO_URING_RECV_BUFS; ++i) {
+            recycle_buffer(i);
+        }
+        return true;
+    }
+
+   public:
+    IoUring()
+        : ring_fd(-1),
+          active(false),
+          sqes(NULL),
+          queued(0),
+          sq_ring(MAP_FAILED),
+          cq_ring(MAP_FAILED),
+          region(NULL),
+          outbox_id(0),
+          append_id(0),
+          recv_fd(-1),
+          multishot(false),
+          recv_armed(false),
+          buf_ring(NULL),
+          recv_bufs(NULL) {
+        // Set by listen_datagrams (freed by the destructor)
+        recv_iov.iov_base = NULL;
+    }
+
+    IoUring(const IoUring &other) = delete;
+    IoUring &operator=(const IoUring &other) = delete;
+
+    ~IoUring() {
+        if (!active) {
+            return;
+        }
+
+        drain();
+        stop_recv();
+        free(recv_iov.iov_base);
+        close(ring_fd);
+    }
+
+    /**
+     * @brief Create the rings and register the buffers
+     * Will return false if io_uring is not available, in which case the
+     * caller should use normal system calls
+     * @return true The engine is ready
+     * @return false The engine could not be started
+     */
+    bool init() {
+        io_uring_params p;
+        bzero(&p, sizeof(p));
+
+        // Every send in flight has a slot, so their completions always fit
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = IO_URING_CQ_ENTRIES;
+
+        ring_fd = io_uring_setup(IO_URING_ENTRIES, &p);
+        if (ring_fd < 0) {
+            console_log("io_uring is not available, using normal I/O\n");
+            return false;
+        }
+        sq_entries = p.sq_entries;
+
+        // Map the rings in memory
+        sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint);
+        cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+
+        sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED) {
+            close(ring_fd);
+            return false;
+        }
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ring = sq_ring;
+        } else {
+            cq_ring =
+                mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+            if (cq_ring == MAP_FAILED) {
+                close(ring_fd);
+                return false;
+            }
+        }
+
+        sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        void *sqes_mem =
+            mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes_mem == MAP_FAILED) {
+            close(ring_fd);
+            return false;
+        }
+        sqes = (io_uring_sqe *)sqes_mem;
+
+        char *sq = (char *)sq_ring;
+        sq_head = (uint *)(sq + p.sq_off.head);
+        sq_tail = (uint *)(sq + p.sq_off.tail);
+        sq_mask = (uint *)(sq + p.sq_off.ring_mask);
+        sq_array = (uint *)(sq + p.sq_off.array);
+        sq_flags = (uint *)(sq + p.sq_off.flags);
+
+        char *cq = (char *)cq_ring;
+        cq_head = (uint *)(cq + p.cq_off.head);
+        cq_tail = (uint *)(cq + p.cq_off.tail);
+        cq_mask = (uint *)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+
+        if (!register_region()) {
+            close(ring_fd);
+            return false;
+        }
+
+        active = true;
+        return true;
+    }
+
+    /**
+     * @brief Checks if the engine is running
+     * @return true I/O should go through the engine
+     * @return false Normal system calls should be used
+     */
+    bool is_active() const { return active; }
+
+    /**
+     * @brief Get the file descriptor of the ring
+     * It becomes readable when there are completions to be reaped, so it can
+     * be used with select
+     * @return int The fd
+     */
+    int get_fd() const { return ring_fd; }
+
+    /**
+     * @brief Start receiving datagrams on a udp socket
+     * Uses a multishot receive if the kernel supports it
+     * @param sockfd The udp socket
+     */
+    void listen_datagrams(const int sockfd) {
+        recv_fd = sockfd;
+        bzero(&recv_hdr, sizeof(recv_hdr));
+        recv_hdr.msg_name = &recv_addr;
+        recv_hdr.msg_namelen = sizeof(recv_addr);
+
+        // Buffer used when multishot isn't available
+        recv_iov.iov_base = malloc(UDP_MSG_SIZE);
+        recv_iov.iov_len = UDP_MSG_SIZE;
+
+        multishot = register_recv_buffers();
+        if (!multishot) {
+            recv_hdr.msg_iov = &recv_iov;
+            recv_hdr.msg_iovlen = 1;
+        }
+
+        arm_recv();
+        flush_queue(0);
+    }
+
+    /**
+     * @brief Queue data to be sent on a socket (in as many slots as it needs,
+     * sent in order). If the socket has more than IO_URING_OUTBOX_SLOTS sends
+     * waiting, the data is dropped, and the socket is reported by
+     * take_stalled
+     * @param sockfd The socket
+     * @param data The data
+     * @param len The size of the data
+     * @return true The data was queued
+     * @return false The socket is stalled
+     */
+    bool send(const int sockfd, const void *data, const size_t len) {
+        auto id = socket_outboxes.find(sockfd);
+        if (id == socket_outboxes.end()) {
+            id = socket_outboxes.insert(std::make_pair(sockfd, outbox_id++))
+                     .first;
+            outboxes[id->second].fd = sockfd;
+        }
+
+        io_outbox &box = outboxes[id->second];
+        if (box.broken) {
+            return false;
+        }
+
+        for (size_t pos = 0; pos < len; pos += IO_URING_SLOT_SIZE) {
+            if (box.sends.size() >= IO_URING_OUTBOX_SLOTS) {
+                // The client doesn't read, nothing else is queued for it
+                box.broken = true;
+                drop_waiting(box);
+                stalled.push_back(sockfd);
+                return false;
+            }
+
+            io_send s;
+            s.slot = take_slot();
+            s.len = std::min(len - pos, (size_t)IO_URING_SLOT_SIZE);
+            s.offset = 0;
+            if (s.slot >= 0) {
+                memcpy(slot_ptr(s.slot), (const char *)data + pos, s.len);
+            } else {
+                s.data.assign((const char *)data + pos, s.len);
+            }
+            box.sends.push_back(std::move(s));
+        }
+        dirty.insert(sockfd);
+        return true;
+    }
+
+    /**
+     * @brief Checks if a socket has data that was not sent yet
+     * @param sockfd The socket
+     */
+    bool has_pending(const int sockfd) const {
+        return socket_outboxes.count(sockfd) != 0;
+    }
+
+    /**
+     * @brief Return the sockets that had too many sends waiting, since the
+     * last call (they should be closed, see forget_socket)
+     * @return std::vector<int> The sockets
+     */
+    std::vector<int> take_stalled() {
+        std::vector<int> v;
+        v.swap(stalled);
+        return v;
+    }
+
+    /**
+     * @brief Queue data to be appended to a log file
+     * The offset is computed now, so appends can be executed in any order
+     * @param fd The file (opened for writing, without O_APPEND)
+     * @param data The data
+     */
+    void append(const int fd, const std::string &data) {
+        if (fd < 0 || data.empty()) {
+            return;
+        }
+
+        auto it = log_offsets.find(fd);
+        if (it == log_offsets.end()) {
+            it = log_offsets.insert(std::make_pair(fd, lseek(fd, 0, SEEK_END)))
+                     .first;
+        }
+        off_t &offset = it->second;
+        queue_append(fd, offset, data);
+        offset += data.size();
+    }
+
+    /**
+     * @brief Submit everything that was queued, with a single system call
+     */
+    void submit() {
+        std::vector<int> later;
+        for (int fd : dirty) {
+            if (!submit_sends(fd)) {
+                later.push_back(fd);
+            }
+        }
+        dirty.clear();
+        dirty.insert(later.begin(), later.end());
+
+        if (queued > 0) {
+            flush_queue(0);
+        }
+    }
+
+    /**
+     * @brief Process all the available completions
+     * Datagrams that were received can be taken with "take_datagrams"
+     */
+    void reap() {
+        uint head = *cq_head;
+        uint tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            tail = flush_overflow();
+        }
+
+        while (head != tail) {
+            io_uring_cqe cqe = cqes[head & *cq_mask];
+            head++;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+            lint value = cqe.user_data & ((1ULL << 56) - 1);
+            switch (cqe.user_data >> 56) {
+                case OP_SEND:
+                    complete_send(value, cqe.res);
+                    break;
+                case OP_APPEND:
+                    complete_append(value, cqe.res);
+                    break;
+                case OP_RECV:
+                    complete_recv(cqe.res, cqe.flags);
+                    break;
+                default:
+                    break;
+            }
+
+            tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            if (head == tail) {
+                tail = flush_overflow();
+            }
+        }
+    }
+
+    /**
+     * @brief Return the datagrams received since the last call
+     * @return std::vector<io_datagram> The datagrams
+     */
+    std::vector<io_datagram> take_datagrams() {
+        std::vector<io_datagram> v;
+        v.swap(received);
+        return v;
+    }
+
+    /**
+     * @brief Wait until all sends and appends are completed
+     */
+    void drain() {
+        submit();
+        reap();
+        while (!appends.empty() || !outboxes.empty()) {
+            flush_queue(1);
+            reap();
+            submit();
+        }
+    }
+
+    /**
+     * @brief Must be called before a file is closed (see
+     * LogWriter::close_file), the offset kept for it is dropped
+     * @param fd The file
+     */
+    void close_file(const int fd) {
+        drain();
+        log_offsets.erase(fd);
+    }
+
+    /**
+     * @brief Must be called before a socket is closed
+     * Drops the sends that wait, and shuts the socket down, so the ones in
+     * flight fail instead of waiting for a client that doesn't read (their
+     * slots are given back when they complete, it doesn't wait for them).
+     * Nothing will be sent on a new socket with the same fd
+     * @param sockfd The socket
+     */
+    void forget_socket(const int sockfd) {
+        dirty.erase(sockfd);
+        stalled.erase(std::remove(stalled.begin(), stalled.end(), sockfd),
+                      stalled.end());
+
+        auto id = socket_outboxes.find(sockfd);
+        if (id == socket_outboxes.end()) {
+            return;
+        }
+        auto it = outboxes.find(id->second);
+        socket_outboxes.erase(id);
+
+        io_outbox &box = it->second;
+        box.broken = true;
+        drop_waiting(box);
+        if (box.inflight == 0) {
+            outboxes.erase(it);
+            return;
+        }
+        shutdown(sockfd, SHUT_RDWR);
+    }
+};
+}  // namespace application
\ No newline at end of file
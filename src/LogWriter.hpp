@@ -0,0 +1,56 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include "Utils.hpp"
+
+namespace application {
+/**
+ * @brief Something that appends to the files of the topics, instead of the
+ * topics writing them directly (the io_uring engine, or the persistence stage
+ * of the pipeline)
+ */
+class LogWriter {
+   public:
+    virtual ~LogWriter() {}
+
+    /**
+     * @brief Queue data to be appended to a file
+     * @param fd The file (opened for writing, without O_APPEND)
+     * @param data The data
+     */
+    virtual void append(const int fd, const std::string &data) = 0;
+
+    /**
+     * @brief Wait until all the queued data is written
+     */
+    virtual void drain() = 0;
+
+    /**
+     * @brief Must be called before a file is closed: waits until its queued
+     * data is written, and forgets it (the fd can be reused by another file)
+     * @param fd The file
+     */
+    virtual void close_file(const int fd) { drain(); }
+};
+}  // namespace application
\ No newline at end of file
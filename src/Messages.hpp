@@ -24,6 +24,8 @@
 
 #include <iomanip>
 
+#include "Filters.hpp"
+#include "RateLimit.hpp"
 #include "Utils.hpp"
 
 /**
@@ -161,6 +163,96 @@ struct udp_message {
     }
 };
 
+/**
+ * @brief Parse a datagram and build the text that is stored and sent to the
+ * subscribers ("ip:port - topic - TYPE - value")
+ * @param buffer The datagram
+ * @param size The size of the datagram
+ * @param addr The adress of the sender
+ * @param topic Will contain the topic of the message
+ * @param text Will contain the text
+ * @return true The datagram is a message
+ * @return false The datagram is empty
+ */
+bool format_udp_message(const char* buffer, const ssize_t size,
+                        const sockaddr_in& addr, std::string& topic,
+                        std::string& text) {
+    if (size <= 0) {
+        return false;
+    }
+
+    udp_message msg;
+    bzero(&msg, UDP_MSG_SIZE);
+    memcpy(&msg, buffer, std::min((size_t)size, (size_t)UDP_MSG_SIZE));
+    topic.assign(msg.topic, strnlen(msg.topic, TOPIC_LENGTH));
+
+    // inet_ntoa is not thread safe
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+
+    std::stringstream ss;
+    ss << ip << ":" << ntohs(addr.sin_port) << " - " << msg.print();
+    text = ss.str();
+    return true;
+}
+
+/**
+ * @brief A message sent to a multicast group (see ENABLE_MULTICAST). The id
+ * of the message in its topic is the sequence number of the datagrams of the
+ * topic, so a receiver can find the ones it has missed. Only the used part of
+ * the text is sent
+ */
+struct udp_multicast {
+    char topic[TOPIC_LENGTH];
+    uint id;
+    char text[TCP_DATA_TEXT];
+};
+
+/**
+ * @brief Build the datagram of a message of a broadcast topic
+ * @param topic The topic
+ * @param id The id of the message in the topic
+ * @param text The message (as it is shown to the clients)
+ * @param msg Will contain the datagram
+ * @return size_t The size of the datagram
+ */
+size_t write_multicast(const std::string& topic, const uint id,
+                       const std::string& text, udp_multicast& msg) {
+    bzero(&msg, offsetof(udp_multicast, text));
+    memcpy(msg.topic, topic.data(), std::min(topic.size(), sizeof(msg.topic)));
+    msg.id = id;
+
+    // Truncated like the DATA messages
+    size_t size = std::min(text.size(), sizeof(msg.text) - 1);
+    memcpy(msg.text, text.data(), size);
+    return offsetof(udp_multicast, text) + size;
+}
+
+/**
+ * @brief Read a datagram received from a multicast group
+ * @param buffer The datagram
+ * @param size The size of the datagram
+ * @param topic Will contain the topic
+ * @param id Will contain the id of the message in the topic
+ * @param text Will contain the message
+ * @return true The datagram is a message
+ * @return false The datagram is invalid
+ */
+bool read_multicast(const char* buffer, const ssize_t size, std::string& topic,
+                    uint& id, std::string& text) {
+    if (size < (ssize_t)offsetof(udp_multicast, text) ||
+        size > (ssize_t)sizeof(udp_multicast)) {
+        return false;
+    }
+
+    udp_multicast msg;
+    memcpy(&msg, buffer, size);
+    topic.assign(msg.topic, strnlen(msg.topic, TOPIC_LENGTH));
+    id = msg.id;
+    text.assign(msg.text, size - offsetof(udp_multicast, text));
+    return true;
+}
+
 #pragma endregion UDP
 
 #pragma region TCP
@@ -176,9 +268,18 @@ struct tcp_message {
 
 // Next structs define different payload types
 
+/**
+ * @brief Data for a DATA
+ * Contains the message (as it is shown), its topic and its id on the topic (the
+ * client keeps the id of the last one, see SUB_ACK)
+ * server => client
+ */
 struct tcp_data {
-    char payload[TCP_DATA_DATA];  //
+    char payload[TCP_DATA_TEXT];
+    uint topic;
+    uint id;
 };
+static_assert(sizeof(tcp_data) == TCP_DATA_DATA, "Invalid DATA size\n");
 
 /**
  * @brief Data for a CONNECT
@@ -191,12 +292,18 @@ struct tcp_connect {
 
 /**
  * @brief Data for a SUBSCRIBE
- * Contains the name of the topic and if the "store & forward" option should be
- * activated client => server
+ * Contains the name of the topic, if the "store & forward" option should be
+ * activated, and the other options (see subscription_option), like the filter
+ * of the messages (used with SUB_FILTER) and their rate (SUB_LIMIT)
+ * client => server
  */
 struct tcp_subscribe {
     char topic[50];
     bool sf;
+    bint options;
+    content_filter filter;
+    uint rate;   // The most messages per second
+    uint every;  // Only one of every "every" messages is sent
 };
 
 /**
@@ -227,6 +334,261 @@ struct tcp_confirm_u {
     uint topic;
 };
 
+/**
+ * @brief Data for a SKIPPED
+ * The number of stored messages on a topic that were over the limits of the
+ * store & forward subscription, and were not sent
+ * server => client
+ */
+struct tcp_skipped {
+    uint topic;
+    uint count;
+};
+
+/**
+ * @brief Data for a QUERY
+ * Contains the name of the topic and the range of the messages (ids, and the
+ * times when they were received, in ns since the epoch, if they are not 0).
+ * The messages are sent at "rate" messages per second (QUERY_RATE if it is 0)
+ * client => server
+ */
+struct tcp_query {
+    char topic[50];
+    uint first;
+    uint last;
+    uint rate;
+    lint since;
+    lint until;
+};
+
+/**
+ * @brief Data for a QUERY_DONE
+ * Contains the name of the topic of the range and the number of messages sent
+ * server => client
+ */
+struct tcp_query_done {
+    char topic[50];
+    uint count;
+};
+
+/**
+ * @brief The data of the batch messages. Only the used part is sent, and
+ * "size" is the number of bytes that are sent (after the type). The entries
+ * are packed one after the other:
+ * - SUBSCRIBE_BATCH: the size of the name (1 byte), the name (the options in
+ * "subscribe" apply to all the topics)
+ * - UNSUBSCRIBE_BATCH: the id (4 bytes)
+ * - TOPIC_IDS: the id (4 bytes), the size of the name (1 byte), the name
+ * - ACK: the id of the topic (4 bytes), the id of the next message (4 bytes)
+ */
+struct tcp_batch {
+    sint size;
+    sint count;                    // The number of entries
+    tcp_subscribe subscribe;       // The options (SUBSCRIBE_BATCH)
+    char entries[TCP_BATCH_DATA];  // The entries
+};
+static_assert(sizeof(tcp_batch) <= TCP_DATA_DATA, "A batch is too big\n");
+
+/**
+ * @brief Builds the batch messages for a list of entries (as many messages as
+ * they need, one after the other, so they can be sent at once)
+ */
+class BatchWriter {
+   private:
+    bint type;
+    tcp_batch batch;
+    size_t used;
+    std::string frames;
+
+    void flush() {
+        if (batch.count == 0) {
+            return;
+        }
+        batch.size = offsetof(tcp_batch, entries) + used;
+        frames.push_back((char)type);
+        frames.append((const char *)&batch, batch.size);
+        batch.count = 0;
+        used = 0;
+    }
+
+    void append(const void *data, const size_t size) {
+        memcpy(batch.entries + used, data, size);
+        used += size;
+    }
+
+   public:
+    /**
+     * @brief Construct a new writer
+     * @param type The type of the messages
+     * @param subscribe The options of the topics (SUBSCRIBE_BATCH)
+     */
+    explicit BatchWriter(const bint type, const tcp_subscribe *subscribe = NULL)
+        : type(type), used(0) {
+        bzero(&batch, sizeof(batch));
+        if (subscribe != NULL) {
+            batch.subscribe = *subscribe;
+        }
+    }
+
+    /**
+     * @brief Add an entry (the name is not added if it is empty, the id is not
+     * added for SUBSCRIBE_BATCH)
+     * @param name The name of the topic
+     * @param id The id of the topic
+     */
+    void add(const std::string &name, const uint id = 0) {
+        bint size = std::min(name.size(), (size_t)TOPIC_LENGTH - 1);
+        size_t entry = (type != SUBSCRIBE_BATCH ? sizeof(uint) : 0) +
+                       (type != UNSUBSCRIBE_BATCH ? 1 + size : 0);
+        if (used + entry > TCP_BATCH_DATA) {
+            flush();
+        }
+
+        if (type != SUBSCRIBE_BATCH) {
+            append(&id, sizeof(uint));
+        }
+        if (type != UNSUBSCRIBE_BATCH) {
+            append(&size, 1);
+            append(name.data(), size);
+        }
+        batch.count++;
+    }
+
+    /**
+     * @brief Add the cursor of a topic (ACK)
+     * @param topic The id of the topic
+     * @param next The id of the next message the client needs
+     */
+    void add_cursor(const uint topic, const uint next) {
+        if (used + 2 * sizeof(uint) > TCP_BATCH_DATA) {
+            flush();
+        }
+        append(&topic, sizeof(uint));
+        append(&next, sizeof(uint));
+        batch.count++;
+    }
+
+    /**
+     * @brief Get the messages
+     */
+    const std::string &get_frames() {
+        flush();
+        return frames;
+    }
+};
+
+/**
+ * @brief Read the entries of a batch message (see tcp_batch)
+ * @param type The type of the message
+ * @param batch The data of the message
+ * @return std::vector<std::pair<std::string, uint>> The names and the ids
+ */
+std::vector<std::pair<std::string, uint>> read_batch(const bint type,
+                                                     const tcp_batch &batch) {
+    std::vector<std::pair<std::string, uint>> entries;
+    size_t end = batch.size - offsetof(tcp_batch, entries), pos = 0;
+    end = std::min(end, (size_t)TCP_BATCH_DATA);
+
+    for (uint i = 0; i < batch.count; ++i) {
+        uint id = 0;
+        std::string name;
+        if (type != SUBSCRIBE_BATCH) {
+            if (pos + sizeof(uint) > end) {
+                break;
+            }
+            memcpy(&id, batch.entries + pos, sizeof(uint));
+            pos += sizeof(uint);
+        }
+        if (type != UNSUBSCRIBE_BATCH) {
+            bint size = pos < end ? (bint)batch.entries[pos] : 0;
+            if (pos + 1 + size > end) {
+                break;
+            }
+            name.assign(batch.entries + pos + 1, size);
+            pos += 1 + size;
+        }
+        entries.push_back(std::make_pair(name, id));
+    }
+    return entries;
+}
+
+/**
+ * @brief Read the cursors of an ACK message
+ * @param batch The data of the message
+ * @return std::vector<std::pair<uint, uint>> The topics, and the next messages
+ */
+std::vector<std::pair<uint, uint>> read_cursors(const tcp_batch &batch) {
+    std::vector<std::pair<uint, uint>> cursors;
+    size_t end = batch.size - offsetof(tcp_batch, entries);
+    end = std::min(end, (size_t)TCP_BATCH_DATA);
+
+    for (size_t i = 0, pos = 0; i < batch.count; ++i) {
+        if (pos + 2 * sizeof(uint) > end) {
+            break;
+        }
+        uint topic, next;
+        memcpy(&topic, batch.entries + pos, sizeof(uint));
+        memcpy(&next, batch.entries + pos + sizeof(uint), sizeof(uint));
+        pos += 2 * sizeof(uint);
+        cursors.push_back(std::make_pair(topic, next));
+    }
+    return cursors;
+}
+
+/**
+ * @brief Return the size of the next tcp message, as it is sent on the socket
+ * (type byte included). Used to split the received stream into messages, as
+ * multiple messages can arrive in a single recv. The size of a batch message
+ * is read from the message (if it wasn't received yet, the size of its header
+ * is returned, so more data is waited for)
+ * @param data The received data (starting with the type of the message)
+ * @param available The size of the received data (> 0)
+ * @return size_t The size, 0 if the message is invalid
+ */
+size_t tcp_message_size(const char *data, const size_t available) {
+    switch ((bint)data[0]) {
+        case DATA:
+            return TCP_DATA_DATA + 1;
+        case SUBSCRIBE:
+            return TCP_DATA_SUBSCRIBE + 1;
+        case UNSUBSCRIBE:
+            return TCP_DATA_UNSUBSCRIBE + 1;
+        case TOPIC_ID:
+            return TCP_DATA_TOPICID + 1;
+        case CONNECT:
+            return TCP_DATA_CONNECT + 1;
+        case CONFIRM_U:
+            return TCP_DATA_CONFIRM_U + 1;
+        case CONNECT_DUP:
+        case HEARTBEAT:
+            return 1;
+        case SKIPPED:
+            return TCP_DATA_SKIPPED + 1;
+        case QUERY:
+            return TCP_DATA_QUERY + 1;
+        case HISTORY:
+            return TCP_DATA_DATA + 1;
+        case QUERY_DONE:
+            return TCP_DATA_QUERY_DONE + 1;
+        case SUBSCRIBE_BATCH:
+        case UNSUBSCRIBE_BATCH:
+        case TOPIC_IDS:
+        case ACK: {
+            sint size;
+            if (available < 1 + sizeof(size)) {
+                return 1 + sizeof(size);
+            }
+            memcpy(&size, data + 1, sizeof(size));
+            if (size < offsetof(tcp_batch, entries) || size > TCP_DATA_DATA) {
+                return 0;
+            }
+            return 1 + size;
+        }
+        default:
+            return 0;
+    }
+}
+
 #pragma endregion TCP
 
 }  // namespace application
\ No newline at end of file
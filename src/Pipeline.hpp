@@ -0,0 +1,622 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <poll.h>   // poll
+#include <sched.h>  // sched_yield
+
+#include <thread>
+
+#include "FanoutPool.hpp"
+#include "LogWriter.hpp"
+#include "Messages.hpp"
+#include "SpscRing.hpp"
+#include "Subscribers.hpp"
+#include "Utils.hpp"
+
+#define PIPELINE_INGEST_QUEUE 4096   // Parsed messages, waiting to be stored
+#define PIPELINE_SEND_QUEUE 4096     // Messages waiting to be sent
+#define PIPELINE_PERSIST_QUEUE 1024  // Data waiting to be written to files
+
+namespace application {
+/**
+ * @brief A message received (and parsed) by the ingest stage
+ */
+struct ingest_item {
+    lint time;  // When the datagram was received
+    std::string topic;
+    std::string text;
+};
+
+/**
+ * @brief Data to be sent by the fan-out stage, to one or more sockets
+ * The sockets are the subscriber list of a topic (if "list" is set), or
+ * "sockets". If "close" is set, the socket is closed instead (after
+ * everything that was queued before it was sent)
+ */
+struct send_item {
+    lint time;  // When the message was received (or the item was queued)
+    const subscriber_list *list;
+    lint epoch;  // The epoch of the list (see EpochReclaimer)
+    std::vector<uint> sockets;
+    std::string frame;
+    bool close;
+};
+
+/**
+ * @brief Data to be appended to a file by the persistence stage
+ */
+struct persist_item {
+    lint time;  // When the data was queued
+    int fd;
+    std::string data;
+};
+
+/**
+ * @brief The number of items a stage has processed and their latency
+ * Written only by the thread of the stage, can be read by any thread
+ */
+class stage_stats {
+   private:
+    std::atomic<lint> items, total_ns, max_ns;
+
+   public:
+    stage_stats() : items(0), total_ns(0), max_ns(0) {}
+
+    /**
+     * @brief Record a processed item
+     * @param start The time the latency is measured from
+     */
+    void record(const lint start) {
+        lint latency = time_ns() - start;
+        items.store(items.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+        total_ns.store(total_ns.load(std::memory_order_relaxed) + latency,
+                       std::memory_order_relaxed);
+        if (latency > max_ns.load(std::memory_order_relaxed)) {
+            max_ns.store(latency, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Build a line with the statistics of the stage
+     * @param name The name of the stage
+     * @param depth The number of items waiting in the queue of the stage
+     * @param capacity The capacity of that queue (0 if it has no queue)
+     * @return std::string The line
+     */
+    std::string print(const std::string &name, const size_t depth,
+                      const size_t capacity) const {
+        lint count = items.load(std::memory_order_relaxed);
+        lint average = count ? total_ns.load(std::memory_order_relaxed) / count
+                             : 0;
+
+        std::stringstream ss;
+        ss << name << ": " << count << " items, ";
+        if (capacity > 0) {
+            ss << "queue " << depth << "/" << capacity << ", ";
+        }
+        ss << "latency avg " << average / 1000 << " us, max "
+           << max_ns.load(std::memory_order_relaxed) / 1000 << " us\n";
+        return ss.str();
+    }
+};
+
+/**
+ * @brief Runs the stages of the server on separate threads:
+ * - ingest: receives the UDP datagrams and parses them
+ * - append: stores the messages in the topics and decides who receives them
+ * (this is the server's main thread, that also owns the database)
+ * - fan-out: sends the data to the subscribers (long subscriber lists are
+ * split between the threads of a FanoutPool)
+ * - persistence: appends the data to the files of the topics
+ * The stages are connected by bounded SPSC queues. When a queue is full, the
+ * stage that adds to it waits, so a slow disk slows only the stages before
+ * it, and the kernel buffers the datagrams meanwhile. The fan-out stage never
+ * waits for a client: what a socket can't take now waits in its backlog, and
+ * a client with more than SEND_BACKLOG_LIMIT bytes waiting is shut down.
+ */
+class Pipeline : public LogWriter {
+   private:
+    bool active;
+    std::atomic<bool> running;
+    int udp_sock, stop_fd;
+
+    SpscRing<ingest_item> ingested;
+    SpscRing<send_item> sends;
+    SpscRing<persist_item> appends;
+    Doorbell ingest_bell, send_bell, persist_bell;
+
+    std::thread ingest_thread, fanout_thread, persist_thread;
+    FanoutPool *pool;  // Sends to long subscriber lists (if any)
+    stage_stats ingest_stats, append_stats, fanout_stats, persist_stats;
+
+    lint appends_queued;              // Written by the main thread
+    std::atomic<lint> appends_done;  // Written by the persistence thread
+
+    // The epoch of the last subscriber list the fan-out stage has finished
+    alignas(CACHE_LINE) std::atomic<lint> list_epoch;
+
+    // The data the sockets could not take yet (fan-out stage)
+    std::unordered_map<uint, std::string> backlog;
+    std::vector<fanout_unsent> unsent;
+
+    /**
+     * @brief Add an item to a queue, waiting while it is full
+     * @param ring The queue
+     * @param item The item
+     * @param bell Used to wake the consumer of the queue
+     */
+    template <typename T>
+    static void push(SpscRing<T> &ring, T &item, Doorbell &bell) {
+        while (!ring.push(item)) {
+            bell.ring();
+            sched_yield();
+        }
+        bell.ring();
+    }
+
+    /**
+     * @brief Get the next item from a queue, sleeping while it is empty
+     * @param ring The queue
+     * @param item Will contain the item
+     * @param bell Rung by the producer of the queue
+     * @return true An item was taken
+     * @return false The pipeline was stopped, and the queue is empty
+     */
+    template <typename T>
+    bool next(SpscRing<T> &ring, T &item, Doorbell &bell) {
+        while (!ring.pop(item)) {
+            if (!running.load(std::memory_order_acquire) && ring.empty()) {
+                return false;
+            }
+            bell.wait([&] {
+                return !ring.empty() ||
+                       !running.load(std::memory_order_acquire);
+            });
+        }
+        return true;
+    }
+
+    void ingest_loop() {
+        pollfd fds[2];
+        fds[0].fd = udp_sock;
+        fds[0].events = POLLIN;
+        fds[1].fd = stop_fd;
+        fds[1].events = POLLIN;
+
+        char buffer[UDP_MSG_SIZE];
+        while (running.load(std::memory_order_acquire)) {
+            if (poll(fds, 2, -1) < 0 || (fds[1].revents & POLLIN)) {
+                continue;
+            }
+
+            // Receive everything that is available
+            FOREVER {
+                sockaddr_in addr;
+                socklen_t addr_len = sizeof(addr);
+                ssize_t size = recvfrom(udp_sock, buffer, sizeof(buffer),
+                                        MSG_DONTWAIT, (sockaddr *)&addr,
+                                        &addr_len);
+                if (size < 0) {
+                    CERR(errno != EAGAIN && errno != EWOULDBLOCK);
+                    break;
+                }
+
+                ingest_item item;
+                item.time = time_ns();
+                if (format_udp_message(buffer, size, addr, item.topic,
+                                       item.text)) {
+                    ingest_stats.record(item.time);
+                    push(ingested, item, ingest_bell);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Send the backlog of a socket, as much as it can take now
+     * @param sockfd The socket
+     * @return true Nothing waits for the socket anymore
+     * @return false Some data still waits
+     */
+    bool flush_backlog(const uint sockfd) {
+        auto it = backlog.find(sockfd);
+        if (it == backlog.end()) {
+            return true;
+        }
+
+        std::string &rest = it->second;
+        size_t sent = FanoutPool::send_some(sockfd, rest.data(), rest.size());
+        if (sent < rest.size()) {
+            rest.erase(0, sent);
+            return false;
+        }
+        backlog.erase(it);
+        return true;
+    }
+
+    /**
+     * @brief Add data to the backlog of a socket. If the client has more than
+     * SEND_BACKLOG_LIMIT bytes waiting, it doesn't read its messages: its
+     * connection is shut down (the main thread closes it when it reads the end
+     * of the connection, and the sends until then fail)
+     * @param sockfd The socket
+     * @param data The data
+     * @param len The size of the data
+     */
+    void keep(const uint sockfd, const char *data, const size_t len) {
+        std::string &rest = backlog[sockfd];
+        if (rest.size() + len > SEND_BACKLOG_LIMIT) {
+            backlog.erase(sockfd);
+            CERR(shutdown(sockfd, SHUT_RDWR) != 0);
+            return;
+        }
+        rest.append(data, len);
+    }
+
+    /**
+     * @brief Send data to a socket, after its backlog, without waiting
+     * @param sockfd The socket
+     * @param frame The data
+     */
+    void deliver(const uint sockfd, const std::string &frame) {
+        size_t sent = 0;
+        if (flush_backlog(sockfd)) {
+            sent = FanoutPool::send_some(sockfd, frame.data(), frame.size());
+        }
+        if (sent < frame.size()) {
+            keep(sockfd, frame.data() + sent, frame.size() - sent);
+        }
+    }
+
+    /**
+     * @brief Get the next item to send. While the queue is empty, the stage
+     * sleeps until an item is added or a socket with a backlog is writable
+     * @param item Will contain the item
+     * @return true An item was taken
+     * @return false The pipeline was stopped, and the queue is empty
+     */
+    bool next_send(send_item &item) {
+        while (!sends.pop(item)) {
+            if (!running.load(std::memory_order_acquire) && sends.empty()) {
+                return false;
+            }
+            if (backlog.empty()) {
+                send_bell.wait([&] {
+                    return !sends.empty() ||
+                           !running.load(std::memory_order_acquire);
+                });
+                continue;
+            }
+
+            send_bell.arm();
+            if (!sends.empty() || !running.load(std::memory_order_acquire)) {
+                send_bell.disarm();
+                continue;
+            }
+            std::vector<pollfd> fds(1);
+            fds[0].fd = send_bell.get_fd();
+            fds[0].events = POLLIN;
+            for (auto &i : backlog) {
+                pollfd fd;
+                fd.fd = i.first;
+                fd.events = POLLOUT;
+                fds.push_back(fd);
+            }
+            CERR(poll(fds.data(), fds.size(), -1) < 0);
+            send_bell.disarm();
+
+            if (fds[0].revents & POLLIN) {
+                send_bell.clear();
+            }
+            for (size_t i = 1; i < fds.size(); ++i) {
+                if (fds[i].revents != 0) {
+                    flush_backlog(fds[i].fd);
+                }
+            }
+        }
+        return true;
+    }
+
+    void fanout_loop() {
+        send_item item;
+        while (next_send(item)) {
+            const std::vector<uint> &sockets =
+                item.list != NULL ? item.list->sockets : item.sockets;
+            if (item.close) {
+                for (uint sockfd : sockets) {
+                    flush_backlog(sockfd);
+                    backlog.erase(sockfd);
+                    CERR(shutdown(sockfd, SHUT_RDWR) != 0);
+                    CERR(close(sockfd) != 0);
+                }
+            } else {
+                // The sockets that have a backlog get the data after it, the
+                // others can be sent to by the pool
+                const std::vector<uint> *ready = &sockets;
+                std::vector<uint> without_backlog;
+                if (!backlog.empty()) {
+                    for (uint sockfd : sockets) {
+                        if (backlog.count(sockfd) != 0) {
+                            deliver(sockfd, item.frame);
+                        } else {
+                            without_backlog.push_back(sockfd);
+                        }
+                    }
+                    ready = &without_backlog;
+                }
+
+                if (pool != NULL && pool->is_active() &&
+                    ready->size() > FANOUT_INLINE_LIMIT) {
+                    pool->send(item.frame, *ready, unsent);
+                    for (const fanout_unsent &u : unsent) {
+                        keep(u.sockfd, item.frame.data() + u.sent,
+                             item.frame.size() - u.sent);
+                    }
+                } else {
+                    for (uint sockfd : *ready) {
+                        deliver(sockfd, item.frame);
+                    }
+                }
+            }
+
+            // The list can be freed, if it was replaced
+            if (item.list != NULL) {
+                list_epoch.store(item.epoch, std::memory_order_release);
+            }
+            fanout_stats.record(item.time);
+        }
+    }
+
+    void persist_loop() {
+        persist_item item;
+        while (next(appends, item, persist_bell)) {
+            size_t written = 0;
+            while (written < item.data.size()) {
+                ssize_t res = write(item.fd, item.data.c_str() + written,
+                                    item.data.size() - written);
+                if (res < 0 && errno == EINTR) {
+                    continue;
+                }
+                CERR(res < 0);
+                if (res < 0) {
+                    break;
+                }
+                written += res;
+            }
+            persist_stats.record(item.time);
+            appends_done.fetch_add(1, std::memory_order_release);
+        }
+    }
+
+   public:
+    Pipeline()
+        : active(false),
+          running(false),
+          udp_sock(-1),
+          stop_fd(-1),
+          ingested(PIPELINE_INGEST_QUEUE),
+          sends(PIPELINE_SEND_QUEUE),
+          appends(PIPELINE_PERSIST_QUEUE),
+          pool(NULL),
+          appends_queued(0),
+          appends_done(0),
+          list_epoch(0) {}
+
+    Pipeline(const Pipeline &other) = delete;
+    Pipeline &operator=(const Pipeline &other) = delete;
+
+    ~Pipeline() { stop(); }
+
+    /**
+     * @brief Start the threads of the pipeline
+     * @param sockfd The UDP socket (read by the ingest stage)
+     * @param fanout Used by the fan-out stage for long subscriber lists
+     */
+    void start(const int sockfd, FanoutPool *fanout = NULL) {
+        udp_sock = sockfd;
+        pool = fanout;
+        stop_fd = eventfd(0, EFD_CLOEXEC);
+        MUST(stop_fd >= 0, "Could not create an eventfd\n");
+
+        running.store(true, std::memory_order_release);
+        active = true;
+        ingest_thread = std::thread(&Pipeline::ingest_loop, this);
+        fanout_thread = std::thread(&Pipeline::fanout_loop, this);
+        persist_thread = std::thread(&Pipeline::persist_loop, this);
+    }
+
+    /**
+     * @brief Stop the pipeline. Everything that was queued is still sent and
+     * written before the threads stop
+     */
+    void stop() {
+        if (!active) {
+            return;
+        }
+
+        running.store(false, std::memory_order_release);
+        lint value = 1;
+        CERR(write(stop_fd, &value, sizeof(value)) < 0);
+        send_bell.ring();
+        persist_bell.ring();
+
+        ingest_thread.join();
+        fanout_thread.join();
+        persist_thread.join();
+        close(stop_fd);
+        active = false;
+    }
+
+    bool is_active() const { return active; }
+
+    /**
+     * @brief Get the fd that becomes readable when there are ingested messages
+     * (after "prepare_wait" returned true)
+     */
+    int get_fd() const { return ingest_bell.get_fd(); }
+
+    /**
+     * @brief Called by the main thread before it waits for events
+     * @return true It can sleep, the fd will be readable when messages arrive
+     * @return false There are messages already, it must not sleep
+     */
+    bool prepare_wait() {
+        ingest_bell.arm();
+        if (!ingested.empty()) {
+            ingest_bell.disarm();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Clear the fd (after select reported it as readable)
+     */
+    void clear_wakeup() { ingest_bell.clear(); }
+
+    /**
+     * @brief Take the next ingested message (main thread)
+     * @param item Will contain the message
+     * @return true A message was taken
+     * @return false There are no messages
+     */
+    bool take(ingest_item &item) { return ingested.pop(item); }
+
+    /**
+     * @brief Record that a message was stored (main thread)
+     * @param time When the message was received
+     */
+    void record_append(const lint time) { append_stats.record(time); }
+
+    /**
+     * @brief Get the epoch of the last subscriber list the fan-out stage has
+     * finished (see EpochReclaimer)
+     */
+    const std::atomic<lint> *get_list_epoch() const { return &list_epoch; }
+
+    /**
+     * @brief Queue a message to be sent to multiple sockets
+     * @param sockets The sockets
+     * @param frame The message
+     * @param time When the message was received
+     */
+    void send(std::vector<uint> &sockets, std::string &frame, const lint time) {
+        send_item item;
+        item.time = time;
+        item.list = NULL;
+        item.epoch = 0;
+        item.sockets = std::move(sockets);
+        item.frame = std::move(frame);
+        item.close = false;
+        push(sends, item, send_bell);
+    }
+
+    /**
+     * @brief Queue a message to be sent to the subscribers of a topic
+     * @param list The subscriber list (not copied, it is used until the
+     * fan-out stage finishes the epoch)
+     * @param epoch The epoch taken for the list
+     * @param frame The message
+     * @param time When the message was received
+     */
+    void send(const subscriber_list *list, const lint epoch,
+              std::string &frame, const lint time) {
+        send_item item;
+        item.time = time;
+        item.list = list;
+        item.epoch = epoch;
+        item.frame = std::move(frame);
+        item.close = false;
+        push(sends, item, send_bell);
+    }
+
+    /**
+     * @brief Queue a message to be sent to a socket
+     * @param sockfd The socket
+     * @param data The message
+     * @param len The size of the message
+     */
+    void send(const uint sockfd, const void *data, const size_t len) {
+        std::vector<uint> sockets(1, sockfd);
+        std::string frame((const char *)data, len);
+        send(sockets, frame, time_ns());
+    }
+
+    /**
+     * @brief Close a socket, after everything queued for it was sent
+     * @param sockfd The socket
+     */
+    void close_socket(const uint sockfd) {
+        send_item item;
+        item.time = time_ns();
+        item.list = NULL;
+        item.epoch = 0;
+        item.sockets.push_back(sockfd);
+        item.close = true;
+        push(sends, item, send_bell);
+    }
+
+    /**
+     * @brief Queue data to be appended to a file (main thread)
+     * @param fd The file
+     * @param data The data
+     */
+    void append(const int fd, const std::string &data) {
+        if (fd < 0 || data.empty()) {
+            return;
+        }
+
+        persist_item item;
+        item.time = time_ns();
+        item.fd = fd;
+        item.data = data;
+        push(appends, item, persist_bell);
+        appends_queued++;
+    }
+
+    /**
+     * @brief Wait until all the queued appends are written (main thread)
+     */
+    void drain() {
+        while (appends_done.load(std::memory_order_acquire) < appends_queued) {
+            persist_bell.ring();
+            sched_yield();
+        }
+    }
+
+    /**
+     * @brief Get the statistics of all the stages
+     * @return std::string One line for every stage
+     */
+    std::string get_stats() const {
+        return ingest_stats.print("ingest", 0, 0) +
+               append_stats.print("append", ingested.size(),
+                                  ingested.capacity()) +
+               fanout_stats.print("fan-out", sends.size(), sends.capacity()) +
+               persist_stats.print("persistence", appends.size(),
+                                   appends.capacity());
+    }
+};
+}  // namespace application
\ No newline at end of file
@@ -0,0 +1,55 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <deque>
+
+#include "RateLimit.hpp"
+#include "Utils.hpp"
+
+#define QUERY_CHUNK 64  // Messages read at once for a range query
+
+namespace application {
+/**
+ * @brief A range of stored messages requested by a client (QUERY)
+ * The messages are read in chunks (from the shard that owns the topic), and
+ * sent at the rate of the query, so a long range doesn't stop the server or
+ * fill the socket of the client.
+ */
+struct range_query {
+    uint sockfd;
+    std::string user;   // The client (its socket can be reused by another)
+    std::string topic;  // The name of the topic
+    uint topic_id;      // Known after the first chunk
+    long next;          // The next message that is read
+    long last;          // The last message of the range
+    lint since;         // The time range (0 if not set), converted to ids
+    lint until;         // when the first chunk is read
+    uint sent;          // The messages sent
+    bool waiting;       // A chunk was requested from another shard
+    rate_limit limit;
+    long chunk_first;               // The id of the first message of the chunk
+    std::deque<std::string> chunk;  // Read, but not sent yet
+};
+}  // namespace application
\ No newline at end of file
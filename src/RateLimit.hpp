@@ -0,0 +1,76 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "Utils.hpp"
+
+#define NS_PER_SECOND 1000000000ULL
+
+namespace application {
+/**
+ * @brief The rate limit of a subscription (sent with SUBSCRIBE)
+ * "rate" is the most messages sent per second, and "every" sends only one of
+ * every "every" messages (0 disables them). The rate is a token bucket that
+ * holds one second of messages, but it is not refilled by a timer: "ready" is
+ * the time when the bucket will be full again, and the tokens are computed
+ * from it when a message arrives. So a subscription costs nothing between
+ * its messages, and the check is a comparison.
+ */
+struct rate_limit {
+    uint rate;
+    uint every;
+    lint ready;    // When the bucket is full (ns, see time_ns)
+    lint seen;     // The messages that were checked
+    lint skipped;  // The messages that were not sent
+
+    /**
+     * @brief Check if the limit does something
+     */
+    bool is_set() const { return rate != 0 || every > 1; }
+
+    /**
+     * @brief Check if a message can be sent now (if not, it is skipped)
+     * @param now The current time (ns)
+     * @return true The message can be sent
+     * @return false The message must be skipped
+     */
+    bool take(const lint now) {
+        if (every > 1 && seen++ % every != 0) {
+            skipped++;
+            return false;
+        }
+        if (rate != 0) {
+            // A message takes "interval" from the bucket, and the bucket
+            // holds one second
+            lint interval = NS_PER_SECOND / rate;
+            if (ready > now + NS_PER_SECOND - interval) {
+                skipped++;
+                return false;
+            }
+            ready = std::max(ready, now) + interval;
+        }
+        return true;
+    }
+};
+}  // namespace application
\ No newline at end of file
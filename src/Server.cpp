@@ -22,8 +22,10 @@
 
 #include "Server.hpp"
 
+#include <deque>
 #include <iostream>
 #include <sstream>
+#include <thread>
 
 std::string require_params() {
     std::stringstream ss;
@@ -31,6 +33,29 @@ std::string require_params() {
     return ss.str();
 }
 
+/**
+ * @brief Run the server as SHARD_COUNT shards, each one on its own thread (the
+ * first one runs on the main thread, and reads the commands)
+ * @param port The port
+ */
+void run_shards(const uint port) {
+    application::ShardRouter router(SHARD_COUNT);
+    std::deque<application::Server> shards;
+    for (uint i = 0; i < SHARD_COUNT; ++i) {
+        shards.emplace_back(port, i, &router);
+    }
+
+    std::vector<std::thread> threads;
+    for (uint i = 1; i < SHARD_COUNT; ++i) {
+        threads.emplace_back(&application::Server::run, &shards[i]);
+    }
+    shards[0].run();
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
 int main(int argc, char *argv[]) {
     // Check if the PORT parameter was specified
     MUST(argc == 2, require_params());
@@ -39,8 +64,12 @@ int main(int argc, char *argv[]) {
     uint port = atoi(argv[1]);
     MUST(port, require_params());
 
-    application::Server server(port);
-    server.run();
+    if (SHARD_COUNT > 1) {
+        run_shards(port);
+    } else {
+        application::Server server(port);
+        server.run();
+    }
 
     return 0;
 }
\ No newline at end of file
@@ -22,248 +22,1883 @@
 
 #pragma once
 
+#include <fcntl.h>  // fcntl
+
+#include <list>
+
+#include "Aggregates.hpp"
+#include "Conflation.hpp"
 #include "Database.hpp"
+#include "FanoutPool.hpp"
+#include "IoUring.hpp"
 #include "Messages.hpp"
+#include "Pipeline.hpp"
+#include "Queries.hpp"
+#include "Shards.hpp"
+#include "ShmRing.hpp"
+#include "TimerWheel.hpp"
 #include "User.hpp"
 #include "Utils.hpp"
 
 namespace application {
+/**
+ * @brief The timers of the server
+ * - HANDSHAKE: a client must send CONNECT before it expires
+ * - HEARTBEAT: a heartbeat is sent to a client (and its silence is checked)
+ * - AGGREGATES: the next aggregate window ends
+ * - QUERIES: the range queries can send again
+ */
+enum class timer_kind : uint { HANDSHAKE, HEARTBEAT, AGGREGATES, QUERIES };
+
+/**
+ * @brief The timer of a client (HANDSHAKE until it sends its id, HEARTBEAT
+ * after that)
+ */
+struct client_timer {
+    lint id;         // 0 if it has no timer
+    lint last_seen;  // When something was received from it
+    lint accepted;   // Its key in the pending handshakes (0 after CONNECT)
+};
+
 class Server {
    private:
     uint main_port, main_tcp_sock, udp_sock, max_fd;
+    int unix_sock;  // Listens for the local clients (-1 if there is none)
     fd_set read_fds, tmp_fds;
+    fd_set write_fds, tmp_write_fds;  // Clients with data waiting
     sockaddr_in listen_addr;
     Database db;
+    IoUring io;
+    FanoutPool fanout;
+    Pipeline pipeline;
+    Conflator conflator;
+    Aggregator aggregator;
+    std::list<range_query> queries;  // The range queries that are being sent
+    ShmRing shm;  // The messages, for the local readers (see ENABLE_SHM_RING)
+    int multicast_sock;  // Sends the broadcast topics (-1 if there is none)
+    std::unordered_map<uint, sockaddr_in> groups;  // Of the topics, by id
+    TimerWheel timers;
+    std::unordered_map<uint, client_timer> client_timers;  // By socket
+    lint aggregate_timer, query_timer;  // The timers (0 if not set)
+    lint query_deadline;                // When the query timer expires
+    std::map<lint, uint> handshakes;  // The sockets without an id, oldest first
+    lint accepted, shed;  // The connections that were accepted, and closed
+                          // because there were too many handshakes
+    int spare_fd;         // Closed to accept a connection when the process
+                          // has no descriptors left (see accept_connections)
+    uint shard;           // The index of this shard (0 if it is not sharded)
+    ShardRouter *router;  // Connects the shards (NULL if it is not sharded)
+    std::unordered_map<uint, std::string> inboxes;  // Incomplete messages
+    int corked;  // The client whose messages are kept (-1 if none, see cork)
+    std::string cork_buffer;
 
     /**
      * @brief Clear the file descriptors
      */
-    void clear_fds() {
-        FD_ZERO(&read_fds);
-        FD_ZERO(&tmp_fds);
+    void clear_fds() {
+        FD_ZERO(&read_fds);
+        FD_ZERO(&tmp_fds);
+        FD_ZERO(&write_fds);
+        FD_ZERO(&tmp_write_fds);
+    }
+
+    /**
+     * @brief Close a socket
+     * @param sockfd The socket to be closed
+     */
+    void close_skt(int sockfd) {
+        if (pipeline.is_active()) {
+            // Closed after everything queued for it is sent
+            pipeline.close_socket(sockfd);
+            return;
+        }
+        if (io.is_active()) {
+            io.forget_socket(sockfd);
+        }
+        CERR(shutdown(sockfd, SHUT_RDWR) != 0);
+        CERR(close(sockfd) != 0);
+    }
+
+    /**
+     * @brief Prepare, bind and start listening
+     */
+    void init_connections() {
+        MUST(bind(main_tcp_sock, (sockaddr *)&listen_addr, sizeof(sockaddr)) >=
+                 0,
+             "Could not bind tcp socket\n");
+        MUST(listen(main_tcp_sock, ACCEPT_BACKLOG) >= 0,
+             "Could not start listening for tcp connections\n");
+        MUST(bind(udp_sock, (sockaddr *)&listen_addr, sizeof(sockaddr)) >= 0,
+             "Could not bind udp socket\n");
+
+        // The sender threads (io_uring sends are queued by the main thread, and
+        // every shard sends from its own thread)
+        if (!io.is_active() && router == NULL) {
+            fanout.start(FANOUT_THREADS);
+        }
+
+        // Set the file descriptors for the sockets
+        FD_SET(main_tcp_sock, &read_fds);
+        max_fd = main_tcp_sock;
+
+        // The messages of the topics of this shard are also written in
+        // shared memory, for the local readers
+        // (like the Unix socket, the ring of a running server is not replaced)
+        if (ENABLE_SHM_RING) {
+            std::string segment = ShmRing::segment_name(main_port, shard);
+            MUST(!ShmRing::is_owned(segment),
+                 "Another server writes the ring " + segment + "\n");
+            shm.create(segment, router != NULL ? router->get_count() : 1);
+        }
+
+        // The broadcast topics of this shard are also sent to their groups
+        if (ENABLE_MULTICAST) {
+            open_multicast();
+        }
+
+        // Only the first shard listens for the local clients (they are given
+        // to the other shards like the others)
+        if (ENABLE_UNIX_SOCKET && shard == 0) {
+            listen_local();
+        }
+        if (unix_sock >= 0) {
+            FD_SET(unix_sock, &read_fds);
+            max_fd = std::max(max_fd, (uint)unix_sock);
+        }
+
+        if (router != NULL) {
+            // The messages from the other shards
+            FD_SET(router->get_fd(shard), &read_fds);
+            max_fd = std::max(max_fd, (uint)router->get_fd(shard));
+        }
+
+        if (ENABLE_PIPELINE && router == NULL) {
+            // The datagrams are received by the ingest thread, the server
+            // waits for the parsed messages
+            pipeline.start(udp_sock, &fanout);
+            db.set_writer(&pipeline);
+            db.add_list_reader(pipeline.get_list_epoch());
+            FD_SET(pipeline.get_fd(), &read_fds);
+            max_fd = std::max(max_fd, (uint)pipeline.get_fd());
+        } else if (io.is_active()) {
+            // The datagrams are received by the engine, the server waits for
+            // its completions
+            io.listen_datagrams(udp_sock);
+            FD_SET(io.get_fd(), &read_fds);
+            max_fd = std::max(max_fd, (uint)io.get_fd());
+        } else {
+            FD_SET(udp_sock, &read_fds);
+            max_fd = std::max(max_fd, udp_sock);
+        }
+
+        // Set the file descriptor for STDIN (only the first shard reads the
+        // commands)
+        if (shard == 0) {
+            FD_SET(STDIN_FILENO, &read_fds);
+        }
+    }
+
+    /**
+     * @brief Create the socket that sends the messages of the broadcast
+     * topics to their multicast groups (see multicast_group). The datagrams
+     * are looped back, so the receivers on this host get them too
+     */
+    void open_multicast() {
+        int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        CERR(sock < 0);
+        if (sock < 0) {
+            return;
+        }
+
+        const uchar ttl = MULTICAST_TTL, loop = 1;
+        in_addr interface;
+        MUST(inet_aton(MULTICAST_INTERFACE, &interface) != 0,
+             "Invalid multicast interface\n");
+        CERR(setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl,
+                        sizeof(ttl)) != 0);
+        CERR(setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop,
+                        sizeof(loop)) != 0);
+        CERR(setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &interface,
+                        sizeof(interface)) != 0);
+        multicast_sock = sock;
+    }
+
+    /**
+     * @brief Send a message of a topic to its multicast group, if it is a
+     * broadcast topic (see MULTICAST_TOPICS). It is sent once, for any number
+     * of receivers, and a receiver that misses one asks for it with a query
+     * @param topic_id The id of the topic
+     * @param topic The name of the topic
+     * @param text The message
+     */
+    void multicast(const uint topic_id, const std::string &topic,
+                   const std::string &text) {
+        auto it = groups.find(topic_id);
+        if (it == groups.end()) {
+            // The pattern is checked once for every topic
+            sockaddr_in group;
+            bzero(&group, sizeof(group));
+            if (TopicTrie::matches(MULTICAST_TOPICS, topic)) {
+                multicast_group(topic, main_port, group);
+            }
+            it = groups.emplace(topic_id, group).first;
+        }
+        if (it->second.sin_family != AF_INET) {
+            return;
+        }
+
+        udp_multicast msg;
+        size_t size = write_multicast(
+            topic, db.get_topic(topic_id).get_last_id(), text, msg);
+        CERR(sendto(multicast_sock, &msg, size, 0, (sockaddr *)&it->second,
+                    sizeof(it->second)) < 0);
+    }
+
+    /**
+     * @brief Get the shard that owns a topic
+     * @param topic_id The id of the topic
+     */
+    uint owner_of(const uint topic_id) const {
+        return topic_id % router->get_count();
+    }
+
+    /**
+     * @brief Tell the other shards to close (if the server is sharded)
+     */
+    void stop_shards() {
+        if (router == NULL) {
+            return;
+        }
+        for (uint i = 0; i < router->get_count(); ++i) {
+            if (i != shard) {
+                shard_message msg{};
+                msg.type = shard_msg_type::STOP;
+                router->send(shard, i, msg);
+            }
+        }
+        while (!router->flush(shard)) {
+            nsleep(1000);
+        }
+    }
+
+    /**
+     * @brief Handle the messages sent by the other shards (at most
+     * SHARD_BATCH, the others are handled in the next iteration)
+     * @return true The server must close
+     * @return false Continue the program
+     */
+    bool read_shards() {
+        shard_message msg;
+        for (uint i = 0; i < SHARD_BATCH && router->receive(shard, msg); ++i) {
+            switch (msg.type) {
+                case shard_msg_type::ADOPT:
+                    FD_SET(msg.sockfd, &read_fds);
+                    max_fd = std::max(max_fd, (uint)msg.sockfd);
+                    // The messages sent after the id
+                    if (connect_user(msg.sockfd, msg.user, msg.addr) &&
+                        !msg.texts.empty()) {
+                        inboxes[msg.sockfd] = msg.texts[0];
+                        read_inbox(msg.sockfd);
+                    }
+                    break;
+                case shard_msg_type::PUBLISH:
+                    publish(msg.name, msg.texts[0], msg.time);
+                    break;
+                case shard_msg_type::DELIVER:
+                    db.remote_message(msg.topic, msg.msg_id);
+                    deliver(msg.topic, msg.msg_id, msg.texts[0], msg.time);
+                    break;
+                case shard_msg_type::SUBSCRIBE:
+                    subscribe_shard(msg, msg.from);
+                    break;
+                case shard_msg_type::SUBSCRIBED:
+                    subscribed_remote(msg);
+                    break;
+                case shard_msg_type::RELEASE:
+                    db.remove_shard_subscriber(msg.topic, msg.from);
+                    break;
+                case shard_msg_type::REPLAY: {
+                    if (!db.topic_exists(msg.topic)) {
+                        break;
+                    }
+                    Topic &topic = db.get_topic(msg.topic);
+
+                    shard_message reply{};
+                    reply.type = shard_msg_type::REPLAYED;
+                    reply.topic = msg.topic;
+                    reply.msg_id = topic.get_backlog(
+                        msg.msg_id, reply.texts, msg.options & SUB_CONFLATE);
+                    reply.user = msg.user;
+                    router->send(shard, msg.from, reply);
+                } break;
+                case shard_msg_type::REPLAYED:
+                    replayed_remote(msg);
+                    break;
+                case shard_msg_type::AGGREGATE:
+                    aggregator.add(msg.name, time_ns());
+                    schedule_aggregates();
+                    break;
+                case shard_msg_type::WILDCARD:
+                    add_wildcard(msg.msg_id, wildcard_subscription{
+                                                 msg.name, msg.user, msg.from,
+                                                 msg.sf, msg.options,
+                                                 msg.filter, msg.limit});
+                    break;
+                case shard_msg_type::UNWILDCARD:
+                    db.remove_wildcard(msg.msg_id);
+                    break;
+                case shard_msg_type::QUERY: {
+                    shard_message reply{};
+                    reply.type = shard_msg_type::QUERIED;
+                    reply.name = msg.name;
+                    reply.last = msg.last;
+                    reply.msg_id =
+                        read_query(msg.name, msg.msg_id, reply.last, msg.time,
+                                   msg.until, reply.texts, reply.topic);
+                    reply.user = msg.user;
+                    router->send(shard, msg.from, reply);
+                } break;
+                case shard_msg_type::QUERIED:
+                    for (range_query &q : queries) {
+                        if (q.waiting && q.user == msg.user &&
+                            q.topic == msg.name) {
+                            add_chunk(q, msg.topic, msg.msg_id, msg.last,
+                                      msg.texts);
+                            break;
+                        }
+                    }
+                    break;
+                case shard_msg_type::STOP:
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief A client of another shard subscribes to a topic of this one. From
+     * now on, the messages are sent to that shard, and it is sent the id of
+     * the topic (SUBSCRIBED)
+     * @param msg The subscription (SUBSCRIBE)
+     * @param from The shard of the client
+     */
+    void subscribe_shard(const shard_message &msg, const uint from) {
+        uint id = add_topic(msg.name);
+        db.add_shard_subscriber(id, from);
+
+        shard_message reply{};
+        reply.type = shard_msg_type::SUBSCRIBED;
+        reply.topic = id;
+        reply.msg_id = db.get_topic(id).get_last_id();
+        reply.sf = msg.sf;
+        reply.options = msg.options;
+        reply.filter = msg.filter;
+        reply.limit = msg.limit;
+        if (msg.options & SUB_SNAPSHOT) {
+            reply.texts.push_back(db.get_topic(id).get_last_message());
+        }
+        reply.name = msg.name;
+        reply.user = msg.user;
+        router->send(shard, from, reply);
+    }
+
+    /**
+     * @brief A client of this shard was subscribed to a topic of another shard
+     * (the reply to a SUBSCRIBE)
+     * @param msg The reply
+     */
+    void subscribed_remote(const shard_message &msg) {
+        db.add_remote_topic(msg.topic, msg.name, msg.msg_id);
+
+        bool subscribed = false;
+        if (db.user_exists(msg.user)) {
+            User &u = db.get_user(msg.user);
+            subscribed = db.subscribe_remote(u, msg.topic, msg.sf, msg.msg_id,
+                                             msg.options, &msg.filter,
+                                             &msg.limit);
+            if (u.is_online()) {
+                send_topic_id(u.get_socket(), msg.name);
+                if (!msg.texts.empty()) {
+                    send_snapshot(u, msg.topic, msg.texts[0]);
+                }
+            }
+        }
+
+        if (!subscribed) {
+            // The other shard counted a subscriber that doesn't exist
+            shard_message release{};
+            release.type = shard_msg_type::RELEASE;
+            release.topic = msg.topic;
+            router->send(shard, msg.from, release);
+        }
+    }
+
+    /**
+     * @brief Send the messages a client has missed on a topic of another shard
+     * (the reply to a REPLAY)
+     * @param msg The reply
+     */
+    void replayed_remote(const shard_message &msg) {
+        // The new messages are sent after these
+        db.resume_subscription(msg.user, msg.topic);
+        if (!db.user_exists(msg.user)) {
+            return;
+        }
+
+        User &u = db.get_user(msg.user);
+        if (u.is_online() && u.is_subscribed(msg.topic) &&
+            !replay(u, msg.topic, msg.msg_id, msg.texts)) {
+            unsubscribe_user(u, msg.topic);
+        }
+    }
+
+    /**
+     * @brief Send the messages a store-forward client has missed on a topic
+     * (see Topic::get_backlog). If the older ones were over the limits, the
+     * client is told how many of them were skipped (a conflated subscription
+     * only receives the newest one)
+     * @param u The client
+     * @param topic_id The topic
+     * @param first_id The id of the first message
+     * @param texts The messages, one for every id (an empty one is invalid,
+     * and is skipped)
+     * @return true The messages were sent
+     * @return false Some messages were over the limits, and the subscription
+     * must be dropped (SF_DROP_ON_OVERFLOW)
+     */
+    bool replay(User &u, const uint topic_id, const long first_id,
+                const std::vector<std::string> &texts) {
+        long skipped = first_id - 1 - u.get_last_id(topic_id);
+        if (skipped > 0) {
+            if (!u.is_conflated(topic_id)) {
+                if (SF_DROP_ON_OVERFLOW) {
+                    return false;
+                }
+                send_skipped(u.get_socket(), topic_id, skipped);
+            }
+            u.sent_message_set(topic_id, first_id - 1);
+        }
+
+        long curr_id = first_id;
+        for (auto &text : texts) {
+            // It may have received some of them already (if it reconnected
+            // again, while they were requested from another shard)
+            if (curr_id > u.get_last_id(topic_id)) {
+                if (!text.empty() && passes_filter(u, topic_id, text)) {
+                    send_message_on_topic(topic_id, text, u, curr_id);
+                } else if (!u.is_acked(topic_id)) {
+                    u.sent_message_set(topic_id, curr_id);
+                }
+            }
+            curr_id++;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Read and execute commands from STDIN
+     * Will return whether the program should close.
+     * @return true Close the program
+     * @return false Continue the program
+     */
+    bool read_input() {
+        std::string command;
+        std::cin >> command;
+
+        if (command == "exit") {
+            stop_shards();
+            return true;
+        } else if (command == "stats") {
+            if (pipeline.is_active()) {
+                std::cout << pipeline.get_stats();
+            } else {
+                std::cout << "The pipeline is not enabled\n";
+            }
+            if (fanout.is_active()) {
+                std::cout << fanout.get_stats();
+            }
+            std::cout << conflator.get_stats();
+            std::cout << "connections: " << accepted << " accepted, " << shed
+                      << " shed, " << handshakes.size() << " handshakes\n";
+        } else if (command == "limits") {
+            // The messages skipped by the rate limited subscriptions
+            lint total = 0;
+            for (User *u : db.get_users()) {
+                for (auto &i : u->get_limits()) {
+                    std::cout << u->get_id() << " "
+                              << db.get_topic_name(i.first) << ": "
+                              << i.second.skipped << " skipped\n";
+                    total += i.second.skipped;
+                }
+            }
+            std::cout << "rate limits: " << total << " skipped\n";
+        } else if (command == "backlog") {
+            // The stored messages that the offline clients will receive
+            for (User *u : db.get_users()) {
+                std::pair<lint, lint> backlog = db.get_backlog(*u);
+                if (backlog.first > 0) {
+                    std::cout << u->get_id() << ": " << backlog.first
+                              << " missed messages, " << backlog.second
+                              << " kept\n";
+                }
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief This function receives a UDP message from the udp socket
+     */
+    void read_udp_message() {
+        char buffer[UDP_MSG_SIZE];
+        bzero(&buffer, UDP_MSG_SIZE);
+
+        sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        ssize_t msg_size = recvfrom(udp_sock, &buffer, sizeof(buffer), 0,
+                                    (sockaddr *)&client_addr, &client_len);
+        CERR(msg_size < 0);
+
+        process_udp_message(buffer, msg_size, client_addr);
+    }
+
+    /**
+     * @brief Receive the datagrams that the io_uring engine has received (and
+     * complete its other operations)
+     */
+    void read_io_completions() {
+        io.reap();
+        for (auto &d : io.take_datagrams()) {
+            process_udp_message(d.data, d.size, d.addr);
+        }
+    }
+
+    /**
+     * @brief Receive the messages parsed by the ingest stage of the pipeline
+     */
+    void read_pipeline() {
+        ingest_item item;
+        while (pipeline.take(item)) {
+            publish(item.topic, item.text, item.time);
+        }
+    }
+
+    /**
+     * @brief This function parses and does different things based on UDP
+     * messages it receives
+     * @param buffer The received data
+     * @param msg_size The size of the data
+     * @param client_addr The adress of the sender
+     */
+    void process_udp_message(const char *buffer, const ssize_t msg_size,
+                             const sockaddr_in &client_addr) {
+        std::string topic, text;
+        // The aggregate topics are only published by the server (and the
+        // patterns are not topics)
+        if (format_udp_message(buffer, msg_size, client_addr, topic, text) &&
+            !Aggregator::is_aggregate(topic) && !TopicTrie::is_pattern(topic)) {
+            publish(topic, text, 0);
+        }
+    }
+
+    /**
+     * @brief Store a message and send it to the subscribers of its topic
+     * @param topic The topic
+     * @param text The message (as it is shown to the clients)
+     * @param time When the message was received (used by the pipeline)
+     */
+    void publish(const std::string &topic, const std::string &text,
+                 const lint time) {
+        // The messages are stored in a file named after the topic
+        if (!DataFolder::is_valid_name(topic)) {
+            console_log("Invalid topic name: " + topic + "\n");
+            return;
+        }
+
+        // The message is stored by the shard that owns the topic
+        if (router != NULL && router->shard_of(topic) != shard) {
+            shard_message msg{};
+            msg.type = shard_msg_type::PUBLISH;
+            msg.time = time;
+            msg.name = topic;
+            msg.texts.push_back(text);
+            router->send(shard, router->shard_of(topic), msg);
+            return;
+        }
+
+        // Add the topic if it didn't exist
+        uint topic_id = add_topic(topic);
+
+        // Store the message
+        db.topic_new_message(topic_id, text);
+        if (shm.is_active()) {
+            shm.publish(topic, db.get_topic(topic_id).get_last_id(), text);
+        }
+        if (multicast_sock >= 0) {
+            multicast(topic_id, topic, text);
+        }
+        if (pipeline.is_active()) {
+            pipeline.record_append(time);
+        }
+
+        // Show the message on the server (if logs are enabled)
+        console_log(text + "\n");
+
+        // The other shards send it to their clients
+        lint shards = db.get_subscribed_shards(topic_id);
+        for (uint i = 0; shards != 0; ++i, shards >>= 1) {
+            if (shards & 1) {
+                shard_message msg{};
+                msg.type = shard_msg_type::DELIVER;
+                msg.topic = topic_id;
+                msg.msg_id = db.get_topic(topic_id).get_last_id();
+                msg.time = time;
+                msg.texts.push_back(text);
+                router->send(shard, i, msg);
+            }
+        }
+
+        deliver(topic_id, db.get_topic(topic_id).get_last_id(), text, time);
+
+        // Update the aggregates of the topic
+        if (!aggregator.empty()) {
+            std::vector<aggregate_result> closed;
+            aggregator.update(topic, text, time_ns(), closed);
+            publish_aggregates(closed);
+        }
+    }
+
+    /**
+     * @brief Publish the results of the aggregate windows that were closed
+     * (like the messages received on the aggregate topics)
+     * @param closed The results
+     */
+    void publish_aggregates(const std::vector<aggregate_result> &closed) {
+        for (const aggregate_result &result : closed) {
+            udp_message msg;
+            ssize_t size = Aggregator::make_message(result, msg);
+
+            std::string topic, text;
+            if (format_udp_message((const char *)&msg, size, listen_addr,
+                                   topic, text)) {
+                publish(topic, text, 0);
+            }
+        }
+    }
+
+    /**
+     * @brief Close the aggregate windows that have ended, and publish them
+     */
+    void close_aggregates() {
+        std::vector<aggregate_result> closed;
+        aggregator.close_windows(time_ns(), closed);
+        publish_aggregates(closed);
+        schedule_aggregates();
+    }
+
+    /**
+     * @brief Set the aggregate timer to the end of the next window (a window
+     * that was closed by a message makes it expire early, see
+     * close_aggregates)
+     */
+    void schedule_aggregates() {
+        if (aggregate_timer != 0) {
+            timers.cancel(aggregate_timer);
+            aggregate_timer = 0;
+        }
+        if (!aggregator.empty()) {
+            aggregate_timer = timers.add(aggregator.next_close(),
+                                         (uint)timer_kind::AGGREGATES, 0);
+        }
+    }
+
+    /**
+     * @brief Start computing an aggregate topic (by the shard that owns its
+     * topic)
+     * @param name The name of the aggregate topic
+     */
+    void add_aggregate(const std::string &name) {
+        std::string topic;
+        window_aggregate aggregate;
+        if (!Aggregator::parse(name, topic, aggregate)) {
+            return;
+        }
+
+        if (router != NULL && router->shard_of(topic) != shard) {
+            shard_message msg{};
+            msg.type = shard_msg_type::AGGREGATE;
+            msg.name = name;
+            router->send(shard, router->shard_of(topic), msg);
+        } else {
+            aggregator.add(name, time_ns());
+            schedule_aggregates();
+        }
+    }
+
+    /**
+     * @brief Send a message to the clients (of this shard) subscribed to its
+     * topic
+     * The online subscribers are read from the list of the topic, that is
+     * never changed (a subscription builds a new list), so the message can be
+     * sent by other threads while the subscriptions change. The clients don't
+     * need to be updated for every message (see Database::user_disconnect)
+     * @param topic_id The topic
+     * @param msg_id The id of the message
+     * @param text The message
+     * @param time When the message was received (used by the pipeline)
+     */
+    void deliver(const uint topic_id, const long msg_id,
+                 const std::string &text, const lint time) {
+        const subscriber_list *list = db.get_subscriber_list(topic_id);
+        if (list == NULL) {
+            return;
+        }
+
+        tcp_message msg;
+        make_data_message(text, msg, topic_id, msg_id);
+        std::string frame((const char *)&msg, TCP_DATA_DATA + 1);
+
+        if (!list->filtered.empty()) {
+            // The value is decoded once, and each filter is checked once for
+            // all the subscribers that have it
+            message_value value;
+            bool decoded =
+                decode_message(text, db.get_topic_name(topic_id), value);
+            for (const filter_group &group : list->filtered) {
+                if (decoded && group.filter.matches(value, text)) {
+                    send_to(group.sockets, group.conflated, topic_id, msg,
+                            frame, time);
+                }
+            }
+        }
+
+        if (!list->limited.empty()) {
+            send_limited(list->limited, topic_id, text, msg, frame);
+        }
+
+        if (pipeline.is_active()) {
+            // The fan-out thread sends every message
+            for (uint sockfd : list->conflated) {
+                send_tcp_message(sockfd, msg, TCP_DATA_DATA + 1);
+            }
+            // The same message is sent to all of them (the frame is moved,
+            // so this is done last)
+            if (!list->sockets.empty()) {
+                pipeline.send(list, db.next_list_epoch(), frame, time);
+            }
+        } else {
+            send_to(list->sockets, list->conflated, topic_id, msg, frame,
+                    time);
+        }
+    }
+
+    /**
+     * @brief Send a message to the rate limited subscribers of a topic (the
+     * limit of each one is checked, see rate_limit). The clock is read once,
+     * and the message is decoded once, if some of them have a filter
+     * @param limited The subscribers
+     * @param topic_id The id of the topic
+     * @param text The message
+     * @param msg The message, as it is sent
+     * @param frame The bytes of the message
+     */
+    void send_limited(const std::vector<limited_subscriber> &limited,
+                      const uint topic_id, const std::string &text,
+                      const tcp_message &msg, const std::string &frame) {
+        lint now = time_ns();
+        message_value value;
+        bool decoded = false, checked = false;
+
+        for (const limited_subscriber &sub : limited) {
+            if (sub.filter != NULL) {
+                if (!checked) {
+                    decoded = decode_message(text, db.get_topic_name(topic_id),
+                                             value);
+                    checked = true;
+                }
+                if (!decoded || !sub.filter->matches(value, text)) {
+                    continue;
+                }
+            }
+            if (!sub.limit->take(now)) {
+                continue;
+            }
+
+            if (sub.conflated && !pipeline.is_active()) {
+                send_conflated(sub.sockfd, topic_id, frame);
+            } else {
+                send_tcp_message(sub.sockfd, msg, TCP_DATA_DATA + 1);
+            }
+        }
+    }
+
+    /**
+     * @brief Send a message to some of the subscribers of a topic
+     * @param sockets The sockets of the subscribers
+     * @param conflated The sockets of the conflated subscribers
+     * @param topic_id The id of the topic
+     * @param msg The message
+     * @param frame The bytes of the message
+     * @param time When the message was received
+     */
+    void send_to(const std::vector<uint> &sockets,
+                 const std::vector<uint> &conflated, const uint topic_id,
+                 const tcp_message &msg, const std::string &frame,
+                 const lint time) {
+        if (pipeline.is_active()) {
+            std::vector<uint> all(sockets);
+            all.insert(all.end(), conflated.begin(), conflated.end());
+            std::string copy(frame);
+            pipeline.send(all, copy, time);
+            return;
+        }
+
+        // The clients that have data waiting get the message after it, the
+        // others can be sent to by the sender threads
+        const std::vector<uint> *ready = &sockets;
+        std::vector<uint> without_partial;
+        if (conflator.has_partials()) {
+            for (uint sockfd : sockets) {
+                if (conflator.get_partial(sockfd) != NULL) {
+                    send_tcp_message(sockfd, msg, TCP_DATA_DATA + 1);
+                } else {
+                    without_partial.push_back(sockfd);
+                }
+            }
+            ready = &without_partial;
+        }
+
+        if (fanout.is_active() && ready->size() > FANOUT_INLINE_LIMIT) {
+            // Too many subscribers to send it from this thread only
+            std::vector<fanout_unsent> unsent;
+            fanout.send(frame, *ready, unsent);
+            for (const fanout_unsent &u : unsent) {
+                keep_unsent(u.sockfd, frame.data() + u.sent,
+                            frame.size() - u.sent);
+            }
+        } else {
+            for (uint sockfd : *ready) {
+                send_tcp_message(sockfd, msg, TCP_DATA_DATA + 1);
+            }
+        }
+
+        for (uint sockfd : conflated) {
+            send_conflated(sockfd, topic_id, frame);
+        }
+    }
+
+    /**
+     * @brief Send a message to a conflated subscriber. If the client can't
+     * receive it now, it waits (replacing the older message of the topic that
+     * waits, if there is one, see Conflator)
+     * @param sockfd The socket of the client
+     * @param topic_id The topic
+     * @param frame The message
+     */
+    void send_conflated(const uint sockfd, const uint topic_id,
+                        const std::string &frame) {
+        if (!conflator.holds(sockfd) && send_now(sockfd, frame)) {
+            return;
+        }
+        conflator.hold(sockfd, topic_id, frame);
+        if (!io.is_active()) {
+            // Sent when the socket is writable
+            FD_SET(sockfd, &write_fds);
+        }
+    }
+
+    /**
+     * @brief Send a message only if the socket can take it now (with io_uring,
+     * if nothing else waits to be sent on it). If only a part of it fits, the
+     * rest is kept by the conflator
+     * @param sockfd The socket
+     * @param frame The message
+     * @return true The message was taken (or the socket is broken)
+     * @return false The socket can't take it
+     */
+    bool send_now(const uint sockfd, const std::string &frame) {
+        if (io.is_active()) {
+            if (io.has_pending(sockfd)) {
+                return false;
+            }
+            io.send(sockfd, frame.data(), frame.size());
+            return true;
+        }
+
+        ssize_t res = send(sockfd, frame.data(), frame.size(),
+                           MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (res < 0) {
+            return errno != EAGAIN && errno != EWOULDBLOCK;
+        }
+        if ((size_t)res < frame.size()) {
+            conflator.set_partial(sockfd, frame.substr(res));
+        }
+        return true;
+    }
+
+    /**
+     * @brief Send the data that waits on a socket (the rest of a message that
+     * was partly sent), as much as it can take now
+     * @param sockfd The socket
+     * @return true Nothing is left
+     * @return false The socket can't take the rest now
+     */
+    bool send_partial(const uint sockfd) {
+        std::string *rest = conflator.get_partial(sockfd);
+        if (rest == NULL) {
+            return true;
+        }
+
+        size_t sent = FanoutPool::send_some(sockfd, rest->data(), rest->size());
+        if (sent < rest->size()) {
+            rest->erase(0, sent);
+            return false;
+        }
+        conflator.clear_partial(sockfd);
+        return true;
+    }
+
+    /**
+     * @brief Keep the data a client can't take now, after the data that waits
+     * for it (sent when its socket is writable). If the client has more than
+     * SEND_BACKLOG_LIMIT bytes waiting, it doesn't read its messages: its
+     * connection is shut down (it is closed when the end of the connection is
+     * read, and the sends until then fail)
+     * @param sockfd The socket of the client
+     * @param data The data
+     * @param len The size of the data
+     */
+    void keep_unsent(const uint sockfd, const char *data, const size_t len) {
+        std::string *rest = conflator.get_partial(sockfd);
+        size_t waiting = rest != NULL ? rest->size() : 0;
+        if (waiting + len > SEND_BACKLOG_LIMIT) {
+            console_log("Client on socket " + std::to_string(sockfd) +
+                        " doesn't read its messages\n");
+            conflator.forget(sockfd);
+            FD_CLR(sockfd, &write_fds);
+            CERR(shutdown(sockfd, SHUT_RDWR) != 0);
+            return;
+        }
+
+        if (rest != NULL) {
+            rest->append(data, len);
+        } else {
+            conflator.set_partial(sockfd, std::string(data, len));
+        }
+        FD_SET(sockfd, &write_fds);
+    }
+
+    /**
+     * @brief Send the conflated messages that wait for a client, while it can
+     * receive them (with io_uring, all of them, when nothing else waits)
+     * @param sockfd The socket of the client
+     * @return true Nothing waits anymore
+     * @return false Some messages still wait
+     */
+    bool flush_conflated(const uint sockfd) {
+        if (io.is_active() && io.has_pending(sockfd)) {
+            return false;
+        }
+
+        const std::string *frame;
+        while (send_partial(sockfd) &&
+               (frame = conflator.peek(sockfd)) != NULL) {
+            if (io.is_active()) {
+                io.send(sockfd, frame->data(), frame->size());
+            } else if (!send_now(sockfd, *frame)) {
+                return false;
+            }
+            conflator.pop(sockfd);
+        }
+        return !conflator.holds(sockfd);
+    }
+
+    /**
+     * @brief Build a DATA message
+     * @param text The text of the message
+     * @param msg Will contain the message
+     * @param topic_id The topic of the message
+     * @param msg_id The id of the message on its topic
+     */
+    void make_data_message(const std::string &text, tcp_message &msg,
+                           const uint topic_id, const long msg_id) {
+        tcp_data data;
+        bzero(&msg, TCP_MSG_SIZE);
+        bzero(&data, TCP_DATA_DATA);
+
+        safe_cpy(data.payload, text.c_str(),
+                 std::min(text.size(), (size_t)TCP_DATA_TEXT - 1));
+        data.topic = topic_id;
+        data.id = msg_id;
+
+        msg.type = tcp_msg_type::DATA;
+        memcpy(msg.payload, &data, TCP_DATA_DATA);
+    }
+
+    /**
+     * @brief Send a message to a client
+     * If the io_uring engine is used, the message is only queued, and will be
+     * sent (with the others) at the end of the event loop iteration
+     * @param sockfd The socket of the client
+     * @param msg The message
+     * @param len The size of the message
+     */
+    void send_tcp_message(const uint sockfd, const tcp_message &msg,
+                          const size_t len) {
+        send_bytes(sockfd, &msg, len);
+    }
+
+    /**
+     * @brief Send data (one or more messages) to a client, see
+     * send_tcp_message
+     * @param sockfd The socket of the client
+     * @param data The data
+     * @param len The size of the data
+     */
+    void send_bytes(const uint sockfd, const void *data, const size_t len) {
+        if ((int)sockfd == corked) {
+            cork_buffer.append((const char *)data, len);
+        } else if (pipeline.is_active()) {
+            pipeline.send(sockfd, data, len);
+        } else if (io.is_active()) {
+            io.send(sockfd, data, len);
+        } else {
+            // After the data that waits for the client, if there is some
+            size_t sent = 0;
+            if (send_partial(sockfd)) {
+                sent = FanoutPool::send_some(sockfd, (const char *)data, len);
+            }
+            if (sent < len) {
+                keep_unsent(sockfd, (const char *)data + sent, len - sent);
+            }
+        }
+    }
+
+    /**
+     * @brief Keep the messages sent to a client, until uncork is called. They
+     * are sent together, with a single system call (used for the replies to
+     * a batch message)
+     * @param sockfd The socket of the client
+     */
+    void cork(const uint sockfd) { corked = sockfd; }
+
+    /**
+     * @brief Send the messages kept by cork
+     */
+    void uncork() {
+        int sockfd = corked;
+        corked = -1;
+        if (sockfd != -1 && !cork_buffer.empty()) {
+            send_bytes(sockfd, cork_buffer.data(), cork_buffer.size());
+        }
+        cork_buffer.clear();
+    }
+
+    /**
+     * @brief Connect a client, after it has sent its id
+     * If it is a known client, the topics it is subscribed to and the messages
+     * it has missed (for the store-forward subscriptions) are sent to it
+     * @param sockfd The socket of the client
+     * @param name The id of the client
+     * @param client_addr The adress of the client
+     * @return true The client is connected
+     * @return false The id is used by a connected client. The socket is still
+     * a pending handshake (closed when its timer expires), or it is closed now
+     * if it was handed over by another shard (it has no timer here)
+     */
+    bool connect_user(const uint sockfd, const std::string &name,
+                      const sockaddr_in &client_addr) {
+        std::string ip = client_addr.sin_family == AF_UNIX
+                             ? "local"
+                             : std::string(inet_ntoa(client_addr.sin_addr));
+        User user = User(name, ip, sockfd, ntohs(client_addr.sin_port));
+        std::string user_id = user.get_id();
+
+        if (!db.user_exists(name)) {
+            // New user - add him to the database
+            watch_client(sockfd);
+            db.add_user(user);
+
+            std::cout << "New client " << user_id << " connected from "
+                      << user.get_ip() << ":" << user.get_port() << ".\n";
+            return true;
+        }
+
+        User &u = db.get_user(user_id);
+        // Check if the user isn't already connected
+        if (u.is_online()) {
+            send_connection_dup(sockfd);
+            if (client_timers.count(sockfd) == 0) {
+                drop_client(sockfd);
+            }
+            return false;
+        }
+        watch_client(sockfd);
+
+        // Reconnected - just update the adress and port
+        std::cout << "Reconnected client " << user_id << " from "
+                  << user.get_ip() << ":" << user.get_port() << ".\n";
+
+        // Update the user data
+        u.set_socket(sockfd);
+        u.set_status(U_ONLINE);
+        u.set_port(user.get_port());
+        u.set_ip(user.get_ip());
+        db.user_connect(u);
+
+        // Send the subscribed topics (and patterns) to the client, all of
+        // them at once
+        BatchWriter ids(TOPIC_IDS);
+        for (const subscription &s : u.get_subscriptions()) {
+            ids.add(db.get_topic_name(s.topic), s.topic);
+        }
+        for (auto &i : db.get_wildcards(u.get_id())) {
+            if (i.second->shard == shard) {
+                ids.add(i.second->pattern, i.first);
+            }
+        }
+        const std::string &frames = ids.get_frames();
+        if (!frames.empty()) {
+            send_bytes(sockfd, frames.data(), frames.size());
+        }
+
+        // Send queued messages
+        std::vector<uint> dropped;
+        for (const subscription &s : u.get_subscriptions()) {
+            // If Store-Forward is active
+            if (!s.sf) {
+                continue;
+            }
+
+            uint t = s.topic;
+            long last_id = u.get_last_id(t);
+
+            if (!db.topic_exists(t)) {
+                // The messages are stored by another shard
+                db.pause_subscription(u, t);
+
+                shard_message replay{};
+                replay.type = shard_msg_type::REPLAY;
+                replay.topic = t;
+                replay.msg_id = last_id;
+                replay.options = s.options;
+                replay.user = user_id;
+                router->send(shard, owner_of(t), replay);
+                continue;
+            }
+
+            Topic &topic = db.get_topic(t);
+
+            // If there are unsent messages on the topic
+            if (last_id < topic.get_last_id()) {
+                std::vector<std::string> texts;
+                long first_id =
+                    topic.get_backlog(last_id, texts, s.options & SUB_CONFLATE);
+                if (!replay(u, t, first_id, texts)) {
+                    dropped.push_back(t);
+                }
+            }
+        }
+
+        for (uint t : dropped) {
+            unsubscribe_user(u, t);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Add a topic of this shard, if it doesn't exist already. A new
+     * topic is subscribed to by the wildcard subscriptions that match it
+     * @param name The name of the topic
+     * @return uint The id of the topic
+     */
+    uint add_topic(const std::string &name) {
+        bool created = db.get_topic_id(name) == -1;
+        uint id = db.add_topic(name);
+        if (created) {
+            for (uint wildcard : db.match_wildcards(name)) {
+                attach(*db.get_wildcard(wildcard), name);
+            }
+        }
+        return id;
+    }
+
+    /**
+     * @brief Subscribe a client to a topic (if it is owned by another shard,
+     * that shard sends the id back)
+     * @param u The client
+     * @param topic The name of the topic
+     * @param sf If the subscription is store-forward
+     * @param options The other options of the subscription
+     * @param filter The filter of the messages
+     * @param limit The rate of the messages
+     * @param reply If the id of the topic is sent to the client (a batch
+     * sends the ids together)
+     * @return int The id of the topic, -1 if it is owned by another shard
+     */
+    int subscribe_user(User &u, const std::string &topic, const bool sf,
+                       const bint options, const content_filter &filter,
+                       const rate_limit &limit, const bool reply = true) {
+        if (Aggregator::is_aggregate(topic)) {
+            add_aggregate(topic);
+        }
+        if (router != NULL && router->shard_of(topic) != shard) {
+            shard_message subscribe{};
+            subscribe.type = shard_msg_type::SUBSCRIBE;
+            subscribe.sf = sf;
+            subscribe.options = options;
+            subscribe.filter = filter;
+            subscribe.limit = limit;
+            subscribe.name = topic;
+            subscribe.user = u.get_id();
+            router->send(shard, router->shard_of(topic), subscribe);
+            return -1;
+        }
+
+        // Add the topic if it doesn't exist already, and subscribe the client
+        uint id = add_topic(topic);
+        db.subscribe(u, id, sf, options, &filter, &limit);
+
+        // Send the id of the topic to the client (and its last message, if it
+        // was requested)
+        if (reply && u.is_online()) {
+            send_topic_id(u.get_socket(), topic);
+            if (options & SUB_SNAPSHOT) {
+                send_snapshot(u, id, db.get_topic(id).get_last_message());
+            }
+        }
+        return id;
+    }
+
+    /**
+     * @brief Subscribe a client to the topics of a batch. The ids of the
+     * topics of this shard are sent in a single TOPIC_IDS message (the other
+     * shards send theirs when they reply), followed by their last messages
+     * @param u The client
+     * @param batch The batch
+     */
+    void subscribe_batch(User &u, const tcp_batch &batch) {
+        const tcp_subscribe &data = batch.subscribe;
+        rate_limit limit{data.rate, data.every, 0, 0, 0};
+        BatchWriter ids(TOPIC_IDS);
+        std::vector<uint> added;
+
+        cork(u.get_socket());
+        for (auto &entry : read_batch(SUBSCRIBE_BATCH, batch)) {
+            if (!DataFolder::is_valid_name(entry.first)) {
+                console_log("Invalid topic name: " + entry.first + "\n");
+                continue;
+            }
+            if (TopicTrie::is_pattern(entry.first)) {
+                subscribe_wildcard(u, entry.first, data, limit);
+                continue;
+            }
+
+            int id = subscribe_user(u, entry.first, data.sf, data.options,
+                                    data.filter, limit, false);
+            if (id != -1) {
+                ids.add(entry.first, id);
+                added.push_back(id);
+            }
+        }
+
+        const std::string &frames = ids.get_frames();
+        send_bytes(u.get_socket(), frames.data(), frames.size());
+        if (data.options & SUB_SNAPSHOT) {
+            for (uint id : added) {
+                send_snapshot(u, id, db.get_topic(id).get_last_message());
+            }
+        }
+        uncork();
+    }
+
+    /**
+     * @brief Unsubscribe a client from the topics (and patterns) of a batch
+     * (the confirmations are sent together)
+     * @param u The client
+     * @param batch The batch
+     */
+    void unsubscribe_batch(User &u, const tcp_batch &batch) {
+        cork(u.get_socket());
+        for (auto &entry : read_batch(UNSUBSCRIBE_BATCH, batch)) {
+            if (entry.second & WILDCARD_ID) {
+                unsubscribe_wildcard(u, entry.second);
+            } else {
+                unsubscribe_user(u, entry.second);
+            }
+        }
+        uncork();
+    }
+
+    /**
+     * @brief Subscribe a client to the topics that match a pattern (the ones
+     * that exist, on every shard, and the ones that are added later)
+     * @param u The client
+     * @param pattern The pattern
+     * @param data The subscription (the options)
+     * @param limit The rate of the messages
+     */
+    void subscribe_wildcard(User &u, const std::string &pattern,
+                            const tcp_subscribe &data,
+                            const rate_limit &limit) {
+        for (auto &i : db.get_wildcards(u.get_id())) {
+            if (i.second->pattern == pattern) {
+                send_topic_id(u.get_socket(), pattern, i.first);
+                return;
+            }
+        }
+
+        uint id = db.next_wildcard_id();
+        wildcard_subscription wildcard{pattern, u.get_id(), shard, data.sf,
+                                       data.options, data.filter, limit};
+        send_topic_id(u.get_socket(), pattern, id);
+
+        if (router != NULL) {
+            for (uint i = 0; i < router->get_count(); ++i) {
+                if (i != shard) {
+                    shard_message msg{};
+                    msg.type = shard_msg_type::WILDCARD;
+                    msg.msg_id = id;
+                    msg.name = pattern;
+                    msg.user = u.get_id();
+                    msg.sf = data.sf;
+                    msg.options = data.options;
+                    msg.filter = data.filter;
+                    msg.limit = limit;
+                    router->send(shard, i, msg);
+                }
+            }
+        }
+        add_wildcard(id, wildcard);
+    }
+
+    /**
+     * @brief Add a wildcard subscription, and subscribe its client to the
+     * topics of this shard that match it
+     * @param id The id of the subscription
+     * @param wildcard The subscription
+     */
+    void add_wildcard(const uint id, const wildcard_subscription &wildcard) {
+        db.add_wildcard(id, wildcard);
+        for (uint topic : db.match_topics(wildcard.pattern)) {
+            attach(wildcard, db.get_topic_name(topic));
+        }
+    }
+
+    /**
+     * @brief Subscribe the client of a wildcard subscription to a topic of
+     * this shard that matches its pattern. A client of another shard is
+     * subscribed like it has sent a SUBSCRIBE, so the next messages of the
+     * topic are sent to its shard after the reply
+     * @param wildcard The subscription
+     * @param topic The name of the topic
+     */
+    void attach(const wildcard_subscription &wildcard,
+                const std::string &topic) {
+        if (wildcard.shard != shard) {
+            shard_message msg{};
+            msg.name = topic;
+            msg.user = wildcard.user;
+            msg.sf = wildcard.sf;
+            msg.options = wildcard.options;
+            msg.filter = wildcard.filter;
+            msg.limit = wildcard.limit;
+            subscribe_shard(msg, wildcard.shard);
+        } else if (db.user_exists(wildcard.user)) {
+            subscribe_user(db.get_user(wildcard.user), topic, wildcard.sf,
+                           wildcard.options, wildcard.filter, wildcard.limit);
+        }
+    }
+
+    /**
+     * @brief Remove a wildcard subscription of a client, and unsubscribe it
+     * from the topics that match its pattern
+     * @param u The client
+     * @param id The id of the subscription
+     */
+    void unsubscribe_wildcard(User &u, const uint id) {
+        const wildcard_subscription *wildcard = db.get_wildcard(id);
+        if (wildcard == NULL || wildcard->user != u.get_id()) {
+            return;
+        }
+        std::string pattern = wildcard->pattern;
+        db.remove_wildcard(id);
+
+        if (router != NULL) {
+            for (uint i = 0; i < router->get_count(); ++i) {
+                if (i != shard) {
+                    shard_message msg{};
+                    msg.type = shard_msg_type::UNWILDCARD;
+                    msg.msg_id = id;
+                    router->send(shard, i, msg);
+                }
+            }
+        }
+
+        std::vector<uint> matched;
+        for (const subscription &s : u.get_subscriptions()) {
+            if (TopicTrie::matches(pattern, db.get_topic_name(s.topic))) {
+                matched.push_back(s.topic);
+            }
+        }
+        for (uint topic : matched) {
+            unsubscribe_user(u, topic);
+        }
+        send_unsubscribe_confirm(u.get_socket(), id);
+    }
+
+    /**
+     * @brief Unsubscribe a client from a topic, and confirm it to the client
+     * @param u The client
+     * @param topic_id The topic
+     */
+    void unsubscribe_user(User &u, const uint topic_id) {
+        // The shard of the topic has one less subscriber, if it is another one
+        if (db.unsubscribe(u, topic_id) && router != NULL &&
+            owner_of(topic_id) != shard) {
+            shard_message release{};
+            release.type = shard_msg_type::RELEASE;
+            release.topic = topic_id;
+            router->send(shard, owner_of(topic_id), release);
+        }
+
+        // Send unsubscribe confirmation
+        send_unsubscribe_confirm(u.get_socket(), topic_id);
+    }
+
+    /**
+     * @brief The client has processed the messages of its acknowledged topics,
+     * until the ones in the ACK. Their store-forward cursors are moved after
+     * them (they are never moved back, or past the last message)
+     * @param u The client
+     * @param batch The ACK
+     */
+    void ack_user(User &u, const tcp_batch &batch) {
+        for (auto &cursor : read_cursors(batch)) {
+            uint topic = cursor.first;
+            long last = (long)cursor.second - 1;
+            if (u.is_acked(topic) && last > u.get_last_id(topic) &&
+                last <= db.last_known_id(topic)) {
+                u.sent_message_set(topic, last);
+            }
+        }
+    }
+
+    /**
+     * @brief Start sending the stored messages of a topic, with the ids (and
+     * the times) in a range (see serve_queries). The client can only ask for a
+     * slower rate than QUERY_RATE, and can have MAX_USER_QUERIES at once (a
+     * query over that ends at once, with nothing sent)
+     * @param u The client
+     * @param data The query
+     */
+    void start_query(User &u, const tcp_query &data) {
+        range_query q;
+        q.sockfd = u.get_socket();
+        q.user = u.get_id();
+        q.topic = std::string(data.topic, strnlen(data.topic, TOPIC_LENGTH));
+        q.topic_id = 0;
+        q.next = data.first;
+        q.last = data.last;
+        q.since = data.since;
+        q.until = data.until;
+        q.sent = 0;
+        q.waiting = false;
+        uint rate = data.rate != 0 ? std::min<uint>(data.rate, QUERY_RATE)
+                                   : QUERY_RATE;
+        q.limit = rate_limit{rate, 0, 0, 0, 0};
+        q.chunk_first = data.first;
+
+        size_t active = 0;
+        for (auto &other : queries) {
+            if (other.user == q.user) {
+                active++;
+            }
+        }
+        if (active >= MAX_USER_QUERIES) {
+            send_query_done(q);
+            return;
+        }
+        queries.push_back(std::move(q));
+        schedule_queries(time_ns());
+    }
+
+    /**
+     * @brief Read the next messages of a range query, from a topic of this
+     * shard. A time range is converted to ids (see Topic::find_time)
+     * @param name The name of the topic
+     * @param first The id of the first message
+     * @param last The last message of the range (can be changed by the time
+     * range)
+     * @param since The start of the time range (0 if it isn't set)
+     * @param until The end of the time range (0 if it isn't set)
+     * @param texts Will contain at most QUERY_CHUNK messages
+     * @param topic_id Will contain the id of the topic
+     * @return long The id of the first message (-1 if the topic doesn't exist)
+     */
+    long read_query(const std::string &name, long first, long &last,
+                    const lint since, const lint until,
+                    std::vector<std::string> &texts, uint &topic_id) {
+        int id = db.get_topic_id(name);
+        if (id == -1 && DataFolder::get().contains(name)) {
+            // A topic of a previous run, that wasn't used since
+            id = add_topic(name);
+        }
+        if (id == -1 || !db.topic_exists(id)) {
+            return -1;
+        }
+        topic_id = id;
+
+        Topic &topic = db.get_topic(id);
+        if (since != 0) {
+            first = std::max(first, topic.find_time(since));
+        }
+        if (until != 0) {
+            last = std::min(last, topic.find_time(until + 1) - 1);
+        }
+        return topic.read_range(first, std::min(last, first + QUERY_CHUNK - 1),
+                                texts);
+    }
+
+    /**
+     * @brief Read the next chunk of a range query. If the topic is owned by
+     * another shard, the chunk is requested, and added when it replies
+     * @param q The query
+     */
+    void read_chunk(range_query &q) {
+        if (router != NULL && router->shard_of(q.topic) != shard) {
+            shard_message msg{};
+            msg.type = shard_msg_type::QUERY;
+            msg.name = q.topic;
+            msg.msg_id = q.next;
+            msg.last = q.last;
+            msg.time = q.since;
+            msg.until = q.until;
+            msg.user = q.user;
+            router->send(shard, router->shard_of(q.topic), msg);
+            q.waiting = true;
+            return;
+        }
+
+        std::vector<std::string> texts;
+        uint topic_id = 0;
+        long last = q.last;
+        long first = read_query(q.topic, q.next, last, q.since, q.until,
+                                texts, topic_id);
+        add_chunk(q, topic_id, first, last, texts);
     }
 
     /**
-     * @brief Close a socket
-     * @param sockfd The socket to be closed
+     * @brief Add the messages that were read for a range query. If there are
+     * none, the range has ended
+     * @param q The query
+     * @param topic_id The id of the topic
+     * @param first The id of the first message (-1 if the topic doesn't exist)
+     * @param last The last message of the range (from now on, the time range
+     * isn't needed)
+     * @param texts The messages
      */
-    void close_skt(int sockfd) {
-        CERR(shutdown(sockfd, SHUT_RDWR) != 0);
-        CERR(close(sockfd) != 0);
+    void add_chunk(range_query &q, const uint topic_id, const long first,
+                   const long last, std::vector<std::string> &texts) {
+        q.waiting = false;
+        q.last = last;
+        q.since = 0;
+        q.until = 0;
+        schedule_queries(time_ns());
+        if (first == -1 || texts.empty()) {
+            q.next = q.last + 1;
+            return;
+        }
+        q.topic_id = topic_id;
+        q.chunk_first = first;
+        q.next = first + texts.size();
+        for (std::string &text : texts) {
+            q.chunk.push_back(std::move(text));
+        }
     }
 
     /**
-     * @brief Prepare, bind and start listening
+     * @brief Send the messages of the range queries, as many as their rates
+     * allow (the next chunks are read when needed). A query that has ended
+     * is followed by a QUERY_DONE, with the number of messages that were sent.
+     * The query timer is set for the first query that waits for its rate
      */
-    void init_connections() {
-        MUST(bind(main_tcp_sock, (sockaddr *)&listen_addr, sizeof(sockaddr)) >=
-                 0,
-             "Could not bind tcp socket\n");
-        MUST(listen(main_tcp_sock, MAX_CLIENTS) >= 0,
-             "Could not start listening for tcp connections\n");
-        MUST(bind(udp_sock, (sockaddr *)&listen_addr, sizeof(sockaddr)) >= 0,
-             "Could not bind udp socket\n");
+    void serve_queries() {
+        lint now = time_ns(), wait = UINT64_MAX;
+        for (auto it = queries.begin(); it != queries.end();) {
+            range_query &q = *it;
+            if (!db.user_exists(q.user) || !db.get_user(q.user).is_online() ||
+                db.get_user(q.user).get_socket() != q.sockfd) {
+                // The client is gone
+                it = queries.erase(it);
+                continue;
+            }
 
-        // Set the file descriptors for the sockets
-        FD_SET(main_tcp_sock, &read_fds);
-        FD_SET(udp_sock, &read_fds);
-        max_fd = std::max(main_tcp_sock, udp_sock);
+            while (!q.waiting) {
+                if (q.chunk.empty()) {
+                    if (q.next > q.last) {
+                        break;
+                    }
+                    read_chunk(q);
+                } else if (q.chunk.front().empty()) {
+                    // An invalid record is skipped
+                    q.chunk.pop_front();
+                    q.chunk_first++;
+                } else if (q.limit.take(now)) {
+                    send_history(q);
+                    q.chunk.pop_front();
+                    q.chunk_first++;
+                } else {
+                    break;
+                }
+            }
 
-        // Set the file descriptor for STDIN
-        FD_SET(STDIN_FILENO, &read_fds);
+            if (!q.waiting && q.chunk.empty()) {
+                send_query_done(q);
+                it = queries.erase(it);
+                continue;
+            }
+            if (!q.waiting) {
+                // The bucket has room for the next message
+                lint at = q.limit.ready + NS_PER_SECOND / q.limit.rate -
+                          NS_PER_SECOND;
+                wait = std::min(wait, at > now ? at - now : 0);
+            }
+            ++it;
+        }
+        if (wait != UINT64_MAX) {
+            schedule_queries(now + wait);
+        }
     }
 
     /**
-     * @brief Read and execute commands from STDIN
-     * Will return whether the program should close.
-     * @return true Close the program
-     * @return false Continue the program
+     * @brief Make the query timer expire at a time (or earlier, if it is set
+     * already)
+     * @param at The time (ns)
      */
-    bool read_input() {
-        std::string command;
-        std::cin >> command;
-
-        if (command == "exit") {
-            return true;
+    void schedule_queries(const lint at) {
+        if (query_timer != 0) {
+            if (query_deadline <= at) {
+                return;
+            }
+            timers.cancel(query_timer);
         }
-        return false;
+        query_timer = timers.add(at, (uint)timer_kind::QUERIES, 0);
+        query_deadline = at;
     }
 
     /**
-     * @brief This function parses and does different things based on UDP
-     * messages it receives
+     * @brief Send the next message of a range query (HISTORY)
+     * @param q The query
      */
-    void read_udp_message() {
-        udp_message msg;
-        char buffer[UDP_MSG_SIZE];
-        bzero(&msg, UDP_MSG_SIZE);
-        bzero(&buffer, UDP_MSG_SIZE);
-
-        sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-
-        ssize_t msg_size = recvfrom(udp_sock, &buffer, sizeof(buffer), 0,
-                                    (sockaddr *)&client_addr, &client_len);
-        CERR(msg_size < 0);
+    void send_history(range_query &q) {
+        tcp_message msg;
+        make_data_message(q.chunk.front(), msg, q.topic_id, q.chunk_first);
+        msg.type = tcp_msg_type::HISTORY;
+        send_tcp_message(q.sockfd, msg, TCP_DATA_DATA + 1);
+        q.sent++;
+    }
 
-        memcpy(&msg, buffer, msg_size);
+    /**
+     * @brief Notify the client that a range query has ended
+     * @param q The query
+     */
+    void send_query_done(const range_query &q) {
+        tcp_message msg;
+        tcp_query_done data;
+        bzero(&msg, TCP_MSG_SIZE);
+        bzero(&data, TCP_DATA_QUERY_DONE);
 
-        // This will build the string to be shown in the console log
-        std::stringstream ss;
-        ss << inet_ntoa(client_addr.sin_addr) << ":";
-        ss << ntohs(client_addr.sin_port) << " - ";
+        safe_cpy(data.topic, q.topic.c_str(), q.topic.size());
+        data.count = q.sent;
 
-        if (msg_size > 0) {
-            ss << msg.print();
-            int topic_id = db.get_topic_id(msg.topic);
-            if (topic_id == -1) {
-                // Add the topic if it didn't exist
-                topic_id = db.add_topic(msg.topic);
-            }
+        msg.type = tcp_msg_type::QUERY_DONE;
+        memcpy(msg.payload, &data, TCP_DATA_QUERY_DONE);
+        send_tcp_message(q.sockfd, msg, TCP_DATA_QUERY_DONE + 1);
+    }
 
-            // Store the message
-            db.topic_new_message(topic_id, ss.str());
+    /**
+     * @brief Receive data from a client. A recv can return many messages (the
+     * last one can be incomplete), so the data is added to the inbox of the
+     * client, and the complete messages are processed
+     * @param sockfd The socket on which the message will be received
+     */
+    void read_tcp_message(uint sockfd) {
+        char buffer[4 * TCP_MSG_SIZE];
 
-            // Show the message on the server (if logs are enabled)
-            console_log(ss.str() + "\n");
+        ssize_t size = recv(sockfd, buffer, sizeof(buffer), 0);
+        CERR(size < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
 
-            // Send the message to the clients
-            for (User &u : db.get_subscribed_users(topic_id)) {
-                if (u.is_online()) {
-                    send_message_on_topic(topic_id, ss.str(), u.get_id());
+        if (size == 0) {
+            // Client disconnected
+            drop_client(sockfd);
+        } else if (size > 0) {
+            if (HEARTBEAT_INTERVAL != 0) {
+                auto it = client_timers.find(sockfd);
+                if (it != client_timers.end()) {
+                    it->second.last_seen = time_ns();
                 }
             }
+            inboxes[sockfd].append(buffer, size);
+            read_inbox(sockfd);
         }
     }
 
     /**
-     * @brief This function parses and does different things based on TCP
-     * messages it receives
-     * @param sockfd The socket on which the message will be received
+     * @brief Process the messages of a client that were received completely
+     * @param sockfd The socket of the client
      */
-    void read_tcp_message(uint sockfd) {
-        tcp_message msg;
-        bzero(&msg, TCP_MSG_SIZE);
+    void read_inbox(const uint sockfd) {
+        std::string &inbox = inboxes[sockfd];
+        size_t pos = 0;
+        while (pos < inbox.size()) {
+            size_t size =
+                tcp_message_size(inbox.data() + pos, inbox.size() - pos);
+            if (size == 0) {
+                // Unknown message, the rest of the data can't be parsed
+                pos = inbox.size();
+                break;
+            }
+            if (inbox.size() - pos < size) {
+                break;
+            }
 
-        ssize_t msg_size = recv(sockfd, &msg, sizeof(msg), 0);
-        CERR(msg_size < 0);
+            tcp_message msg;
+            bzero(&msg, TCP_MSG_SIZE);
+            memcpy(&msg, inbox.data() + pos, size);
+            pos += size;
 
-        if (msg_size == 0) {
-            // Client disconnected
-            close_skt(sockfd);
-            FD_CLR(sockfd, &read_fds);
-            db.user_disconnect(sockfd);
-        } else {
-            switch (msg.type) {
-                case tcp_msg_type::CONNECT: {
-                    tcp_connect data;
-                    bzero(&data, TCP_DATA_CONNECT);
-                    memcpy(&data, msg.payload, TCP_DATA_CONNECT);
-
-                    sockaddr_in client_addr = db.get_reserved_adress(sockfd);
-                    User user = User(
-                        data.name, std::string(inet_ntoa(client_addr.sin_addr)),
-                        sockfd, ntohs(client_addr.sin_port));
-                    std::string user_id = user.get_id();
-
-                    if (!db.user_exists(data.name)) {
-                        // New user - add him to the database
-                        db.add_user(user);
-
-                        std::cout << "New client " << user_id
-                                  << " connected from " << user.get_ip() << ":"
-                                  << user.get_port() << ".\n";
-                    } else {
-                        User &u = db.get_user(user_id);
-                        // Check if the user isn't already connected
-                        if (u.is_online()) {
-                            send_connection_dup(sockfd);
-                            return;
-                        }
+            if (!process_tcp_message(sockfd, msg, inbox, pos)) {
+                // The client was given to another shard, with the rest (or
+                // closed)
+                inboxes.erase(sockfd);
+                return;
+            }
+        }
 
-                        // Reconnected - just update the adress and port
-                        std::cout << "Reconnected client " << user_id
-                                  << " from " << user.get_ip() << ":"
-                                  << user.get_port() << ".\n";
-
-                        // Update the user data
-                        u.set_socket(sockfd);
-                        u.set_status(U_ONLINE);
-                        u.set_port(user.get_port());
-                        u.set_ip(user.get_ip());
-
-                        // Send subscribed topics
-                        for (uint t : db.get_topics()) {
-                            // If the user is subscribed to the topic, send to
-                            // subscriber the info
-
-                            if (u.is_subscribed(t)) {
-                                // This inexistant delay actually helps the code
-                                // so that the client will receive all the
-                                // messages
-                                nsleep(10);
-                                send_topic_id(sockfd, db.get_topic_name(t));
-                            }
-                        }
+        inbox.erase(0, pos);
+        if (inbox.empty()) {
+            inboxes.erase(sockfd);
+        }
+    }
 
-                        // Send queued messages
-                        for (uint t : db.get_topics()) {
-                            // If Store-Forward is active
-                            if (u.is_sf(t)) {
-                                uint last_id = u.get_last_id(t);
-
-                                Topic topic(db.get_topic(t));
-
-                                // If there are unsent messages on the topic
-                                if (last_id < topic.get_last_id()) {
-                                    uint curr_id = last_id + 1;
-
-                                    for (auto &msg : topic.get_messages(
-                                             last_id + 1,
-                                             topic.get_last_id())) {
-                                        nsleep(10);
-                                        send_message_on_topic(
-                                            t, msg, u.get_id(), curr_id);
-                                        curr_id++;
-                                    }
-                                }
-                            }
-                        }
-                    }
-                } break;
-                case tcp_msg_type::SUBSCRIBE: {
-                    tcp_subscribe data;
-                    bzero(&data, TCP_DATA_SUBSCRIBE);
-                    memcpy(&data, msg.payload, TCP_DATA_SUBSCRIBE);
-
-                    // Add the topic if it doesn't exist already
-                    db.add_topic(data.topic);
-
-                    // Subscribe the client
-                    int id = db.get_topic_id(data.topic);
-                    if (id != -1) {
-                        db.get_user(sockfd).subscribe(
-                            id, data.sf, db.get_topic(id).get_last_id());
+    /**
+     * @brief This function parses and does different things based on TCP
+     * messages it receives
+     * @param sockfd The socket on which the message was received
+     * @param msg The message
+     * @param inbox The data received from the client
+     * @param next Where the data received after the message starts in it
+     * @return true The next messages can be processed
+     * @return false The client is handled by another shard now (or it was
+     * closed)
+     */
+    bool process_tcp_message(const uint sockfd, const tcp_message &msg,
+                             const std::string &inbox, const size_t next) {
+        switch (msg.type) {
+            case tcp_msg_type::CONNECT: {
+                tcp_connect data;
+                bzero(&data, TCP_DATA_CONNECT);
+                memcpy(&data, msg.payload, TCP_DATA_CONNECT);
+
+                std::string name(data.name,
+                                 strnlen(data.name, TCP_DATA_CONNECT));
+                sockaddr_in client_addr = db.get_reserved_adress(sockfd);
+
+                // The client is handled by the shard that owns its id
+                if (router != NULL && router->shard_of(name) != shard) {
+                    forget_client(sockfd);
+                    FD_CLR(sockfd, &read_fds);
+
+                    shard_message adopt{};
+                    adopt.type = shard_msg_type::ADOPT;
+                    adopt.sockfd = sockfd;
+                    adopt.addr = client_addr;
+                    adopt.user = name;
+                    if (next < inbox.size()) {
+                        adopt.texts.push_back(inbox.substr(next));
                     }
+                    router->send(shard, router->shard_of(name), adopt);
+                    return false;
+                }
 
-                    // Send the id of the topic to the client
-                    send_topic_id(sockfd, data.topic);
-                } break;
-                case tcp_msg_type::UNSUBSCRIBE: {
-                    tcp_unsubscribe data;
-                    bzero(&data, TCP_DATA_UNSUBSCRIBE);
-                    memcpy(&data, msg.payload, TCP_DATA_UNSUBSCRIBE);
-
-                    // Unsubscribe the client
-                    db.get_user(sockfd).unsubcribe(data.topic);
+                if (!connect_user(sockfd, name, client_addr) &&
+                    client_timers.count(sockfd) == 0) {
+                    // It was closed
+                    return false;
+                }
+            } break;
+            case tcp_msg_type::SUBSCRIBE: {
+                tcp_subscribe data;
+                bzero(&data, TCP_DATA_SUBSCRIBE);
+                memcpy(&data, msg.payload, TCP_DATA_SUBSCRIBE);
+
+                std::string topic(data.topic,
+                                  strnlen(data.topic, TOPIC_LENGTH));
+                rate_limit limit{data.rate, data.every, 0, 0, 0};
+                if (!db.user_exists(sockfd)) {
+                    // The client hasn't connected (or its id was refused)
+                    break;
+                } else if (!DataFolder::is_valid_name(topic)) {
+                    console_log("Invalid topic name: " + topic + "\n");
+                } else if (TopicTrie::is_pattern(topic)) {
+                    subscribe_wildcard(db.get_user(sockfd), topic, data,
+                                       limit);
+                } else {
+                    subscribe_user(db.get_user(sockfd), topic, data.sf,
+                                   data.options, data.filter, limit);
+                }
+            } break;
+            case tcp_msg_type::UNSUBSCRIBE: {
+                tcp_unsubscribe data;
+                bzero(&data, TCP_DATA_UNSUBSCRIBE);
+                memcpy(&data, msg.payload, TCP_DATA_UNSUBSCRIBE);
 
-                    // Send unsubscribe confirmation
-                    send_unsubscribe_confirm(sockfd, data.topic);
-                } break;
-                default:
+                if (!db.user_exists(sockfd)) {
                     break;
-            }
+                } else if (data.topic & WILDCARD_ID) {
+                    unsubscribe_wildcard(db.get_user(sockfd), data.topic);
+                } else {
+                    unsubscribe_user(db.get_user(sockfd), data.topic);
+                }
+            } break;
+            case tcp_msg_type::ACK: {
+                tcp_batch data;
+                bzero(&data, sizeof(data));
+                memcpy(&data, msg.payload, sizeof(data));
+
+                if (db.user_exists(sockfd)) {
+                    ack_user(db.get_user(sockfd), data);
+                }
+            } break;
+            case tcp_msg_type::QUERY: {
+                tcp_query data;
+                bzero(&data, TCP_DATA_QUERY);
+                memcpy(&data, msg.payload, TCP_DATA_QUERY);
+
+                if (db.user_exists(sockfd)) {
+                    start_query(db.get_user(sockfd), data);
+                }
+            } break;
+            case tcp_msg_type::SUBSCRIBE_BATCH:
+            case tcp_msg_type::UNSUBSCRIBE_BATCH: {
+                tcp_batch data;
+                bzero(&data, sizeof(data));
+                memcpy(&data, msg.payload, sizeof(data));
+
+                if (!db.user_exists(sockfd)) {
+                    break;
+                } else if (msg.type == tcp_msg_type::SUBSCRIBE_BATCH) {
+                    subscribe_batch(db.get_user(sockfd), data);
+                } else {
+                    unsubscribe_batch(db.get_user(sockfd), data);
+                }
+            } break;
+            default:
+                break;
         }
+        return true;
     }
 
     /**
@@ -275,7 +1910,7 @@ class Server {
         tcp_message msg;
         bzero(&msg, TCP_MSG_SIZE);
         msg.type = tcp_msg_type::CONNECT_DUP;
-        CERR(send(sockfd, &msg, 1, 0) < 0);
+        send_tcp_message(sockfd, msg, 1);
     }
 
     /**
@@ -285,23 +1920,71 @@ class Server {
      * @param name The name of the topic
      */
     void send_topic_id(const uint sockfd, const std::string &name) {
+        int id = db.get_topic_id(name);
+        if (id != -1) {
+            send_topic_id(sockfd, name, id);
+        }
+    }
+
+    /**
+     * @brief Send the id of a topic (or of a pattern) to a client
+     * @param sockfd The socket of the client
+     * @param name The name of the topic
+     * @param id The id
+     */
+    void send_topic_id(const uint sockfd, const std::string &name,
+                       const uint id) {
         tcp_message msg;
+        tcp_topic_id data;
         bzero(&msg, TCP_MSG_SIZE);
+        bzero(&data, TCP_DATA_TOPICID);
 
-        int id = db.get_topic_id(name);
-        if (id != -1) {
-            tcp_topic_id data;
-            bzero(&data, TCP_DATA_TOPICID);
+        safe_cpy(data.topic, name.c_str(), name.size());
+        data.id = id;
+
+        msg.type = tcp_msg_type::TOPIC_ID;
+        memcpy(msg.payload, &data, TCP_DATA_TOPICID);
 
-            safe_cpy(data.topic, name.c_str(), name.size());
-            data.id = id;
+        // Send the client info
+        send_tcp_message(sockfd, msg, TCP_DATA_TOPICID + 1);
+    }
 
-            msg.type = tcp_msg_type::TOPIC_ID;
-            memcpy(msg.payload, &data, TCP_DATA_TOPICID);
+    /**
+     * @brief Send the last message of a topic to a client that has just
+     * subscribed to it (see Topic::get_last_message)
+     * @param u The client
+     * @param topic_id The topic
+     * @param text The message (nothing is sent if it is empty, or if it
+     * doesn't match the filter of the subscription)
+     */
+    void send_snapshot(const User &u, const uint topic_id,
+                       const std::string &text) {
+        if (text.empty() || !passes_filter(u, topic_id, text)) {
+            return;
+        }
+        tcp_message msg;
+        make_data_message(text, msg, topic_id, db.last_known_id(topic_id));
+        send_tcp_message(u.get_socket(), msg, TCP_DATA_DATA + 1);
+    }
 
-            // Send the client info
-            CERR(send(sockfd, &msg, TCP_DATA_TOPICID + 1, 0) < 0);
+    /**
+     * @brief Check if a message matches the filter of a subscription (the
+     * messages that are not sent to a list of subscribers, see deliver)
+     * @param u The client
+     * @param topic_id The topic
+     * @param text The message
+     * @return true It has no filter, or the message matches it
+     * @return false The message must not be sent to the client
+     */
+    bool passes_filter(const User &u, const uint topic_id,
+                       const std::string &text) {
+        const content_filter *filter = u.get_filter(topic_id);
+        if (filter == NULL) {
+            return true;
         }
+        message_value value;
+        return decode_message(text, db.get_topic_name(topic_id), value) &&
+               filter->matches(value, text);
     }
 
     void send_unsubscribe_confirm(const uint sockfd, const uint id) {
@@ -316,52 +1999,268 @@ class Server {
         memcpy(msg.payload, &data, TCP_DATA_CONFIRM_U);
 
         // Send the unsubscribe confirmation
-        CERR(send(sockfd, &msg, TCP_DATA_CONFIRM_U + 1, 0) < 0);
+        send_tcp_message(sockfd, msg, TCP_DATA_CONFIRM_U + 1);
     }
 
-    void send_message_on_topic(const uint topic_id, const std::string &message,
-                               const std::string &user_id,
-                               const uint message_id = 0) {
-        // Send message to all online clients that are subscribed to the topic
+    /**
+     * @brief Tell a client that some of the stored messages on a topic were
+     * not sent
+     * @param sockfd The socket of the client
+     * @param id The topic
+     * @param count The number of messages
+     */
+    void send_skipped(const uint sockfd, const uint id, const uint count) {
         tcp_message msg;
-        tcp_data data;
+        tcp_skipped data;
         bzero(&msg, TCP_MSG_SIZE);
-        bzero(&data, TCP_DATA_DATA);
+        bzero(&data, TCP_DATA_SKIPPED);
 
-        User &u = db.get_user(user_id);
+        data.topic = id;
+        data.count = count;
 
-        safe_cpy(data.payload, message.c_str(), message.size());
+        msg.type = tcp_msg_type::SKIPPED;
+        memcpy(msg.payload, &data, TCP_DATA_SKIPPED);
+        send_tcp_message(sockfd, msg, TCP_DATA_SKIPPED + 1);
+    }
 
-        msg.type = tcp_msg_type::DATA;
-        memcpy(msg.payload, &data, TCP_DATA_DATA);
+    /**
+     * @brief Send a message on a topic to a user
+     * @param topic_id The topic
+     * @param message The message
+     * @param u The user
+     * @param message_id The id of the message (-1 for the last message on the
+     * topic)
+     */
+    void send_message_on_topic(const uint topic_id, const std::string &message,
+                               User &u, const long message_id = -1) {
+        long id = message_id == -1 ? db.last_known_id(topic_id) : message_id;
+        tcp_message msg;
+        make_data_message(message, msg, topic_id, id);
 
-        // Set the last message id of the user
-        if (message_id == 0) {
-            u.sent_message_set(topic_id, db.get_topic(topic_id).get_last_id());
-        } else {
-            u.sent_message_set(topic_id, message_id);
+        // Set the last message id of the user (an acknowledged subscription
+        // waits for the client to do it)
+        if (!u.is_acked(topic_id)) {
+            u.sent_message_set(topic_id, id);
         }
 
-        CERR(send(u.get_socket(), &msg, TCP_DATA_DATA + 1, 0) < 0);
+        send_tcp_message(u.get_socket(), msg, TCP_DATA_DATA + 1);
     }
 
     /**
-     * @brief This function manages new TCP connections
+     * @brief This function manages new TCP connections (and the local ones)
+     * The listening socket doesn't block, so the connections are accepted
+     * until there are none left (at most ACCEPT_BATCH, so a flood doesn't
+     * stop the other clients, the rest are accepted in the next iteration).
+     * At most MAX_PENDING_HANDSHAKES connections can wait for their CONNECT:
+     * when there are more, the oldest one is closed (a client sends its id
+     * right after it connects, so the oldest ones are the most likely to never
+     * send it)
+     * @param listener The listening socket (TCP or Unix)
      */
-    void accept_connection() {
-        // Accept the new connection
-        sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int new_sockfd =
-            accept(main_tcp_sock, (sockaddr *)&client_addr, &client_len);
-        CERR(new_sockfd < 0);
+    void accept_connections(const int listener) {
+        bool local = listener == unix_sock;
+        for (uint i = 0; i < ACCEPT_BATCH; ++i) {
+            // Not blocking: a read never waits, even if the socket was marked
+            // as readable for another (closed) client with the same number
+            sockaddr_in client_addr;
+            socklen_t client_len = sizeof(client_addr);
+            int new_sockfd =
+                accept4(listener, local ? NULL : (sockaddr *)&client_addr,
+                        local ? NULL : &client_len,
+                        SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (new_sockfd < 0) {
+                if (errno == EMFILE || errno == ENFILE) {
+                    // Accept it with the spare descriptor and close it, or it
+                    // stays in the queue and wakes the server up again
+                    shed_spare(listener);
+                    continue;
+                }
+                CERR(errno != EAGAIN && errno != EWOULDBLOCK);
+                return;
+            }
+            if (new_sockfd >= FD_SETSIZE) {
+                // It can't be watched by select
+                reset_connection(new_sockfd);
+                continue;
+            }
+            if (local) {
+                // A local client has no adress (see connect_user)
+                bzero(&client_addr, sizeof(client_addr));
+                client_addr.sin_family = AF_UNIX;
+            }
+
+            accepted++;
+            if (handshakes.size() >= MAX_PENDING_HANDSHAKES) {
+                drop_client(handshakes.begin()->second);
+                shed++;
+            }
+
+            // Add the new socket
+            FD_SET(new_sockfd, &read_fds);
+            max_fd = std::max(max_fd, (uint)new_sockfd);
+
+            // Reserve the user data
+            db.reserve_adress(new_sockfd, client_addr);
+
+            // It is closed if it doesn't send its id in time
+            lint id = 0;
+            if (HANDSHAKE_TIMEOUT != 0) {
+                id = timers.add(time_ns() + HANDSHAKE_TIMEOUT * NS_PER_SECOND,
+                                (uint)timer_kind::HANDSHAKE, new_sockfd);
+            }
+            client_timers[new_sockfd] = client_timer{id, 0, accepted};
+            handshakes[accepted] = new_sockfd;
+        }
+    }
+
+    /**
+     * @brief Close a connection that can't be handled, with a reset (the
+     * kernel doesn't keep it, like it does for a normal close)
+     * @param sockfd The socket
+     */
+    void reset_connection(const int sockfd) {
+        linger reset = {1, 0};
+        CERR(setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &reset,
+                        sizeof(reset)) != 0);
+        CERR(close(sockfd) != 0);
+        shed++;
+    }
+
+    /**
+     * @brief Accept a connection when the process has no descriptors left,
+     * using the spare one, and reset it
+     * @param listener The listening socket
+     */
+    void shed_spare(const int listener) {
+        if (spare_fd < 0) {
+            return;
+        }
+        CERR(close(spare_fd) != 0);
+        int sockfd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (sockfd >= 0) {
+            reset_connection(sockfd);
+        }
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    /**
+     * @brief Start sending heartbeats to a client, after it has sent its id
+     * (if they are enabled)
+     * @param sockfd The socket of the client
+     */
+    void watch_client(const uint sockfd) {
+        forget_client(sockfd);
+        if (HEARTBEAT_INTERVAL == 0) {
+            return;
+        }
+
+        lint now = time_ns();
+        lint id = timers.add(now + HEARTBEAT_INTERVAL * NS_PER_SECOND,
+                             (uint)timer_kind::HEARTBEAT, sockfd);
+        client_timers[sockfd] = client_timer{id, now, 0};
+    }
+
+    /**
+     * @brief Cancel the timer of a client (and remove it from the pending
+     * handshakes)
+     * @param sockfd The socket of the client
+     */
+    void forget_client(const uint sockfd) {
+        auto it = client_timers.find(sockfd);
+        if (it != client_timers.end()) {
+            if (it->second.id != 0) {
+                timers.cancel(it->second.id);
+            }
+            if (it->second.accepted != 0) {
+                handshakes.erase(it->second.accepted);
+            }
+            client_timers.erase(it);
+        }
+    }
+
+    /**
+     * @brief Close the connection of a client, and forget everything kept for
+     * its socket
+     * @param sockfd The socket of the client
+     */
+    void drop_client(const uint sockfd) {
+        close_skt(sockfd);
+        FD_CLR(sockfd, &read_fds);
+        FD_CLR(sockfd, &write_fds);
+        // A new client can get the same number in this loop iteration
+        FD_CLR(sockfd, &tmp_fds);
+        FD_CLR(sockfd, &tmp_write_fds);
+        conflator.forget(sockfd);
+        inboxes.erase(sockfd);
+        forget_client(sockfd);
+        db.release_adress(sockfd);
+        db.user_disconnect(sockfd);
+    }
+
+    /**
+     * @brief Close the clients that don't read their messages (see
+     * IoUring::take_stalled), then submit what the io_uring engine has queued
+     */
+    void submit_io() {
+        for (int sockfd : io.take_stalled()) {
+            console_log("Client on socket " + std::to_string(sockfd) +
+                        " doesn't read its messages\n");
+            drop_client(sockfd);
+        }
+        io.submit();
+    }
+
+    /**
+     * @brief Send a heartbeat to a client, or close its connection if it
+     * hasn't sent anything for HEARTBEAT_MISSED intervals
+     * @param sockfd The socket of the client
+     * @param now The current time (ns)
+     */
+    void send_heartbeat(const uint sockfd, const lint now) {
+        client_timer &t = client_timers[sockfd];
+        if (now - t.last_seen >=
+            HEARTBEAT_MISSED * HEARTBEAT_INTERVAL * NS_PER_SECOND) {
+            console_log("Client on socket " + std::to_string(sockfd) +
+                        " timed out\n");
+            drop_client(sockfd);
+            return;
+        }
 
-        // Add the new socket
-        FD_SET(new_sockfd, &read_fds);
-        max_fd = std::max(max_fd, (uint)new_sockfd);
+        tcp_message msg;
+        bzero(&msg, TCP_MSG_SIZE);
+        msg.type = tcp_msg_type::HEARTBEAT;
+        send_tcp_message(sockfd, msg, 1);
+        t.id = timers.add(now + HEARTBEAT_INTERVAL * NS_PER_SECOND,
+                          (uint)timer_kind::HEARTBEAT, sockfd);
+    }
 
-        // Reserve the user data
-        db.reserve_adress(new_sockfd, client_addr);
+    /**
+     * @brief Handle the timers that have expired
+     */
+    void run_timers() {
+        std::vector<timer_event> expired;
+        lint now = time_ns();
+        timers.advance(now, expired);
+
+        for (const timer_event &e : expired) {
+            switch ((timer_kind)e.kind) {
+                case timer_kind::HANDSHAKE:
+                    // It never sent its id
+                    drop_client(e.key);
+                    break;
+                case timer_kind::HEARTBEAT:
+                    send_heartbeat(e.key, now);
+                    break;
+                case timer_kind::AGGREGATES:
+                    aggregate_timer = 0;
+                    close_aggregates();
+                    break;
+                case timer_kind::QUERIES:
+                    query_timer = 0;
+                    serve_queries();
+                    break;
+            }
+        }
     }
 
    public:
@@ -371,8 +2270,31 @@ class Server {
      * on
      * @param main_port The port
      */
-    explicit Server(const uint main_port)
-        : main_port(main_port), max_fd(0), db(Database()) {
+    explicit Server(const uint main_port, const uint shard = 0,
+                    ShardRouter *router = NULL)
+        : main_port(main_port),
+          max_fd(0),
+          unix_sock(-1),
+          db(shard, router != NULL ? router->get_count() : 1),
+          multicast_sock(-1),
+          timers(time_ns()),
+          aggregate_timer(0),
+          query_timer(0),
+          query_deadline(0),
+          accepted(0),
+          shed(0),
+          spare_fd(open("/dev/null", O_RDONLY | O_CLOEXEC)),
+          shard(shard),
+          router(router),
+          corked(-1) {
+        // Start the io_uring engine, if it is enabled and the kernel has it
+        // (not with the pipeline or the shards, their threads make their own
+        // system calls)
+        if (router == NULL && !ENABLE_PIPELINE && ENABLE_IO_URING &&
+            io.init()) {
+            db.set_writer(&io);
+        }
+
         // Initialise the main TCP socket
         int sock = socket(AF_INET, SOCK_STREAM, 0);
         CERR(sock < 0);
@@ -411,6 +2333,28 @@ class Server {
 #ifdef SO_REUSEPORT
         CERR(setsockopt(main_tcp_sock, SOL_SOCKET, SO_REUSEPORT,
                         (const char *)&opt, sizeof(opt)) != 0);
+
+        // Every shard has its own sockets, the kernel spreads the connections
+        // and the datagrams between them
+        if (router != NULL) {
+            CERR(setsockopt(udp_sock, SOL_SOCKET, SO_REUSEPORT,
+                            (const char *)&opt, sizeof(opt)) != 0);
+        }
+#endif
+
+        // The connections are accepted until there are none left, so the
+        // listening socket must not block
+        int flags = fcntl(main_tcp_sock, F_GETFL, 0);
+        CERR(fcntl(main_tcp_sock, F_SETFL, flags | O_NONBLOCK) != 0);
+
+#ifdef TCP_DEFER_ACCEPT
+        // A connection is only given to the server when its first data (the
+        // CONNECT) arrives, so a connect flood doesn't fill the handshakes
+        if (HANDSHAKE_TIMEOUT != 0) {
+            int defer = HANDSHAKE_TIMEOUT;
+            CERR(setsockopt(main_tcp_sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                            &defer, sizeof(defer)) != 0);
+        }
 #endif
 
         // Set the listen adress
@@ -422,13 +2366,83 @@ class Server {
     ~Server() {
         // Close connections
         close_skt(main_tcp_sock);
+        if (unix_sock >= 0) {
+            CERR(close(unix_sock) != 0);
+            unlink(unix_socket_path(main_port).c_str());
+        }
+        if (spare_fd >= 0) {
+            CERR(close(spare_fd) != 0);
+        }
+        if (multicast_sock >= 0) {
+            CERR(close(multicast_sock) != 0);
+        }
 
         // Close all client sockets
-        for (User &usr : db.get_online_users()) {
-            close_skt(usr.get_socket());
+        for (User *usr : db.get_online_users()) {
+            close_skt(usr->get_socket());
         }
 
         db.save_topics();
+        if (io.is_active()) {
+            io.drain();
+        }
+
+        // Everything that was queued is sent and written before it stops
+        pipeline.stop();
+        fanout.stop();
+    }
+
+    /**
+     * @brief Listen on the Unix socket of the server (see unix_socket_path),
+     * for the clients on the same host. They use the same messages as the
+     * TCP clients, without the TCP stack. The server stops if another one is
+     * listening on it already. It is called by run when ENABLE_UNIX_SOCKET
+     * is set (or before run, to listen anyway)
+     * @return true The socket is listening
+     * @return false It couldn't be created (the server only uses TCP)
+     */
+    bool listen_local() {
+        if (unix_sock >= 0) {
+            return true;
+        }
+
+        sockaddr_un addr;
+        std::string path = unix_socket_path(main_port);
+        if (!set_unix_adress(path, addr)) {
+            console_log("The path of the Unix socket is too long\n");
+            return false;
+        }
+
+        int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          0);
+        CERR(sock < 0);
+        if (sock < 0) {
+            return false;
+        }
+
+        // The socket of a previous run is replaced, but not the one of a
+        // server that is still running (it accepts the connection, or its
+        // queue is full)
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                           0);
+        CERR(probe < 0);
+        bool live = probe >= 0 &&
+                    (connect(probe, (sockaddr *)&addr, sizeof(addr)) == 0 ||
+                     errno == EAGAIN);
+        if (probe >= 0) {
+            CERR(close(probe) != 0);
+        }
+        MUST(!live, "Another server listens on " + path + "\n");
+        unlink(path.c_str());
+        bool listening = bind(sock, (sockaddr *)&addr, sizeof(addr)) == 0 &&
+                         listen(sock, ACCEPT_BACKLOG) == 0;
+        CERR(!listening);
+        if (!listening) {
+            CERR(close(sock) != 0);
+            return false;
+        }
+        unix_sock = sock;
+        return true;
     }
 
     /**
@@ -437,9 +2451,52 @@ class Server {
     void run() {
         init_connections();
         do {
+            // Don't sleep if the pipeline has messages already
+            timeval no_wait = {0, 0}, retry = {0, 1000}, wake_up;
+            timeval *timeout = NULL;
+
+            // Wake up when the next timer expires
+            run_timers();
+            lint wait = timers.next_expiry(time_ns());
+            if (wait != UINT64_MAX) {
+                wake_up.tv_sec = wait / NS_PER_SECOND;
+                wake_up.tv_usec = wait % NS_PER_SECOND / 1000;
+                timeout = &wake_up;
+            }
+            if (io.is_active()) {
+                // The messages sent by the timers must not wait for the next
+                // iteration
+                submit_io();
+            }
+
+            if (pipeline.is_active() && !pipeline.prepare_wait()) {
+                timeout = &no_wait;
+            }
+
+            // The same for the messages from other shards. If the queue to
+            // another shard is full, try again soon
+            if (router != NULL) {
+                if (!router->flush(shard)) {
+                    timeout = &retry;
+                }
+                if (!router->prepare_wait(shard)) {
+                    timeout = &no_wait;
+                }
+            }
+
+            // The subscriber lists that have changed (the ones that were needed
+            // are published already)
+            db.publish_lists();
+
             tmp_fds = read_fds;
-            CERR(select(max_fd + 1, &tmp_fds, NULL, NULL, NULL) < 0);
+            tmp_write_fds = write_fds;
+            CERR(select(max_fd + 1, &tmp_fds, &tmp_write_fds, NULL, timeout) <
+                 0);
             for (uint i = 0; i <= max_fd; ++i) {
+                if (FD_ISSET(i, &tmp_write_fds) && flush_conflated(i)) {
+                    FD_CLR(i, &write_fds);
+                }
+
                 if (FD_ISSET(i, &tmp_fds)) {
                     if (i == STDIN_FILENO) {
                         if (read_input()) {
@@ -447,7 +2504,17 @@ class Server {
                             return;
                         }
                     } else if (i == main_tcp_sock) {
-                        accept_connection();
+                        accept_connections(main_tcp_sock);
+                    } else if ((int)i == unix_sock) {
+                        accept_connections(unix_sock);
+                    } else if (io.is_active() && i == (uint)io.get_fd()) {
+                        read_io_completions();
+                    } else if (pipeline.is_active() &&
+                               i == (uint)pipeline.get_fd()) {
+                        pipeline.clear_wakeup();
+                    } else if (router != NULL &&
+                               i == (uint)router->get_fd(shard)) {
+                        router->clear_wakeup(shard);
                     } else if (i == udp_sock) {
                         read_udp_message();
                     } else if (i != STDOUT_FILENO && i != STDERR_FILENO) {
@@ -455,6 +2522,24 @@ class Server {
                     }
                 }
             }
+
+            if (pipeline.is_active()) {
+                read_pipeline();
+            }
+
+            if (router != NULL && read_shards()) {
+                // The server is closing
+                return;
+            }
+
+            // Submit everything that was queued in this iteration (and the
+            // conflated messages of the clients that have received everything)
+            if (io.is_active()) {
+                for (uint sockfd : conflator.get_sockets()) {
+                    flush_conflated(sockfd);
+                }
+                submit_io();
+            }
         }
         FOREVER;
     }
@@ -0,0 +1,233 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <deque>
+#include <memory>
+
+#include "Filters.hpp"
+#include "RateLimit.hpp"
+#include "SpscRing.hpp"
+#include "Utils.hpp"
+
+#define MAX_SHARDS 64     // The other shards of a topic are kept in a bit mask
+#define SHARD_QUEUE 4096  // Messages between two shards
+#define SHARD_BATCH 256   // Messages handled by a shard in an iteration
+
+namespace application {
+/**
+ * @brief The messages the shards send to each other
+ * - ADOPT: a client must be handled by the shard that owns its id
+ * - PUBLISH: a message was received for a topic owned by another shard
+ * - DELIVER: a message must be sent to the clients of another shard
+ * - SUBSCRIBE / SUBSCRIBED: a client subscribes to a topic owned by another
+ * shard, and the reply (with the id of the topic)
+ * - RELEASE: a shard has one less subscriber to a topic
+ * - REPLAY / REPLAYED: the stored messages a client has missed, and the reply
+ * - AGGREGATE: a client subscribed to an aggregate of a topic of another shard
+ * - WILDCARD / UNWILDCARD: a client subscribed to a pattern, or unsubscribed
+ * - QUERY / QUERIED: the next messages of a range query, and the reply
+ * - STOP: the server is closing
+ */
+enum class shard_msg_type : bint {
+    ADOPT,
+    PUBLISH,
+    DELIVER,
+    SUBSCRIBE,
+    SUBSCRIBED,
+    RELEASE,
+    REPLAY,
+    REPLAYED,
+    AGGREGATE,
+    WILDCARD,
+    UNWILDCARD,
+    QUERY,
+    QUERIED,
+    STOP
+};
+
+struct shard_message {
+    shard_msg_type type;
+    uint from;        // The shard that sent the message
+    uint topic;       // The id of the topic
+    long msg_id;      // A message id (the last one, or the first one)
+    long last;        // The last message of a range (QUERY)
+    int sockfd;       // The socket of the client (ADOPT)
+    bool sf;          // If the subscription is store-forward
+    bint options;     // The other options of the subscription
+    content_filter filter;           // The filter of the subscription
+    rate_limit limit;                // The rate limit of the subscription
+    lint time;        // When the message was received
+    lint until;       // The end of a time range (QUERY)
+    sockaddr_in addr;                // The adress of the client (ADOPT)
+    std::string name;                // The name of the topic
+    std::string user;                // The id of the client
+    std::vector<std::string> texts;  // The messages
+};
+
+/**
+ * @brief This class connects the shards of the server
+ * Each (sender, receiver) pair has its own SpscRing, so nothing is shared by
+ * more than two threads, and every shard has a Doorbell it can wait on (with
+ * select). A message that doesn't fit in a full queue is kept by the sender,
+ * and sent later (a shard never blocks on another one, so two shards can't
+ * wait for each other).
+ */
+class ShardRouter {
+   private:
+    uint count;
+    std::vector<std::unique_ptr<SpscRing<shard_message>>> rings;  // from, to
+    std::vector<std::unique_ptr<Doorbell>> bells;
+    std::vector<std::deque<shard_message>> backlog;  // from, to (sender only)
+    std::vector<uint> next_source;  // Where each shard starts reading
+
+    SpscRing<shard_message> &ring(const uint from, const uint to) {
+        return *rings[from * count + to];
+    }
+
+   public:
+    /**
+     * @brief Construct a new router
+     * @param count The number of shards
+     */
+    explicit ShardRouter(const uint count) : count(count) {
+        MUST(count > 0 && count <= MAX_SHARDS, "Invalid number of shards\n");
+        for (uint i = 0; i < count * count; ++i) {
+            rings.emplace_back(new SpscRing<shard_message>(SHARD_QUEUE));
+        }
+        for (uint i = 0; i < count; ++i) {
+            bells.emplace_back(new Doorbell());
+        }
+        backlog.resize(count * count);
+        next_source.resize(count, 0);
+    }
+
+    ShardRouter(const ShardRouter &other) = delete;
+    ShardRouter &operator=(const ShardRouter &other) = delete;
+
+    uint get_count() const { return count; }
+
+    /**
+     * @brief Get the shard that owns a key (the name of a topic, or the id of
+     * a client). The hash (FNV-1a) doesn't depend on the platform, so a topic
+     * is always stored by the same shard
+     * @param key The key
+     * @return uint The shard
+     */
+    uint shard_of(const std::string &key) const {
+        uint hash = 2166136261u;
+        for (const char c : key) {
+            hash = (hash ^ (uchar)c) * 16777619u;
+        }
+        return hash % count;
+    }
+
+    /**
+     * @brief Send a message to another shard
+     * @param from The shard that sends it (the current one)
+     * @param to The shard that will receive it
+     * @param msg The message (moved)
+     */
+    void send(const uint from, const uint to, shard_message &msg) {
+        msg.from = from;
+        std::deque<shard_message> &waiting = backlog[from * count + to];
+        if (waiting.empty() && ring(from, to).push(msg)) {
+            bells[to]->ring();
+            return;
+        }
+        // Keep the order, everything that is waiting is sent before it
+        waiting.push_back(std::move(msg));
+    }
+
+    /**
+     * @brief Send the messages that didn't fit in the queues
+     * @param from The shard that sent them (the current one)
+     * @return true Everything was sent
+     * @return false Some queues are still full
+     */
+    bool flush(const uint from) {
+        bool done = true;
+        for (uint to = 0; to < count; ++to) {
+            std::deque<shard_message> &waiting = backlog[from * count + to];
+            bool pushed = false;
+            while (!waiting.empty() && ring(from, to).push(waiting.front())) {
+                waiting.pop_front();
+                pushed = true;
+            }
+            if (pushed) {
+                bells[to]->ring();
+            }
+            done = done && waiting.empty();
+        }
+        return done;
+    }
+
+    /**
+     * @brief Receive a message (the queues are read in turns)
+     * @param to The shard that receives it (the current one)
+     * @param msg Will contain the message
+     * @return true A message was received
+     * @return false There are no messages
+     */
+    bool receive(const uint to, shard_message &msg) {
+        for (uint i = 0; i < count; ++i) {
+            uint from = (next_source[to] + i) % count;
+            if (ring(from, to).pop(msg)) {
+                next_source[to] = from + 1;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Get the fd that becomes readable when a shard receives messages
+     * (see prepare_wait)
+     * @param shard The shard
+     */
+    int get_fd(const uint shard) const { return bells[shard]->get_fd(); }
+
+    /**
+     * @brief Must be called by a shard before it waits for its fd
+     * @param shard The shard
+     * @return true The shard can wait
+     * @return false There are messages already, it must not wait
+     */
+    bool prepare_wait(const uint shard) {
+        bells[shard]->arm();
+        for (uint from = 0; from < count; ++from) {
+            if (!ring(from, shard).empty()) {
+                bells[shard]->disarm();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief Clear the fd of a shard, after select reported it as readable
+     * @param shard The shard
+     */
+    void clear_wakeup(const uint shard) { bells[shard]->clear(); }
+};
+}  // namespace application
\ No newline at end of file
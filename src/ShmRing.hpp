@@ -0,0 +1,317 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <fcntl.h>     // O_* constants
+#include <signal.h>    // kill
+#include <sys/mman.h>  // shm_open, mmap
+#include <sys/stat.h>  // fstat
+
+#include <atomic>
+
+#include "SpscRing.hpp"
+#include "Utils.hpp"
+
+#define SHM_RING_MAGIC 0x54535231  // Set when the segment is ready
+#define SHM_RING_SLOTS 4096        // Messages kept in a ring (a power of 2)
+#define SHM_SLOT_SIZE 2048         // The size of a slot (with its header)
+#define SHM_SLOT_DATA (SHM_SLOT_SIZE - sizeof(lint) - 2 * sizeof(sint) - \
+                       sizeof(uint))  // The topic and the text of a message
+
+namespace application {
+/**
+ * @brief The start of a shared memory segment (see ShmRing)
+ */
+struct shm_ring_header {
+    std::atomic<uint> magic;  // SHM_RING_MAGIC, after the segment is ready
+    uint rings;               // The rings of the server (one for every shard)
+    uint slots;
+    uint slot_size;
+    pid_t owner;  // The process of the writer
+    alignas(CACHE_LINE) std::atomic<lint> head;  // Messages written
+};
+
+/**
+ * @brief A message in the ring
+ */
+struct shm_slot {
+    std::atomic<lint> seq;  // The number of the message + 1 (0 while written)
+    sint topic_size;
+    sint text_size;
+    uint msg_id;
+    char data[SHM_SLOT_DATA];  // The topic, then the text
+};
+
+/**
+ * @brief A message read from a ring
+ */
+struct shm_message {
+    std::string topic;
+    std::string text;
+    uint msg_id;
+};
+
+/**
+ * @brief A broadcast ring in a shared memory segment, with one writer (the
+ * server, or one of its shards) and any number of readers (the subscribers
+ * on the same host, in other processes)
+ * The writer copies every message once, in the slot of its number, and the
+ * readers don't change anything in the segment (they map it read-only), so
+ * they don't slow each other down, and reading doesn't need a system call.
+ * Every reader keeps its own cursor (the number of the next message). A slot
+ * is marked as being written (seq = 0) before its data changes, and gets the
+ * number of its message after, so a reader checks the number before and after
+ * it copies the message: if it changed, the writer has overwritten the slot
+ * (the reader is too slow), and the reader skips to the oldest message that is
+ * still in the ring, counting the ones it has missed.
+ */
+class ShmRing {
+   private:
+    std::string name;
+    char *segment;
+    size_t size;
+    bool writer;
+
+    shm_ring_header &header() const { return *(shm_ring_header *)segment; }
+
+    shm_slot &slot(const lint number) const {
+        lint index = number & (header().slots - 1);
+        return *(shm_slot *)(segment + sizeof(shm_ring_header) +
+                             index * header().slot_size);
+    }
+
+   public:
+    ShmRing() : segment(NULL), size(0), writer(false) {}
+
+    ShmRing(const ShmRing &other) = delete;
+    ShmRing &operator=(const ShmRing &other) = delete;
+
+    ~ShmRing() {
+        if (segment != NULL) {
+            munmap(segment, size);
+            if (writer) {
+                shm_unlink(name.c_str());
+            }
+        }
+    }
+
+    /**
+     * @brief Get the name of the segment of a ring
+     * @param port The port of the server
+     * @param ring The ring (the shard that writes it)
+     */
+    static std::string segment_name(const uint port, const uint ring) {
+        return "/topic_server." + std::to_string(port) + "." +
+               std::to_string(ring);
+    }
+
+    /**
+     * @brief Check if the writer of a segment is still running (its process
+     * exists)
+     * @param segment_name The name of the segment
+     * @return true Another writer uses the segment
+     * @return false There is no segment, or it was left by a previous run
+     */
+    static bool is_owned(const std::string &segment_name) {
+        ShmRing ring;
+        if (!ring.open(segment_name)) {
+            return false;
+        }
+        pid_t owner = ring.header().owner;
+        return owner > 0 && (kill(owner, 0) == 0 || errno == EPERM);
+    }
+
+    /**
+     * @brief Create the segment (the writer). A segment of a previous run is
+     * replaced, but not the one of a writer that is still running (see
+     * is_owned). Only the user of the writer can read it
+     * @param segment_name The name of the segment
+     * @param rings The number of rings of the server
+     * @return true The ring was created
+     * @return false It couldn't be created (the messages are only sent on
+     * the sockets)
+     */
+    bool create(const std::string &segment_name, const uint rings) {
+        if (is_owned(segment_name)) {
+            console_log("The ring " + segment_name + " is already used\n");
+            return false;
+        }
+
+        name = segment_name;
+        shm_unlink(name.c_str());
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        CERR(fd < 0);
+        if (fd < 0) {
+            return false;
+        }
+
+        size = sizeof(shm_ring_header) + SHM_RING_SLOTS * sizeof(shm_slot);
+        bool mapped = ftruncate(fd, size) == 0;
+        if (mapped) {
+            void *data =
+                mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            mapped = data != MAP_FAILED;
+            segment = mapped ? (char *)data : NULL;
+        }
+        CERR(!mapped);
+        CERR(close(fd) != 0);
+        if (!mapped) {
+            shm_unlink(name.c_str());
+            return false;
+        }
+
+        // The new segment is filled with zeros (no message was written)
+        writer = true;
+        header().rings = rings;
+        header().slots = SHM_RING_SLOTS;
+        header().slot_size = sizeof(shm_slot);
+        header().owner = getpid();
+        header().magic.store(SHM_RING_MAGIC, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Map the segment of a writer (a reader)
+     * @param segment_name The name of the segment
+     * @return true The ring can be read
+     * @return false The segment doesn't exist (or it is not ready)
+     */
+    bool open(const std::string &segment_name) {
+        name = segment_name;
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat info;
+        void *data = MAP_FAILED;
+        if (fstat(fd, &info) == 0 &&
+            (size_t)info.st_size >= sizeof(shm_ring_header)) {
+            size = info.st_size;
+            data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        CERR(close(fd) != 0);
+        if (data == MAP_FAILED) {
+            return false;
+        }
+
+        segment = (char *)data;
+        if (header().magic.load(std::memory_order_acquire) != SHM_RING_MAGIC ||
+            size < sizeof(shm_ring_header) +
+                       (size_t)header().slots * header().slot_size) {
+            munmap(segment, size);
+            segment = NULL;
+            return false;
+        }
+        return true;
+    }
+
+    bool is_active() const { return segment != NULL; }
+
+    /**
+     * @brief Get the number of rings of the server (the readers open all of
+     * them)
+     */
+    uint get_rings() const { return header().rings; }
+
+    /**
+     * @brief Get the number of the next message (a new reader starts there)
+     */
+    lint get_head() const {
+        return header().head.load(std::memory_order_acquire);
+    }
+
+    /**
+     * @brief Write a message (the writer)
+     * @param topic The topic of the message
+     * @param msg_id The id of the message on the topic
+     * @param text The message (as it is shown to the clients)
+     */
+    void publish(const std::string &topic, const uint msg_id,
+                 const std::string &text) {
+        lint number = header().head.load(std::memory_order_relaxed);
+        shm_slot &s = slot(number);
+
+        // The readers must see that the slot changes before its data does
+        s.seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        s.topic_size = std::min(topic.size(), SHM_SLOT_DATA);
+        s.text_size = std::min(text.size(), SHM_SLOT_DATA - s.topic_size);
+        s.msg_id = msg_id;
+        memcpy(s.data, topic.data(), s.topic_size);
+        memcpy(s.data + s.topic_size, text.data(), s.text_size);
+
+        s.seq.store(number + 1, std::memory_order_release);
+        header().head.store(number + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief Read the next message (a reader)
+     * @param cursor The number of the next message of the reader (updated)
+     * @param msg Will contain the message
+     * @param missed Increased by the number of messages that were overwritten
+     * before the reader could read them
+     * @return true A message was read
+     * @return false There are no new messages
+     */
+    bool read(lint &cursor, shm_message &msg, lint &missed) const {
+        FOREVER {
+            lint head = header().head.load(std::memory_order_acquire);
+            if (cursor >= head) {
+                return false;
+            }
+
+            const shm_slot &s = slot(cursor);
+            bool valid =
+                head - cursor <= header().slots &&
+                s.seq.load(std::memory_order_acquire) == cursor + 1;
+            if (valid) {
+                sint topic_size = std::min<size_t>(s.topic_size, SHM_SLOT_DATA);
+                sint text_size =
+                    std::min<size_t>(s.text_size, SHM_SLOT_DATA - topic_size);
+                msg.topic.assign(s.data, topic_size);
+                msg.text.assign(s.data + topic_size, text_size);
+                msg.msg_id = s.msg_id;
+
+                // The slot must not have changed while it was copied
+                std::atomic_thread_fence(std::memory_order_acquire);
+                valid = s.seq.load(std::memory_order_relaxed) == cursor + 1;
+            }
+            if (valid) {
+                cursor++;
+                return true;
+            }
+
+            // Overwritten: skip to the oldest message the writer won't
+            // overwrite next
+            head = header().head.load(std::memory_order_acquire);
+            lint oldest = head + 1 > header().slots ? head + 1 - header().slots
+                                                    : 0;
+            oldest = std::max(oldest, cursor + 1);
+            missed += oldest - cursor;
+            cursor = oldest;
+        }
+    }
+};
+}  // namespace application
\ No newline at end of file
@@ -0,0 +1,207 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <sys/eventfd.h>  // eventfd
+
+#include <atomic>
+
+#include "Utils.hpp"
+
+#define CACHE_LINE 64
+
+namespace application {
+/**
+ * @brief A bounded, lock-free queue with a single producer and a single
+ * consumer (each one a different thread)
+ * The producer only writes "tail", the consumer only writes "head", and they
+ * are kept on different cache lines. Each side also keeps the last value it
+ * has read from the other side, so the shared index is only read again when
+ * the queue looks full (or empty).
+ * @tparam T The type of the elements (moved in and out of the queue)
+ */
+template <typename T>
+class SpscRing {
+   private:
+    std::vector<T> slots;
+    size_t mask;
+
+    alignas(CACHE_LINE) std::atomic<size_t> head;  // Next slot to read
+    size_t cached_tail;                            // Used by the consumer
+
+    alignas(CACHE_LINE) std::atomic<size_t> tail;  // Next slot to write
+    size_t cached_head;                            // Used by the producer
+
+   public:
+    /**
+     * @brief Construct a new queue
+     * @param capacity The number of elements (rounded up to a power of 2)
+     */
+    explicit SpscRing(const size_t capacity)
+        : mask(0), head(0), cached_tail(0), tail(0), cached_head(0) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    SpscRing(const SpscRing &other) = delete;
+    SpscRing &operator=(const SpscRing &other) = delete;
+
+    /**
+     * @brief Add an element (producer only)
+     * @param item The element, moved into the queue if there is space
+     * @return true The element was added
+     * @return false The queue is full
+     */
+    bool push(T &item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - cached_head > mask) {
+            cached_head = head.load(std::memory_order_acquire);
+            if (t - cached_head > mask) {
+                return false;
+            }
+        }
+
+        slots[t & mask] = std::move(item);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Remove the oldest element (consumer only)
+     * @param item Will contain the element
+     * @return true An element was removed
+     * @return false The queue is empty
+     */
+    bool pop(T &item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == cached_tail) {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (h == cached_tail) {
+                return false;
+            }
+        }
+
+        item = std::move(slots[h & mask]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Get the number of elements in the queue (can be called by any
+     * thread, the result is only an estimate)
+     */
+    size_t size() const {
+        size_t t = tail.load(std::memory_order_acquire);
+        size_t h = head.load(std::memory_order_acquire);
+        return t - h;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    size_t capacity() const { return mask + 1; }
+};
+
+/**
+ * @brief Used to wake a thread that waits for a queue to have elements
+ * The thread that waits marks itself as "waiting" before it checks the queue
+ * for the last time, and the other thread only writes the eventfd (a system
+ * call) if the first one is waiting.
+ */
+class Doorbell {
+   private:
+    int event_fd;
+    std::atomic<bool> waiting;
+
+   public:
+    Doorbell() : waiting(false) {
+        event_fd = eventfd(0, EFD_CLOEXEC);
+        MUST(event_fd >= 0, "Could not create an eventfd\n");
+    }
+
+    Doorbell(const Doorbell &other) = delete;
+    Doorbell &operator=(const Doorbell &other) = delete;
+
+    ~Doorbell() { close(event_fd); }
+
+    /**
+     * @brief Get the eventfd (readable after "ring" was called for a waiting
+     * thread, can be used with select)
+     */
+    int get_fd() const { return event_fd; }
+
+    /**
+     * @brief Mark the current thread as waiting. After this, the condition it
+     * waits for must be checked once more, before it sleeps
+     */
+    void arm() {
+        waiting.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    /**
+     * @brief The current thread is no longer waiting (the condition was true)
+     */
+    void disarm() { waiting.store(false, std::memory_order_relaxed); }
+
+    /**
+     * @brief Wait for the eventfd to be written, and clear it (if select
+     * reported it as readable, this will not block)
+     */
+    void clear() {
+        lint value;
+        CERR(read(event_fd, &value, sizeof(value)) < 0);
+    }
+
+    /**
+     * @brief Sleep until "ring" is called. If "ready" is already true, it will
+     * return immediately (the caller must check again after it returns)
+     * @param ready Checks if there is something to do
+     */
+    template <typename F>
+    void wait(F ready) {
+        arm();
+        if (ready()) {
+            disarm();
+            return;
+        }
+        clear();
+    }
+
+    /**
+     * @brief Wake the waiting thread (if there is one)
+     */
+    void ring() {
+        // Orders the push (before) with the load of the flag
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_relaxed) &&
+            waiting.exchange(false, std::memory_order_seq_cst)) {
+            lint value = 1;
+            CERR(write(event_fd, &value, sizeof(value)) < 0);
+        }
+    }
+};
+}  // namespace application
\ No newline at end of file
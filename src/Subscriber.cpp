@@ -28,6 +28,7 @@
 std::string require_params() {
     std::stringstream ss;
     ss << "Wrong parameters : ./subscriber ID IP PORT\n";
+    ss << "(IP can be unix or unix:PATH, for a server on the same host)\n";
     return ss.str();
 }
 
@@ -21,21 +21,64 @@
  */
 
 #pragma once
+#include <sys/stat.h>
+
+#include <climits>
+#include <map>
+#include <memory>
+
 #include "Messages.hpp"
+#include "ShmRing.hpp"
+#include "TopicTrie.hpp"
 #include "Utils.hpp"
 
 namespace application {
+/**
+ * @brief A broadcast topic that is read from its multicast group. After a gap,
+ * the missing messages are asked from the server, and the newer ones wait
+ * until they arrive, so the topic is shown in order
+ */
+struct multicast_topic {
+    long next;   // The id of the next message (-1 before the first one)
+    long asked;  // The last id asked from the server (-1 if none is)
+    std::map<long, std::string> waiting;  // Newer messages, shown after them
+};
+
 class Subscriber {
    private:
-    uint sockfd, server_port;
+    uint sockfd, server_port, max_fd;
     fd_set read_fds, tmp_fds;
-    sockaddr_in server_addr;
+    sockaddr_storage server_addr;  // TCP, or Unix for a local server
+    socklen_t server_len;
     std::string client_id;
 
     // The database that links topic names to their id's
     std::unordered_map<uint, std::string> topics;
     std::set<std::string> queuedTopics;
 
+    // The next message needed on the acknowledged topics (see SUB_ACK). They
+    // are kept in a file, so the next process with the same id resumes them
+    std::unordered_map<uint, uint> cursors;
+    std::set<uint> unacked;            // The cursors that have changed
+    std::set<std::string> queuedAcks;  // Acknowledged topics waiting for id
+
+    // Data received from the server, that doesn't form a whole message yet
+    std::string inbox;
+
+    // The rings of the server in shared memory (opened by the first local
+    // subscription, see ShmRing), the next message of each one, and the
+    // topics that are read from them
+    std::vector<std::unique_ptr<ShmRing>> rings;
+    std::vector<lint> ring_cursors;
+    std::set<std::string> local_topics;
+
+    // The socket that receives the broadcast topics from their multicast
+    // groups (-1 before the first one), the topics (see multicast_topic), and
+    // the number of topics read from every group
+    int multicast_sock;
+    std::unordered_map<std::string, multicast_topic> multicast_topics;
+    std::unordered_map<in_addr_t, uint> joined;
+
     /**
      * @brief Return the name of a topic
      * Will return " " if the id was not sent by the server
@@ -69,6 +112,128 @@ class Subscriber {
         return it->first;
     }
 
+    /**
+     * @brief Parse the time of a query: "now", a time of today ("09:30" or
+     * "09:30:15", local time) or the seconds since the epoch
+     * @param text The time
+     * @param time Will contain the time (ns since the epoch)
+     * @return true The time is valid
+     * @return false The time is invalid
+     */
+    static bool parse_time(const std::string& text, lint& time) {
+        if (text == "now") {
+            time = wall_time_ns();
+            return true;
+        }
+
+        if (text.find(':') != std::string::npos) {
+            uint hours, minutes, seconds = 0;
+            char extra;
+            int fields = sscanf(text.c_str(), "%u:%u:%u%c", &hours, &minutes,
+                                &seconds, &extra);
+            if ((fields != 2 && fields != 3) || hours > 23 || minutes > 59 ||
+                seconds > 59) {
+                return false;
+            }
+
+            time_t now = ::time(NULL);
+            tm day;
+            localtime_r(&now, &day);
+            day.tm_hour = hours;
+            day.tm_min = minutes;
+            day.tm_sec = seconds;
+            time = (lint)mktime(&day) * 1000000000ULL;
+            return true;
+        }
+
+        if (text.empty() ||
+            text.find_first_not_of("0123456789") != std::string::npos) {
+            return false;
+        }
+        time = std::stoull(text) * 1000000000ULL;
+        return true;
+    }
+
+    /**
+     * @brief Store the id of a topic, sent by the server
+     * @param id The id of the topic
+     * @param name The name of the topic
+     */
+    void add_topic(const uint id, const std::string& name) {
+        topics.insert(std::make_pair(id, name));
+
+        // A topic subscribed with "ack" (an existing cursor is kept)
+        if (queuedAcks.erase(name) != 0) {
+            cursors.insert(std::make_pair(id, 0));
+            save_cursors();
+        }
+
+        // If it was requested by this process, and not sent
+        // because the user was previously subscribed to it
+        auto it = queuedTopics.find(name);
+        if (it != queuedTopics.end()) {
+            queuedTopics.erase(it);
+
+            std::cout << "Subscribed " << name << "\n";
+        }
+    }
+
+    /**
+     * @brief Read the cursors kept by the previous process with this id
+     */
+    void load_cursors() {
+        std::ifstream in(CURSOR_FOLDER + client_id);
+        uint topic, next;
+        while (in >> topic >> next) {
+            cursors[topic] = next;
+        }
+    }
+
+    /**
+     * @brief Keep the cursors (before they are sent to the server, so the
+     * server is never ahead of the file)
+     */
+    void save_cursors() {
+        mkdir(CURSOR_FOLDER, S_IRWXU | S_IRWXG | S_IROTH);
+        std::string path = CURSOR_FOLDER + client_id;
+        {
+            std::ofstream out(path + ".tmp", std::ios_base::trunc);
+            for (auto& cursor : cursors) {
+                out << cursor.first << " " << cursor.second << "\n";
+            }
+        }
+        CERR(rename((path + ".tmp").c_str(), path.c_str()) != 0);
+    }
+
+    /**
+     * @brief Send the cursors of the acknowledged topics to the server
+     * @param all Send all of them (to resume them), not only the ones that
+     * have changed
+     */
+    void send_acks(const bool all) {
+        if (!all && unacked.empty()) {
+            return;
+        }
+        save_cursors();
+
+        BatchWriter acks(ACK);
+        if (all) {
+            for (auto& cursor : cursors) {
+                acks.add_cursor(cursor.first, cursor.second);
+            }
+        } else {
+            for (uint topic : unacked) {
+                acks.add_cursor(topic, cursors[topic]);
+            }
+        }
+        unacked.clear();
+
+        const std::string& frames = acks.get_frames();
+        if (!frames.empty()) {
+            CERR(send(sockfd, frames.data(), frames.size(), 0) < 0);
+        }
+    }
+
     /**
      * @brief Clear the file descriptors
      */
@@ -84,11 +249,12 @@ class Subscriber {
      */
     void init_connection() {
         // Connect to the server
-        MUST(connect(sockfd, (sockaddr*)&server_addr, sizeof(server_addr)) == 0,
+        MUST(connect(sockfd, (sockaddr*)&server_addr, server_len) == 0,
              "Couldn't connect to the server\n");
 
         // Set the file descriptors for the sockets
         FD_SET(sockfd, &read_fds);
+        max_fd = sockfd;
 
         // Set the file descriptor for STDIN
         FD_SET(STDIN_FILENO, &read_fds);
@@ -104,72 +270,411 @@ class Subscriber {
         memcpy(msg.payload, &data, TCP_DATA_CONNECT);
         // Send the client info
         CERR(send(sockfd, &msg, TCP_DATA_CONNECT + 1, 0) < 0);
+
+        // Resume the acknowledged topics
+        load_cursors();
+        send_acks(true);
     }
 #pragma GCC pop_options
 
+    /**
+     * @brief Do different things based on the messages received from the
+     * server
+     * Will return whether the program should close.
+     * @param msg The message
+     * @return true Close the program
+     * @return false Continue the program
+     */
+    bool process_message(const tcp_message& msg) {
+        switch (msg.type) {
+            case tcp_msg_type::TOPIC_ID: {
+                // Store the id of the topic in the topics map
+                tcp_topic_id data;
+                bzero(&data, TCP_DATA_TOPICID);
+                memcpy(&data, msg.payload, TCP_DATA_TOPICID);
+
+                add_topic(data.id, data.topic);
+            } break;
+            case tcp_msg_type::TOPIC_IDS: {
+                // The ids of many topics
+                tcp_batch data;
+                bzero(&data, sizeof(data));
+                memcpy(&data, msg.payload, sizeof(data));
+
+                for (auto& entry : read_batch(TOPIC_IDS, data)) {
+                    add_topic(entry.second, entry.first);
+                }
+            } break;
+            case tcp_msg_type::CONFIRM_U: {
+                // The server confirmed we are unsubscribed from this topic
+                tcp_confirm_u data;
+                bzero(&data, TCP_DATA_CONFIRM_U);
+                memcpy(&data, msg.payload, TCP_DATA_CONFIRM_U);
+
+                std::cout << "Unsubscribed " << topics[data.topic] << "\n";
+                topics.erase(data.topic);
+                if (cursors.erase(data.topic) != 0) {
+                    save_cursors();
+                }
+            } break;
+            case tcp_msg_type::SKIPPED: {
+                // Some of the messages we have missed were not kept for us
+                tcp_skipped data;
+                bzero(&data, TCP_DATA_SKIPPED);
+                memcpy(&data, msg.payload, TCP_DATA_SKIPPED);
+
+                std::cout << "Skipped " << data.count << " messages on "
+                          << get_topic_name(data.topic) << "\n";
+            } break;
+            case tcp_msg_type::DATA: {
+                tcp_data data;
+                bzero(&data, TCP_DATA_DATA);
+                memcpy(&data, msg.payload, TCP_DATA_DATA);
+
+                // The messages of an acknowledged topic that were processed
+                // already are sent again, if they were not acknowledged
+                auto it = cursors.find(data.topic);
+                if (it != cursors.end()) {
+                    if (data.id < it->second) {
+                        break;
+                    }
+                    it->second = data.id + 1;
+                    unacked.insert(data.topic);
+                }
+                std::cout << data.payload << "\n";
+            } break;
+            case tcp_msg_type::HISTORY: {
+                // A stored message, sent for a query (it doesn't change the
+                // cursors)
+                tcp_data data;
+                bzero(&data, TCP_DATA_DATA);
+                memcpy(&data, msg.payload, TCP_DATA_DATA);
+
+                std::cout << data.payload << "\n";
+            } break;
+            case tcp_msg_type::QUERY_DONE: {
+                // All the messages of a query were sent
+                tcp_query_done data;
+                bzero(&data, TCP_DATA_QUERY_DONE);
+                memcpy(&data, msg.payload, TCP_DATA_QUERY_DONE);
+
+                std::string topic(data.topic,
+                                  strnlen(data.topic, TOPIC_LENGTH));
+                std::cout << "Received " << data.count
+                          << " stored messages on " << topic << "\n";
+                recovered(topic, data.count);
+            } break;
+            case tcp_msg_type::HEARTBEAT: {
+                // The server checks that we are still here
+                tcp_message reply;
+                bzero(&reply, TCP_MSG_SIZE);
+                reply.type = tcp_msg_type::HEARTBEAT;
+                CERR(send(sockfd, &reply, 1, 0) < 0);
+            } break;
+            case tcp_msg_type::CONNECT_DUP: {
+                MUST(false, "This user id is already in use\n");
+                return true;
+            }
+            default:
+                break;
+        }
+        return false;
+    }
+
     /**
      * @brief Read TCP messages received from the srver
+     * A single recv can contain more messages (or only a part of one), so the
+     * data is accumulated in "inbox" and split into messages
      * Will return whether the program should close. (the server closed)
      * @return true Close the program
      * @return false Continue the program
      */
     bool read_tcp_message() {
-        tcp_message msg;
-        bzero(&msg, TCP_MSG_SIZE);
+        char buffer[4 * TCP_MSG_SIZE];
 
-        ssize_t msg_size = recv(sockfd, &msg, sizeof(msg), 0);
+        ssize_t msg_size = recv(sockfd, buffer, sizeof(buffer), 0);
         CERR(msg_size < 0);
 
         if (msg_size == 0) {
             // The server disconnected
             close(sockfd);
             return true;
-        } else {
-            switch (msg.type) {
-                case tcp_msg_type::TOPIC_ID: {
-                    // Store the id of the topic in the topics map
-                    tcp_topic_id data;
-                    bzero(&data, TCP_DATA_TOPICID);
-                    memcpy(&data, msg.payload, TCP_DATA_TOPICID);
-
-                    topics.insert(std::make_pair(data.id, data.topic));
-
-                    // If it was requested by this process, and not sent
-                    // because the user was previously subscribed to it
-                    auto it = queuedTopics.find(data.topic);
-                    if (it != queuedTopics.end()) {
-                        queuedTopics.erase(it);
-
-                        std::cout << "Subscribed " << data.topic << "\n";
-                    }
-                } break;
-                case tcp_msg_type::CONFIRM_U: {
-                    // The server confirmed we are unsubscribed from this topic
-                    tcp_confirm_u data;
-                    bzero(&data, TCP_DATA_CONFIRM_U);
-                    memcpy(&data, msg.payload, TCP_DATA_CONFIRM_U);
-
-                    std::cout << "Unsubscribed " << topics[data.topic] << "\n";
-                    topics.erase(data.topic);
-                } break;
-                case tcp_msg_type::DATA: {
-                    tcp_data data;
-                    bzero(&data, TCP_DATA_DATA);
-                    memcpy(&data, msg.payload, TCP_DATA_DATA);
-                    std::cout << data.payload << "\n";
-                } break;
-                case tcp_msg_type::CONNECT_DUP: {
-                    MUST(false, "This user id is already in use\n");
-                    return true;
-                }
-                default:
-                    break;
+        } else if (msg_size < 0) {
+            return false;
+        }
+        inbox.append(buffer, msg_size);
+
+        // Process all the messages that were received completely
+        size_t pos = 0;
+        while (pos < inbox.size()) {
+            size_t size = tcp_message_size(inbox.data() + pos,
+                                           inbox.size() - pos);
+            if (size == 0) {
+                // Unknown message, the rest of the data can't be parsed
+                pos = inbox.size();
+                break;
+            }
+            if (inbox.size() - pos < size) {
+                break;
+            }
+
+            tcp_message msg;
+            bzero(&msg, TCP_MSG_SIZE);
+            memcpy(&msg, inbox.data() + pos, size);
+            pos += size;
+
+            if (process_message(msg)) {
+                return true;
             }
         }
+        inbox.erase(0, pos);
+
+        // The messages received together are acknowledged together
+        send_acks(false);
+
         return false;
     }
 
-    /**W
+    /**
+     * @brief Open the rings of the server (one for every shard), if they are
+     * not open already. Only the messages written after this are read
+     * @return true The rings can be read
+     * @return false The server doesn't write its messages in shared memory
+     */
+    bool open_rings() {
+        if (!rings.empty()) {
+            return true;
+        }
+
+        std::unique_ptr<ShmRing> first(new ShmRing());
+        if (!first->open(ShmRing::segment_name(server_port, 0))) {
+            return false;
+        }
+        uint count = first->get_rings();
+        rings.push_back(std::move(first));
+
+        for (uint i = 1; i < count; ++i) {
+            std::unique_ptr<ShmRing> ring(new ShmRing());
+            if (!ring->open(ShmRing::segment_name(server_port, i))) {
+                rings.clear();
+                return false;
+            }
+            rings.push_back(std::move(ring));
+        }
+        for (auto& ring : rings) {
+            ring_cursors.push_back(ring->get_head());
+        }
+        return true;
+    }
+
+    /**
+     * @brief Read the new messages of the rings, and show the ones of the
+     * local subscriptions
+     * @return true Some messages were read
+     * @return false The rings are idle
+     */
+    bool read_rings() {
+        bool read = false;
+        lint missed = 0;
+        shm_message msg;
+        for (size_t i = 0; i < rings.size(); ++i) {
+            while (rings[i]->read(ring_cursors[i], msg, missed)) {
+                read = true;
+                if (local_topics.count(msg.topic) != 0) {
+                    std::cout << msg.text << "\n";
+                }
+            }
+        }
+        if (missed != 0) {
+            std::cout << "Missed " << missed
+                      << " messages in shared memory (too slow)\n";
+        }
+        return read || missed != 0;
+    }
+
+    /**
+     * @brief Send a range query to the server (the messages are sent back as
+     * HISTORY, then QUERY_DONE)
+     * @param data The query
+     */
+    void send_query(const tcp_query& data) {
+        tcp_message msg;
+        bzero(&msg, TCP_MSG_SIZE);
+        msg.type = tcp_msg_type::QUERY;
+        memcpy(msg.payload, &data, TCP_DATA_QUERY);
+        CERR(send(sockfd, &msg, TCP_DATA_QUERY + 1, 0) < 0);
+    }
+
+    /**
+     * @brief Create the socket that receives the multicast groups, if it
+     * doesn't exist already
+     * @return true The socket can receive the groups
+     * @return false It couldn't be created
+     */
+    bool open_multicast() {
+        if (multicast_sock >= 0) {
+            return true;
+        }
+
+        int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        CERR(sock < 0);
+        if (sock < 0) {
+            return false;
+        }
+
+        // Every subscriber on this host receives the groups on the same port
+        const int opt = 1;
+        CERR(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) !=
+             0);
+#ifdef IP_MULTICAST_ALL
+        // Only the groups joined by this socket (not the ones of the others)
+        const int all = 0;
+        CERR(setsockopt(sock, IPPROTO_IP, IP_MULTICAST_ALL, &all,
+                        sizeof(all)) != 0);
+#endif
+
+        sockaddr_in addr;
+        bzero(&addr, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(server_port + 1);
+        addr.sin_addr.s_addr = INADDR_ANY;
+        bool bound = bind(sock, (sockaddr*)&addr, sizeof(addr)) == 0;
+        CERR(!bound);
+        if (!bound) {
+            close(sock);
+            return false;
+        }
+
+        multicast_sock = sock;
+        FD_SET(multicast_sock, &read_fds);
+        max_fd = std::max(max_fd, (uint)multicast_sock);
+        return true;
+    }
+
+    /**
+     * @brief Join the multicast group of a topic, or leave it (a group is
+     * left when none of its topics are read anymore)
+     * @param topic The topic
+     * @param join Join the group, or leave it
+     */
+    void change_group(const std::string& topic, const bool join) {
+        sockaddr_in group;
+        multicast_group(topic, server_port, group);
+        uint& topics = joined[group.sin_addr.s_addr];
+        topics = join ? topics + 1 : topics - 1;
+        if (topics != (join ? 1u : 0u)) {
+            return;
+        }
+
+        ip_mreq request;
+        request.imr_multiaddr = group.sin_addr;
+        MUST(inet_aton(MULTICAST_INTERFACE, &request.imr_interface) != 0,
+             "Invalid multicast interface\n");
+        CERR(setsockopt(multicast_sock, IPPROTO_IP,
+                        join ? IP_ADD_MEMBERSHIP : IP_DROP_MEMBERSHIP,
+                        &request, sizeof(request)) != 0);
+        if (!join) {
+            joined.erase(group.sin_addr.s_addr);
+        }
+    }
+
+    /**
+     * @brief Ask the server for the messages of a broadcast topic that were
+     * lost (a range query on the TCP connection)
+     * @param topic The name of the topic
+     * @param state The topic
+     * @param last The last message that is missing
+     */
+    void recover(const std::string& topic, multicast_topic& state,
+                 const long last) {
+        std::cout << "Recovering " << last + 1 - state.next << " messages on "
+                  << topic << "\n";
+
+        tcp_query data;
+        bzero(&data, TCP_DATA_QUERY);
+        safe_cpy(data.topic, topic.c_str(), topic.size());
+        data.first = state.next;
+        data.last = last;
+        send_query(data);
+        state.asked = last;
+    }
+
+    /**
+     * @brief The server has sent the messages asked for a broadcast topic
+     * (see recover). The ones it doesn't have are lost, and the messages that
+     * were waiting are shown, until the next gap
+     * @param topic The name of the topic
+     * @param count The number of messages that were sent
+     */
+    void recovered(const std::string& topic, const uint count) {
+        auto it = multicast_topics.find(topic);
+        if (it == multicast_topics.end() || it->second.asked == -1) {
+            // A query of the user
+            return;
+        }
+
+        multicast_topic& state = it->second;
+        long lost = state.asked + 1 - state.next - (long)count;
+        if (lost > 0) {
+            std::cout << "Couldn't recover " << lost << " messages on "
+                      << topic << "\n";
+        }
+        state.next = state.asked + 1;
+        state.asked = -1;
+
+        auto msg = state.waiting.begin();
+        while (msg != state.waiting.end() && msg->first == state.next) {
+            std::cout << msg->second << "\n";
+            state.next++;
+            msg = state.waiting.erase(msg);
+        }
+        if (msg != state.waiting.end()) {
+            recover(topic, state, msg->first - 1);
+        }
+    }
+
+    /**
+     * @brief Read a datagram of a multicast group, and show it if its topic
+     * is read. The ids of a topic follow each other, so a gap means that
+     * some datagrams were lost: they are asked from the server (see recover),
+     * and the next messages wait for them (a gap is only seen when the next
+     * message of the topic arrives)
+     */
+    void read_multicast_message() {
+        char buffer[sizeof(udp_multicast)];
+        ssize_t size = recv(multicast_sock, buffer, sizeof(buffer), 0);
+        CERR(size < 0);
+
+        std::string topic, text;
+        uint id;
+        if (!read_multicast(buffer, size, topic, id, text)) {
+            return;
+        }
+        auto it = multicast_topics.find(topic);
+        if (it == multicast_topics.end() ||
+            (it->second.next != -1 && (long)id < it->second.next)) {
+            // Another topic of the group, or a duplicate
+            return;
+        }
+
+        multicast_topic& state = it->second;
+        if (state.asked != -1) {
+            // The server sends the older ones (and the ones it was asked for)
+            if ((long)id > state.asked) {
+                state.waiting.emplace(id, text);
+            }
+            return;
+        }
+        if (state.next != -1 && (long)id > state.next) {
+            state.waiting.emplace(id, text);
+            recover(topic, state, (long)id - 1);
+            return;
+        }
+        state.next = (long)id + 1;
+        std::cout << text << "\n";
+    }
+
+    /**
      * @brief Read input from stdin
      * Will return whether the program should close.
      * @return true Close the program
@@ -182,10 +687,41 @@ class Subscriber {
         if (command == "exit") {
             return true;
         } else if (command == "subscribe") {
-            // Subscribe
-            std::string topic, sf_string;
+            // Subscribe (the options are optional, on the same line)
+            std::string topic, sf_string, options_line, option;
             bool sf;
+            bint options = 0;
+            uint rate = 0, every = 0;
+            content_filter filter;
+            bzero(&filter, sizeof(filter));
             std::cin >> topic >> sf_string;
+            std::getline(std::cin, options_line);
+
+            std::istringstream options_ss(options_line);
+            while (options_ss >> option) {
+                if (option == "conflate") {
+                    options |= SUB_CONFLATE;
+                } else if (option == "snapshot") {
+                    options |= SUB_SNAPSHOT;
+                } else if (option == "filter" && options_ss >> option &&
+                           content_filter::parse(option, filter)) {
+                    // The filter is the next word ("filter gt:100")
+                    options |= SUB_FILTER;
+                } else if (option == "rate" && options_ss >> rate && rate) {
+                    // The most messages per second ("rate 5")
+                    options |= SUB_LIMIT;
+                } else if (option == "every" && options_ss >> every &&
+                           every > 1) {
+                    // One of every "every" messages ("every 10")
+                    options |= SUB_LIMIT;
+                } else if (option == "ack" && !TopicTrie::is_pattern(topic)) {
+                    // The client keeps the cursor of the topic
+                    options |= SUB_ACK;
+                } else {
+                    // Invalid input, but program can continue
+                    return false;
+                }
+            }
 
             if (sf_string == "0") {
                 sf = false;
@@ -207,6 +743,10 @@ class Subscriber {
                 bzero(&data, TCP_DATA_SUBSCRIBE);
 
                 data.sf = sf;
+                data.options = options;
+                data.filter = filter;
+                data.rate = rate;
+                data.every = every;
                 safe_cpy(data.topic, topic.c_str(), topic.size());
 
                 msg.type = tcp_msg_type::SUBSCRIBE;
@@ -217,6 +757,52 @@ class Subscriber {
 
                 // Mark this topic as "requested by the client, waiting id"
                 queuedTopics.insert(data.topic);
+                if (options & SUB_ACK) {
+                    queuedAcks.insert(data.topic);
+                }
+            }
+        } else if (command == "subscribe_local") {
+            // Read a topic from the shared memory of the server, instead of
+            // the socket (the server doesn't know about it)
+            std::string topic;
+            std::cin >> topic;
+
+            if (!open_rings()) {
+                std::cout << "The server doesn't share its messages\n";
+            } else if (local_topics.insert(topic).second) {
+                std::cout << "Subscribed " << topic << " (shared memory)\n";
+            }
+        } else if (command == "unsubscribe_local") {
+            std::string topic;
+            std::cin >> topic;
+
+            if (local_topics.erase(topic) != 0) {
+                std::cout << "Unsubscribed " << topic << " (shared memory)\n";
+            }
+        } else if (command == "subscribe_multicast") {
+            // Receive a broadcast topic from its multicast group, instead of
+            // the socket (the server doesn't know about it)
+            std::string topic;
+            std::cin >> topic;
+
+            if (!ENABLE_MULTICAST || topic.size() >= TOPIC_LENGTH ||
+                TopicTrie::is_pattern(topic) ||
+                !TopicTrie::matches(MULTICAST_TOPICS, topic)) {
+                std::cout << "The topic is not broadcast\n";
+            } else if (!open_multicast()) {
+                std::cout << "Couldn't receive the multicast groups\n";
+            } else if (multicast_topics.count(topic) == 0) {
+                multicast_topics[topic] = multicast_topic{-1, -1, {}};
+                change_group(topic, true);
+                std::cout << "Subscribed " << topic << " (multicast)\n";
+            }
+        } else if (command == "unsubscribe_multicast") {
+            std::string topic;
+            std::cin >> topic;
+
+            if (multicast_topics.erase(topic) != 0) {
+                change_group(topic, false);
+                std::cout << "Unsubscribed " << topic << " (multicast)\n";
             }
         } else if (command == "unsubscribe") {
             // Unsubscribe
@@ -239,8 +825,90 @@ class Subscriber {
                 data.topic = id;
                 memcpy(msg.payload, &data, TCP_DATA_UNSUBSCRIBE);
                 // Send the client info
-                CERR(send(sockfd, &msg, TCP_DATA_UNSUBSCRIBE, 0) < 0);
+                CERR(send(sockfd, &msg, TCP_DATA_UNSUBSCRIBE + 1, 0) < 0);
+            }
+        } else if (command == "subscribe_batch") {
+            // Subscribe to all the topics on the line, with one request
+            std::string sf_string, topics_line, topic;
+            std::cin >> sf_string;
+            std::getline(std::cin, topics_line);
+            if (sf_string != "0" && sf_string != "1") {
+                // Invalid input, but program can continue
+                return false;
+            }
+
+            tcp_subscribe data;
+            bzero(&data, TCP_DATA_SUBSCRIBE);
+            data.sf = sf_string == "1";
+
+            BatchWriter batch(SUBSCRIBE_BATCH, &data);
+            std::istringstream topics_ss(topics_line);
+            while (topics_ss >> topic) {
+                if (topic.size() >= 50) {
+                    console_log("Invalid topic size\n");
+                    continue;
+                }
+                batch.add(topic);
+                queuedTopics.insert(topic);
             }
+
+            const std::string& frames = batch.get_frames();
+            if (!frames.empty()) {
+                CERR(send(sockfd, frames.data(), frames.size(), 0) < 0);
+            }
+        } else if (command == "unsubscribe_batch") {
+            // Unsubscribe from all the topics on the line, with one request
+            std::string topics_line, topic;
+            std::getline(std::cin, topics_line);
+
+            BatchWriter batch(UNSUBSCRIBE_BATCH);
+            std::istringstream topics_ss(topics_line);
+            while (topics_ss >> topic) {
+                int id = get_topic_id(topic);
+                if (id != -1) {
+                    batch.add("", id);
+                }
+            }
+
+            const std::string& frames = batch.get_frames();
+            if (!frames.empty()) {
+                CERR(send(sockfd, frames.data(), frames.size(), 0) < 0);
+            }
+        } else if (command == "query" || command == "query_time") {
+            // The stored messages of a topic, with the ids in a range, or
+            // received in a time range ("query_time topic 09:30 now"). The
+            // rate is optional, on the same line
+            std::string topic, from, to, rate_line;
+            uint rate = 0;
+            std::cin >> topic >> from >> to;
+            std::getline(std::cin, rate_line);
+            std::istringstream(rate_line) >> rate;
+
+            tcp_query data;
+            bzero(&data, TCP_DATA_QUERY);
+
+            bool valid;
+            if (command == "query") {
+                std::istringstream range(from + " " + to);
+                valid = (bool)(range >> data.first >> data.last);
+            } else {
+                data.last = UINT_MAX;
+                valid = parse_time(from, data.since) &&
+                        parse_time(to, data.until);
+            }
+            if (!valid) {
+                // Invalid input, but program can continue
+                return false;
+            }
+
+            if (topic.size() >= 50) {
+                console_log("Invalid topic size\n");
+                return false;
+            }
+
+            safe_cpy(data.topic, topic.c_str(), topic.size());
+            data.rate = rate;
+            send_query(data);
         }
         return false;
     }
@@ -248,20 +916,37 @@ class Subscriber {
    public:
     /**
      * @brief Contrustor, initialises connections, etc.
+     * A server on the same host can be reached through its Unix socket: the
+     * ip is "unix" (the socket of the server that listens on the port) or
+     * "unix:PATH"
      * @param id The id/name of the subscriber
      * @param ip The ip of the server
      * @param port The port of the server
      */
     Subscriber(const std::string& id, const char* ip, const uint port)
-        : server_port(port), client_id(id) {
-        // Initialise the TCP socket
-        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        : server_port(port), max_fd(0), client_id(id), multicast_sock(-1) {
+        std::string adress(ip);
+        bool local = adress == "unix" || adress.compare(0, 5, "unix:") == 0;
+
+        // Initialise the socket
+        int sock = socket(local ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
         MUST(sock >= 0, "Failed to initialise socket\n");
         sockfd = sock;
 
         // Clear the file descriptors sets
         clear_fds();
 
+        bzero(&server_addr, sizeof(server_addr));
+        if (local) {
+            // Set the path of the socket
+            std::string path = adress.size() > 5 ? adress.substr(5)
+                                                 : unix_socket_path(port);
+            MUST(set_unix_adress(path, (sockaddr_un&)server_addr),
+                 "Invalid socket path\n");
+            server_len = sizeof(sockaddr_un);
+            return;
+        }
+
         // Set the socket options
         const int opt = 1;
         int neagle_res =
@@ -277,9 +962,11 @@ class Subscriber {
         }
 
         // Set the server adress
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(server_port);
-        MUST(inet_aton(ip, &server_addr.sin_addr) != 0, "Invalid IP adress\n");
+        sockaddr_in& addr = (sockaddr_in&)server_addr;
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(server_port);
+        MUST(inet_aton(ip, &addr.sin_addr) != 0, "Invalid IP adress\n");
+        server_len = sizeof(sockaddr_in);
     }
 
     /**
@@ -289,6 +976,9 @@ class Subscriber {
         // Close connection
         shutdown(sockfd, SHUT_RDWR);
         close(sockfd);
+        if (multicast_sock >= 0) {
+            close(multicast_sock);
+        }
     }
 
     /**
@@ -300,10 +990,22 @@ class Subscriber {
 
         do {
             tmp_fds = read_fds;
+            timeval no_wait = {0, 0}, idle = {0, SHM_POLL_SLEEP};
+            timeval *timeout = NULL;
+
+            // The rings are polled (without system calls), and the sockets
+            // are checked between the polls. When the rings are idle, the
+            // select waits a little for them
+            if (!local_topics.empty()) {
+                bool read = false;
+                for (uint i = 0; i < SHM_POLL_SPINS; ++i) {
+                    read = read_rings() || read;
+                }
+                timeout = read ? &no_wait : &idle;
+            }
 
-            // The maximum fd is the socket fd
-            CERR(select(sockfd + 1, &tmp_fds, NULL, NULL, NULL) < 0);
-            for (uint i = 0; i <= sockfd; ++i) {
+            CERR(select(max_fd + 1, &tmp_fds, NULL, NULL, timeout) < 0);
+            for (uint i = 0; i <= max_fd; ++i) {
                 if (FD_ISSET(i, &tmp_fds)) {
                     if (i == STDIN_FILENO) {
                         if (read_input()) {
@@ -315,6 +1017,8 @@ class Subscriber {
                             // Close the subscriber
                             return;
                         }
+                    } else if ((int)i == multicast_sock) {
+                        read_multicast_message();
                     }
                 }
             }
@@ -0,0 +1,146 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <deque>
+
+#include "Filters.hpp"
+#include "RateLimit.hpp"
+#include "Utils.hpp"
+
+namespace application {
+/**
+ * @brief The subscribers of a topic that have the same filter (it is checked
+ * once for all of them)
+ */
+struct filter_group {
+    content_filter filter;
+    std::vector<uint> sockets;
+    std::vector<uint> conflated;
+};
+
+/**
+ * @brief A subscriber of a topic with a rate limit (checked for every message)
+ */
+struct limited_subscriber {
+    uint sockfd;
+    bool conflated;
+    const content_filter *filter;  // NULL if it has no filter
+    rate_limit *limit;  // Kept by the user (see User::get_limit)
+};
+
+/**
+ * @brief The sockets of the online subscribers of a topic
+ * A list is never changed after it is published. A change (a subscription, a
+ * connection, etc.) builds a new list, and the old one is freed when nothing
+ * can use it anymore (see EpochReclaimer). The conflated subscriptions are
+ * kept apart, their messages are sent differently (see Conflator), and so are
+ * the subscriptions with a filter, grouped by filter. The rate limits are
+ * changed by the thread that owns the database (the one that sends the
+ * messages to the limited subscribers), never by the other threads
+ */
+struct subscriber_list {
+    std::vector<uint> sockets;
+    std::vector<uint> conflated;
+    std::vector<filter_group> filtered;
+    std::vector<limited_subscriber> limited;
+};
+
+/**
+ * @brief Frees the data replaced by the writer thread (the one that owns the
+ * database), after the reader threads have stopped using it
+ * When the writer gives a reader something that can use the data (for example,
+ * a message to be sent to a subscriber list), it takes a new epoch for it. A
+ * reader publishes the epoch of the last item it has finished (the items are
+ * finished in order). The data replaced at epoch "e" can only be used by
+ * items with an epoch <= e, so it is freed when every reader has reached "e".
+ * The readers never wait, and never write anything the writer does.
+ * @tparam T The type of the data
+ */
+template <typename T>
+class EpochReclaimer {
+   private:
+    lint epoch;  // The epoch of the last item given to a reader
+    std::vector<const std::atomic<lint> *> readers;
+    std::deque<std::pair<lint, const T *>> retired;  // Sorted by epoch
+
+   public:
+    EpochReclaimer() : epoch(0) {}
+
+    EpochReclaimer(const EpochReclaimer &other) = delete;
+    EpochReclaimer &operator=(const EpochReclaimer &other) = delete;
+
+    ~EpochReclaimer() {
+        for (auto &i : retired) {
+            delete i.second;
+        }
+    }
+
+    /**
+     * @brief Add a reader (before it can receive anything)
+     * @param finished The epoch of the last item the reader has finished
+     * (written by the reader)
+     */
+    void add_reader(const std::atomic<lint> *finished) {
+        readers.push_back(finished);
+    }
+
+    /**
+     * @brief Take the epoch for an item that will be given to a reader
+     * @return lint The epoch
+     */
+    lint next_epoch() { return ++epoch; }
+
+    /**
+     * @brief The data was replaced, free it when the readers are done
+     * @param data The old data (can be NULL)
+     */
+    void retire(const T *data) {
+        if (data != NULL) {
+            retired.push_back(std::make_pair(epoch, data));
+        }
+        reclaim();
+    }
+
+    /**
+     * @brief Free the data that can't be used anymore
+     */
+    void reclaim() {
+        lint done = epoch;
+        for (const std::atomic<lint> *finished : readers) {
+            done = std::min(done, finished->load(std::memory_order_acquire));
+        }
+
+        while (!retired.empty() && retired.front().first <= done) {
+            delete retired.front().second;
+            retired.pop_front();
+        }
+    }
+
+    /**
+     * @brief Get the number of retired objects that are not freed yet
+     */
+    size_t pending() const { return retired.size(); }
+};
+}  // namespace application
\ No newline at end of file
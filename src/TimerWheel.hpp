@@ -0,0 +1,299 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "Utils.hpp"
+
+#define TIMER_TICK 1000000ULL  // The resolution of the timers (ns)
+#define TIMER_LEVELS 4         // 64^4 ticks (about 4.6 hours) ahead
+#define TIMER_SLOTS 64         // Slots on every level
+
+namespace application {
+/**
+ * @brief A timer that has expired (see TimerWheel::advance)
+ */
+struct timer_event {
+    lint id;    // The timer
+    uint kind;  // What the timer is for (set by the user of the wheel)
+    uint key;   // What it refers to (a socket, for example)
+};
+
+/**
+ * @brief A hierarchical timer wheel, with O(1) add and cancel
+ * Level L has TIMER_SLOTS slots of 64^L ticks, and holds the timers that
+ * expire in less than 64^(L+1) ticks (but not less than 64^L), in the slot of
+ * their deadline. When the current tick reaches a slot of a higher level, its
+ * timers are moved down (they are closer now), and the timers of a slot of
+ * the first level expire. The timers are nodes of doubly linked lists
+ * (indices in one vector, reused after they expire), and every level has a
+ * bitmap of its slots that are not empty, so finding the next tick with
+ * something to do doesn't scan the slots (or the timers).
+ */
+class TimerWheel {
+   private:
+    struct timer_node {
+        lint deadline;    // The tick when it expires
+        uint kind;
+        uint key;
+        uint generation;  // Changed when the node is freed (see make_id)
+        int prev;
+        int next;
+        int slot;  // The index of its list in "heads" (-1 if it is free)
+    };
+
+    std::vector<timer_node> nodes;
+    std::vector<uint> free_nodes;
+    int heads[TIMER_LEVELS * TIMER_SLOTS];
+    lint occupied[TIMER_LEVELS];  // The slots that are not empty (bitmaps)
+    lint now_tick;                // The last tick that was handled
+    size_t count;
+
+    static uint level_shift(const uint level) { return 6 * level; }
+
+    lint make_id(const uint index) const {
+        return ((lint)nodes[index].generation << 32) | index;
+    }
+
+    /**
+     * @brief Add a node to the slot of its deadline (not before the current
+     * tick)
+     * @param index The node
+     */
+    void link(const uint index) {
+        timer_node &n = nodes[index];
+
+        // A deadline the wheel can't hold is kept in the last slot it can,
+        // and moved again from there
+        lint deadline = std::max(n.deadline, now_tick);
+        lint range = 1ULL << level_shift(TIMER_LEVELS);
+        if (deadline - now_tick >= range) {
+            deadline = now_tick + range - 1;
+        }
+
+        uint level = 0;
+        while (level + 1 < TIMER_LEVELS &&
+               deadline - now_tick >= 1ULL << level_shift(level + 1)) {
+            level++;
+        }
+        uint slot = (deadline >> level_shift(level)) & (TIMER_SLOTS - 1);
+
+        n.slot = level * TIMER_SLOTS + slot;
+        n.prev = -1;
+        n.next = heads[n.slot];
+        if (n.next >= 0) {
+            nodes[n.next].prev = index;
+        }
+        heads[n.slot] = index;
+        occupied[level] |= 1ULL << slot;
+    }
+
+    /**
+     * @brief Remove a node from its slot
+     * @param index The node
+     */
+    void unlink(const uint index) {
+        timer_node &n = nodes[index];
+        if (n.prev >= 0) {
+            nodes[n.prev].next = n.next;
+        } else {
+            heads[n.slot] = n.next;
+        }
+        if (n.next >= 0) {
+            nodes[n.next].prev = n.prev;
+        }
+        if (heads[n.slot] < 0) {
+            occupied[n.slot / TIMER_SLOTS] &= ~(1ULL << (n.slot % TIMER_SLOTS));
+        }
+        n.slot = -1;
+    }
+
+    /**
+     * @brief Free a node (the ids of its timer become invalid)
+     * @param index The node
+     */
+    void release(const uint index) {
+        nodes[index].slot = -1;
+        nodes[index].generation++;
+        free_nodes.push_back(index);
+        count--;
+    }
+
+    /**
+     * @brief Take all the nodes of a slot
+     * @param slot The index of the slot in "heads"
+     * @return int The first node (-1 if there is none)
+     */
+    int take_slot(const uint slot) {
+        int first = heads[slot];
+        heads[slot] = -1;
+        occupied[slot / TIMER_SLOTS] &= ~(1ULL << (slot % TIMER_SLOTS));
+        return first;
+    }
+
+    /**
+     * @brief Get the next tick when a slot must be handled. On every level,
+     * it is the first occupied slot after the current one, or, if there is
+     * none, the first one in the next turn of the level
+     * @return lint The tick (UINT64_MAX if there are no timers)
+     */
+    lint next_tick() const {
+        lint next = UINT64_MAX;
+        for (uint level = 0; level < TIMER_LEVELS; ++level) {
+            lint slots = occupied[level];
+            if (slots == 0) {
+                continue;
+            }
+
+            uint shift = level_shift(level), turn = level_shift(level + 1);
+            uint current = (now_tick >> shift) & (TIMER_SLOTS - 1);
+            lint after = current + 1 < TIMER_SLOTS
+                             ? slots & (~0ULL << (current + 1))
+                             : 0;
+            lint start = (now_tick >> turn) << turn;
+            if (after == 0) {
+                start += 1ULL << turn;
+                after = slots;
+            }
+            next = std::min(
+                next, start | ((lint)__builtin_ctzll(after) << shift));
+        }
+        return next;
+    }
+
+   public:
+    /**
+     * @brief Construct a new wheel
+     * @param now The current time (ns, see time_ns)
+     */
+    explicit TimerWheel(const lint now) : now_tick(now / TIMER_TICK), count(0) {
+        std::fill(heads, heads + TIMER_LEVELS * TIMER_SLOTS, -1);
+        std::fill(occupied, occupied + TIMER_LEVELS, 0);
+    }
+
+    TimerWheel(const TimerWheel &other) = delete;
+    TimerWheel &operator=(const TimerWheel &other) = delete;
+
+    /**
+     * @brief Add a timer
+     * @param deadline When it expires (ns, see time_ns)
+     * @param kind What the timer is for
+     * @param key What it refers to
+     * @return lint The id of the timer (never 0)
+     */
+    lint add(const lint deadline, const uint kind, const uint key) {
+        uint index;
+        if (!free_nodes.empty()) {
+            index = free_nodes.back();
+            free_nodes.pop_back();
+        } else {
+            index = nodes.size();
+            nodes.push_back(timer_node{0, 0, 0, 1, -1, -1, -1});
+        }
+
+        timer_node &n = nodes[index];
+        n.deadline = std::max<lint>(deadline / TIMER_TICK, now_tick + 1);
+        n.kind = kind;
+        n.key = key;
+        link(index);
+        count++;
+        return make_id(index);
+    }
+
+    /**
+     * @brief Cancel a timer
+     * @param id The timer
+     * @return true The timer was cancelled
+     * @return false The timer has expired, or was cancelled already
+     */
+    bool cancel(const lint id) {
+        uint index = id & 0xffffffff;
+        if (index >= nodes.size() || nodes[index].slot < 0 ||
+            nodes[index].generation != id >> 32) {
+            return false;
+        }
+        unlink(index);
+        release(index);
+        return true;
+    }
+
+    /**
+     * @brief Move the wheel to the current time
+     * @param now The current time (ns, see time_ns)
+     * @param expired The timers that have expired are added to it (in the
+     * order of their deadlines)
+     */
+    void advance(const lint now, std::vector<timer_event> &expired) {
+        lint target = now / TIMER_TICK;
+        for (lint tick = next_tick(); tick <= target; tick = next_tick()) {
+            now_tick = tick;
+
+            // The higher levels first, their timers can move to the lower
+            // slots of this tick
+            for (uint level = TIMER_LEVELS - 1; level > 0; --level) {
+                if ((tick & ((1ULL << level_shift(level)) - 1)) != 0) {
+                    continue;
+                }
+                uint slot = (tick >> level_shift(level)) & (TIMER_SLOTS - 1);
+                for (int i = take_slot(level * TIMER_SLOTS + slot); i >= 0;) {
+                    int next = nodes[i].next;
+                    link(i);
+                    i = next;
+                }
+            }
+
+            for (int i = take_slot(tick & (TIMER_SLOTS - 1)); i >= 0;) {
+                int next = nodes[i].next;
+                if (nodes[i].deadline > tick) {
+                    // It was too far, and kept in a closer slot
+                    link(i);
+                } else {
+                    expired.push_back(
+                        timer_event{make_id(i), nodes[i].kind, nodes[i].key});
+                    release(i);
+                }
+                i = next;
+            }
+        }
+        now_tick = std::max(now_tick, target);
+    }
+
+    /**
+     * @brief Get the time until the wheel must be advanced again
+     * @param now The current time (ns, see time_ns)
+     * @return lint The time (ns, UINT64_MAX if there are no timers)
+     */
+    lint next_expiry(const lint now) const {
+        lint tick = next_tick();
+        if (tick == UINT64_MAX) {
+            return UINT64_MAX;
+        }
+        return tick * TIMER_TICK > now ? tick * TIMER_TICK - now : 0;
+    }
+
+    /**
+     * @brief Get the number of timers
+     */
+    size_t size() const { return count; }
+};
+}  // namespace application
\ No newline at end of file
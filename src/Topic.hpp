@@ -22,64 +22,412 @@
 
 #pragma once
 
+#include <sys/mman.h>  // mmap
+#include <sys/stat.h>  // stat
+
+#include <deque>
+
+#include "Crc32c.hpp"
 #include "Filesystem.hpp"
+#include "LogWriter.hpp"
 #include "Utils.hpp"
 
 #define MAX_TOPIC_LINES 500
+#define TOPIC_INDEX_EVERY 64  // Records between two entries of the file index
 
 namespace application {
+/**
+ * @brief An entry of the index of a topic file: where a record is, and when
+ * its message was received
+ */
+struct index_entry {
+    long id;
+    off_t offset;
+    lint time;
+};
+
+/**
+ * @brief A file mapped in memory, read only (a copy starts without a mapping)
+ */
+struct file_mapping {
+    const char* data;
+    off_t size;
+
+    file_mapping() : data(NULL), size(0) {}
+    file_mapping(const file_mapping& other) : data(NULL), size(0) {}
+    ~file_mapping() { reset(); }
+
+    file_mapping& operator=(const file_mapping& other) {
+        reset();
+        return *this;
+    }
+
+    /**
+     * @brief Unmap the file, and keep another mapping instead (if any)
+     * @param new_data The new mapping
+     * @param new_size Its size
+     */
+    void reset(const char* new_data = NULL, const off_t new_size = 0) {
+        if (data != NULL) {
+            munmap((void*)data, size);
+        }
+        data = new_data;
+        size = new_size;
+    }
+};
+
 class Topic {
    private:
     uint id;
     std::string name;
     long last_message_id;
-    std::queue<std::string> messages;
+    std::deque<std::string> messages;  // Records, see make_record
+    LogWriter* writer;
+    std::string last_value;  // The last message (without its id)
+    lint last_time;          // When the last message was received
+
+    // The size of the file (with the appends that are queued), and every
+    // TOPIC_INDEX_EVERY-th record in it, so a range of messages (by id or by
+    // time) is read from its closest record, not from the start
+    off_t file_size;
+    std::vector<index_entry> index;
+
+    // The file, mapped in memory when it was last read. The file only grows,
+    // so the mapping is kept, and replaced when a read goes past its end
+    file_mapping mapped;
 
     /**
-     * @brief Get the id from a message
-     * @param msg The message
-     * @return uint Its id
+     * @brief Append data to the file of this topic
+     * The file is created now, if this is the first time the topic stores
+     * messages. If a writer is used (io_uring or the pipeline), the write is
+     * only queued
+     * @param data The data
+     * @return true The data was written (or queued)
+     * @return false The file couldn't be opened, or written
      */
-    uint get_message_id(const std::string& msg) {
-        std::istringstream ss(msg);
-        std::string id;
-        ss >> id;
-        return atoi(id.c_str());
+    bool write_file(const std::string& data) {
+        if (writer == NULL) {
+            return DataFolder::get().append_file(name, data);
+        }
+
+        int fd = DataFolder::get().open_file(name, writer);
+        if (fd < 0) {
+            return false;
+        }
+        writer->append(fd, data);
+        return true;
+    }
+
+    /**
+     * @brief Move the oldest records from the memory to the file, and add
+     * them to the index
+     * @param count The number of records
+     */
+    void flush_records(const size_t count) {
+        long id = last_message_id + 1 - (long)messages.size();
+        std::string data;
+        std::vector<index_entry> added;
+        for (size_t i = 0; i < count && !messages.empty(); ++i, ++id) {
+            if (id % TOPIC_INDEX_EVERY == 0) {
+                added.push_back(index_entry{id,
+                                            file_size + (off_t)data.size(),
+                                            record_time(messages.front())});
+            }
+            data += messages.front() + "\n";
+            messages.pop_front();
+        }
+
+        // The records that couldn't be written are lost, the index and the
+        // size must only count the ones in the file
+        if (!data.empty() && write_file(data)) {
+            index.insert(index.end(), added.begin(), added.end());
+            file_size += data.size();
+        }
     }
 
     /**
-     * @brief Return the message with the specified id (from the memory or the
-     * filesystem)
-     * @param msg_id The id of the message
-     * @return std::string The message
+     * @brief Map the file of this topic in memory again, if it has grown since
+     * it was mapped (a read needs the records after the end of the mapping)
+     * @param drain If the queued appends are written to the file first
+     * @return true The mapping is bigger
+     * @return false The file has nothing more (or it can't be read)
      */
-    std::string get_message(const uint msg_id) {
-        // If the id we search is smaller than the oldest message from the
-        // queue, it means we can find it in the file
-        std::string first_msg = messages.front();
+    bool map_file(const bool drain) {
+        if (mapped.size >= file_size) {
+            // The topic has nothing more in the file
+            return false;
+        }
+        if (drain && writer != NULL) {
+            writer->drain();
+        }
+
+        int fd = DataFolder::get().open_read(name);
+        struct stat st;
+        void* data = MAP_FAILED;
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > mapped.size) {
+            data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
 
-        if (get_message_id(first_msg) > msg_id) {
-            std::ifstream in(DATABASE_FOLDER + name);
+        if (data == MAP_FAILED) {
+            return false;
+        }
+        mapped.reset((const char*)data, st.st_size);
+        return true;
+    }
 
-            std::string data;
-            while (std::getline(in, data)) {
-                if (get_message_id(data) == msg_id) {
-                    return data;
+    /**
+     * @brief Read the records of the file, from the mapping, until "visit"
+     * returns true. If the end of the mapping is reached before, the file is
+     * mapped again: with what is in the file now, then (only if that is not
+     * enough) after the queued appends are written
+     * @param pos The offset of the first record
+     * @param visit Called with the start and the end of every record
+     */
+    template <typename F>
+    void scan_file(off_t pos, F visit) {
+        for (int pass = 0; pass < 3; ++pass) {
+            if (pass > 0 && !map_file(pass == 2)) {
+                continue;
+            }
+            while (pos < mapped.size) {
+                const char* start = mapped.data + pos;
+                const char* end =
+                    (const char*)memchr(start, '\n', mapped.size - pos);
+                if (end == NULL) {
+                    break;
                 }
+                if (visit(start, end)) {
+                    return;
+                }
+                pos = end - mapped.data + 1;
             }
-        } else {
-            // The message is in the memory
-            std::queue<std::string> other = messages;
-            while (!other.empty()) {
-                if (get_message_id(other.front()) == msg_id) {
-                    return other.front();
+        }
+    }
+
+    /**
+     * @brief Read the messages of a range that are in the file. The file is
+     * mapped in memory, and read from the closest record in the index
+     * @param first The id of the first message
+     * @param last The id of the last message
+     * @param texts The messages are added to it (see read_range)
+     */
+    void read_file(const long first, const long last,
+                   std::vector<std::string>& texts) {
+        size_t expected = texts.size() + (last - first + 1);
+        auto it = std::partition_point(
+            index.begin(), index.end(),
+            [first](const index_entry& e) { return e.id <= first; });
+        off_t pos = it == index.begin() ? 0 : std::prev(it)->offset;
+
+        std::string msg;
+        scan_file(pos, [&](const char* start, const char* end) {
+            long id = record_id(start, end);
+            if (id > last) {
+                return true;
+            } else if (id >= first) {
+                std::string record(start, end);
+                if (parse_record(record, msg, VERIFY_REPLAY_CHECKSUMS)) {
+                    texts.push_back(message_text(msg));
                 } else {
-                    other.pop();
+                    console_log("Topic " + name + ": invalid record " +
+                                std::to_string(id) + "\n");
+                    texts.push_back("");
                 }
             }
+            return texts.size() >= expected;
+        });
+        texts.resize(expected);
+    }
+
+    /**
+     * @brief Get the id of a record (its first field)
+     * @param record The start of the record
+     * @param end The end of the record
+     */
+    static long record_id(const char* record, const char* end) {
+        long id = 0;
+        for (const char* c = record; c < end && *c >= '0' && *c <= '9'; ++c) {
+            id = id * 10 + (*c - '0');
+        }
+        return id;
+    }
+
+    /**
+     * @brief Get the time of a record (its third field, see add_message),
+     * without parsing all of it
+     * @param record The start of the record
+     * @param end The end of the record
+     * @return lint The time (0 if the record doesn't have one)
+     */
+    static lint record_time(const char* record, const char* end) {
+        // Skip the id and the checksum
+        for (int i = 0; i < 2 && record != NULL; ++i) {
+            record = (const char*)memchr(record, ' ', end - record);
+            record = record != NULL ? record + 1 : NULL;
+        }
+        if (record == NULL) {
+            return 0;
+        }
+
+        lint time = 0;
+        const char* c = record;
+        for (; c < end && *c >= '0' && *c <= '9'; ++c) {
+            time = time * 10 + (*c - '0');
+        }
+        return c > record && c < end && *c == ' ' ? time : 0;
+    }
+
+    static lint record_time(const std::string& record) {
+        return record_time(record.data(), record.data() + record.size());
+    }
+
+    /**
+     * @brief Get the text of a message ("id time text", see add_message). The
+     * messages stored before they had a time are "id text"
+     * @param msg The message
+     * @return std::string The text
+     */
+    static std::string message_text(const std::string& msg) {
+        size_t start = msg.find(' ');
+        if (start == std::string::npos) {
+            return "";
+        }
+        start++;
+
+        size_t end = start;
+        while (end < msg.size() && msg[end] >= '0' && msg[end] <= '9') {
+            end++;
+        }
+        if (end > start && end < msg.size() && msg[end] == ' ') {
+            return msg.substr(end + 1);
+        }
+        return msg.substr(start);
+    }
+
+    /**
+     * @brief Build the record that is stored in the file, from a message
+     * The record is "id crc rest_of_the_message", the crc (8 hex digits) being
+     * the CRC32C of the message ("id rest_of_the_message")
+     * @param msg The message
+     * @return std::string The record (without the new line)
+     */
+    static std::string make_record(const std::string& msg) {
+        static const char digits[] = "0123456789abcdef";
+        uint crc = crc32c(msg);
+
+        size_t pos = std::min(msg.find(' '), msg.size());
+        std::string record;
+        record.reserve(msg.size() + 10);
+        record.append(msg, 0, pos);
+        record += ' ';
+        for (int shift = 28; shift >= 0; shift -= 4) {
+            record += digits[(crc >> shift) & 0xf];
+        }
+        record.append(msg, pos, std::string::npos);
+        return record;
+    }
+
+    /**
+     * @brief Get the message from a record (see make_record)
+     * @param record The record, as it is stored in the file
+     * @param msg Will contain the message
+     * @param verify If the checksum should be checked
+     * @return true The record is valid
+     * @return false The record is malformed, or the checksum doesn't match
+     */
+    static bool parse_record(const std::string& record, std::string& msg,
+                             const bool verify) {
+        size_t first = record.find(' ');
+        if (first == std::string::npos || record.size() < first + 10 ||
+            record[first + 9] != ' ') {
+            return false;
+        }
+
+        msg = record.substr(0, first) + record.substr(first + 9);
+        if (!verify) {
+            return true;
+        }
+        uint crc = strtoul(record.substr(first + 1, 8).c_str(), NULL, 16);
+        return crc == crc32c(msg);
+    }
+
+    /**
+     * @brief Check the records that are already in the file of this topic
+     * (left by a previous run of the server). The topic continues from the
+     * last valid record. Everything after the first invalid record (for
+     * example, a torn write) is removed from the file.
+     */
+    void recover() {
+        DataFolder& folder = DataFolder::get();
+        struct stat st;
+        if (!folder.contains(name) || !folder.stat_file(name, st) ||
+            st.st_size == 0) {
+            return;
+        }
+
+        int fd = folder.open_read(name);
+        if (fd < 0) {
+            return;
+        }
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            return;
+        }
+
+        const char* start = (const char*)data;
+        std::string record, msg, last;
+        off_t valid_size = 0;
+        while (valid_size < st.st_size) {
+            off_t offset = valid_size;
+            const char* end = (const char*)memchr(start + offset, '\n',
+                                                  st.st_size - offset);
+            if (end == NULL) {
+                // The last record wasn't completely written
+                break;
+            }
+
+            record.assign(start + offset, end);
+            if (!parse_record(record, msg, true) ||
+                (long)get_message_id(msg) != last_message_id + 1) {
+                break;
+            }
+            last_message_id++;
+            valid_size = end - start + 1;
+            last = msg;
+            last_time = std::max(last_time, record_time(record));
+            if (last_message_id % TOPIC_INDEX_EVERY == 0) {
+                index.push_back(
+                    index_entry{last_message_id, offset, record_time(record)});
+            }
+        }
+        munmap(data, st.st_size);
+        file_size = valid_size;
+        if (!last.empty()) {
+            last_value = message_text(last);
         }
 
-        return "";
+        if (st.st_size > valid_size) {
+            console_log("Topic " + name + ": removed " +
+                        std::to_string(st.st_size - valid_size) +
+                        " bytes of invalid records\n");
+            folder.truncate_file(name, valid_size);
+        }
+    }
+
+    /**
+     * @brief Get the id from a message
+     * @param msg The message
+     * @return uint Its id
+     */
+    uint get_message_id(const std::string& msg) {
+        std::istringstream ss(msg);
+        std::string id;
+        ss >> id;
+        return atoi(id.c_str());
     }
 
    public:
@@ -87,24 +435,30 @@ class Topic {
         : id(0),
           name(""),
           last_message_id(-1),
-          messages(std::queue<std::string>()) {
-        Filesystem fs;
-        fs.createFile(DATABASE_FOLDER);
-    }
+          messages(std::deque<std::string>()),
+          writer(NULL),
+          last_value(""),
+          last_time(0),
+          file_size(0) {}
 
     /**
      * @brief Construct a new topic
-     * Also, create the file that will store this topic's messages
+     * If the topic already has a file, the messages it contains are recovered.
+     * Otherwise, the file is created only when messages are stored in it
      * @param id The id of the topic (set by the server)
      * @param name The name of the topic
+     * @param writer The writer used to append to the file (if any)
      */
-    Topic(const uint id, const std::string& name)
+    Topic(const uint id, const std::string& name, LogWriter* writer = NULL)
         : id(id),
           name(name),
           last_message_id(-1),
-          messages(std::queue<std::string>()) {
-        Filesystem fs;
-        fs.createFile(DATABASE_FOLDER + name);
+          messages(std::deque<std::string>()),
+          writer(writer),
+          last_value(""),
+          last_time(0),
+          file_size(0) {
+        recover();
     }
 
     /**
@@ -115,7 +469,12 @@ class Topic {
         : id(other.id),
           name(other.name),
           last_message_id(other.last_message_id),
-          messages(other.messages) {
+          messages(other.messages),
+          writer(other.writer),
+          last_value(other.last_value),
+          last_time(other.last_time),
+          file_size(other.file_size),
+          index(other.index) {
         // It doesn't need to create any new file
     }
 
@@ -126,35 +485,26 @@ class Topic {
     void add_message(const std::string& message) {
         // If there are too many messages in the stack, store excess messages in
         // file
-        std::ofstream out(DATABASE_FOLDER + name,
-                          std::ios_base::app | std::ios_base::out);
         if (messages.size() == MAX_TOPIC_LINES) {
             // Store a quarter of the messages
-            for (int i = 0; i < MAX_TOPIC_LINES / 4; ++i) {
-                out << messages.front() << "\n";
-                messages.pop();
-            }
-            out.close();
+            flush_records(MAX_TOPIC_LINES / 4);
         }
 
-        out.close();
+        // The time of the message (ns since the epoch) never decreases, so
+        // the messages can be found by time with a binary search
+        last_time = std::max(wall_time_ns(), last_time);
         last_message_id++;
-        messages.push(std::to_string(last_message_id) + " " + message);
+        // The checksum is computed now, while the message is in the cache
+        messages.push_back(make_record(std::to_string(last_message_id) + " " +
+                                       std::to_string(last_time) + " " +
+                                       message));
+        last_value = message;
     }
 
     /**
      * @brief Store all data into files. Will remove it from memory
      */
-    void save() {
-        std::ofstream out(DATABASE_FOLDER + name,
-                          std::ios_base::app | std::ios_base::out);
-        // Store a quarter of the messages
-        while (!messages.empty()) {
-            out << messages.front() << "\n";
-            messages.pop();
-        }
-        out.close();
-    }
+    void save() { flush_records(messages.size()); }
 
     /**
      * @brief Returns all the messages with id's in the specified range
@@ -170,28 +520,141 @@ class Topic {
             std::swap(start, finish);
         }
 
-        if (finish > last_message_id) {
-            finish = last_message_id;
+        // Get all messages from the range (the invalid ones are skipped)
+        std::vector<std::string> texts;
+        read_range(start, finish, texts);
+        for (std::string& msg : texts) {
+            if (!msg.empty()) {
+                v.push_back(std::move(msg));
+            }
+        }
+
+        return v;
+    }
+
+    /**
+     * @brief Read the messages with the ids in a range, from the file and
+     * from the memory (each one is read once)
+     * @param first The id of the first message
+     * @param last The id of the last message (at most the last one of the
+     * topic)
+     * @param texts Will contain the messages (without their ids), one for
+     * every id (empty if its record is invalid)
+     * @return long The id of the first message in "texts"
+     */
+    long read_range(long first, long last, std::vector<std::string>& texts) {
+        first = std::max(first, 0L);
+        last = std::min(last, last_message_id);
+        texts.clear();
+        if (first > last) {
+            return first;
+        }
+
+        long memory_first = last_message_id + 1 - (long)messages.size();
+        if (first < memory_first) {
+            read_file(first, std::min(last, memory_first - 1), texts);
         }
 
-        // Get all messages from the range
-        for (uint i = start; i <= finish; ++i) {
-            // Remove the message id from the messages
-            std::string msg = get_message(i);
-            int pos = msg.find_first_of(' ');
-            if (msg != "") {
-                v.push_back(msg.substr(pos + 1));
+        std::string msg;
+        for (long id = std::max(first, memory_first); id <= last; ++id) {
+            parse_record(messages[id - memory_first], msg, false);
+            texts.push_back(message_text(msg));
+        }
+        return first;
+    }
+
+    /**
+     * @brief Find the first message received at (or after) a time. The times
+     * never decrease, so it is a binary search in the memory, and, for an
+     * older time, in the index of the file (that is read from the closest
+     * entry)
+     * @param since The time (ns since the epoch)
+     * @return long The id of the message (the last id + 1 if there is none)
+     */
+    long find_time(const lint since) {
+        long memory_first = last_message_id + 1 - (long)messages.size();
+        auto it = std::partition_point(
+            messages.begin(), messages.end(),
+            [since](const std::string& r) { return record_time(r) < since; });
+        if (it != messages.begin() || memory_first == 0) {
+            return memory_first + (it - messages.begin());
+        }
+
+        auto entry = std::partition_point(
+            index.begin(), index.end(),
+            [since](const index_entry& e) { return e.time < since; });
+        off_t pos = entry == index.begin() ? 0 : std::prev(entry)->offset;
+        long found = memory_first;
+        scan_file(pos, [&](const char* start, const char* end) {
+            if (record_time(start, end) >= since) {
+                found = record_id(start, end);
+                return true;
             }
+            return false;
+        });
+        return found;
+    }
+
+    /**
+     * @brief Get the id of the first message that is sent to a store-forward
+     * subscriber, that has missed the messages after last_id. The older ones
+     * are over the limits (SF_MAX_MESSAGES, SF_MAX_AGE) and are skipped
+     * @param last_id The last message the subscriber has received
+     * @return long The id
+     */
+    long get_backlog_start(const long last_id) {
+        long first = last_id + 1;
+        if (SF_MAX_MESSAGES > 0) {
+            first =
+                std::max(first, last_message_id + 1 - (long)SF_MAX_MESSAGES);
+        }
+        if (SF_MAX_AGE > 0 && first <= last_message_id) {
+            lint now = wall_time_ns(), age = SF_MAX_AGE * 1000000000ULL;
+            first = std::max(first, find_time(now > age ? now - age : 0));
         }
+        return first;
+    }
 
-        return v;
+    /**
+     * @brief Get the messages a store-forward subscriber has missed, within
+     * the limits (see get_backlog_start). The oldest messages are skipped
+     * until their size is at most SF_MAX_BYTES
+     * @param last_id The last message the subscriber has received
+     * @param texts Will contain the messages, one for every id (empty if its
+     * record is invalid, so the ids of the next ones don't change)
+     * @param latest If only the newest message is needed (a conflated
+     * subscription)
+     * @return long The id of the first message in "texts"
+     */
+    long get_backlog(const long last_id, std::vector<std::string>& texts,
+                     const bool latest = false) {
+        long first = get_backlog_start(last_id);
+        if (latest) {
+            first = std::max(first, last_message_id);
+        }
+        if (first > last_message_id) {
+            return first;
+        }
+        first = read_range(first, last_message_id, texts);
+
+        if (SF_MAX_BYTES > 0) {
+            size_t size = 0, kept = texts.size();
+            while (kept > 0 && size + texts[kept - 1].size() <= SF_MAX_BYTES) {
+                size += texts[--kept].size();
+            }
+            texts.erase(texts.begin(), texts.begin() + kept);
+            first += kept;
+        }
+        return first;
     }
 
     /**
-     * @brief Get the last message on the topic
-     * @return std::string The message
+     * @brief Get the last message on the topic. It is always kept in memory
+     * (also after the messages are moved to the file, or recovered from it),
+     * so new subscribers can receive it without reading the file
+     * @return std::string The message (empty if there is none)
      */
-    std::string get_last_message() const { return messages.front(); }
+    const std::string& get_last_message() const { return last_value; }
 
     /**
      * @brief Get the id of the last message
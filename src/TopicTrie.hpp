@@ -0,0 +1,211 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <memory>
+
+#include "Utils.hpp"
+
+#define TOPIC_SEPARATOR '/'
+#define WILDCARD_ONE "+"  // Any single level
+#define WILDCARD_ALL "#"  // Any number of levels (the last level only)
+
+namespace application {
+/**
+ * @brief A trie of topic names, split in levels ("a/b/c" has 3 levels), that
+ * stores some values (ids) for every name. It is used in two ways:
+ * - with topic names: find_matching finds the topics that match a pattern
+ * - with patterns: find_patterns finds the patterns that match a topic, in a
+ * time proportional to the depth of the topic (not to the number of patterns)
+ * A pattern is a topic name with wildcards: "+" matches a level, and "#"
+ * matches the current level and all the levels under it ("a/#" matches "a",
+ * "a/b" and "a/b/c").
+ */
+class TopicTrie {
+   private:
+    struct node {
+        std::unordered_map<std::string, std::unique_ptr<node>> children;
+        std::vector<uint> values;
+    };
+    node root;
+
+    /**
+     * @brief Split a name into its levels
+     */
+    static std::vector<std::string> split(const std::string &name) {
+        std::vector<std::string> levels;
+        size_t start = 0, end;
+        while ((end = name.find(TOPIC_SEPARATOR, start)) != std::string::npos) {
+            levels.push_back(name.substr(start, end - start));
+            start = end + 1;
+        }
+        levels.push_back(name.substr(start));
+        return levels;
+    }
+
+    const node *child(const node &parent, const std::string &level) const {
+        auto it = parent.children.find(level);
+        return it != parent.children.end() ? it->second.get() : NULL;
+    }
+
+    /**
+     * @brief Add the values of a node, and of all the nodes under it
+     */
+    static void collect(const node &from, std::vector<uint> &values) {
+        values.insert(values.end(), from.values.begin(), from.values.end());
+        for (auto &i : from.children) {
+            collect(*i.second, values);
+        }
+    }
+
+    void find_matching(const node &from, const std::vector<std::string> &levels,
+                       const size_t level, std::vector<uint> &values) const {
+        if (level == levels.size()) {
+            values.insert(values.end(), from.values.begin(), from.values.end());
+        } else if (levels[level] == WILDCARD_ALL) {
+            collect(from, values);
+        } else if (levels[level] == WILDCARD_ONE) {
+            for (auto &i : from.children) {
+                find_matching(*i.second, levels, level + 1, values);
+            }
+        } else if (const node *next = child(from, levels[level])) {
+            find_matching(*next, levels, level + 1, values);
+        }
+    }
+
+    void find_patterns(const node &from, const std::vector<std::string> &levels,
+                       const size_t level, std::vector<uint> &values) const {
+        if (const node *all = child(from, WILDCARD_ALL)) {
+            values.insert(values.end(), all->values.begin(), all->values.end());
+        }
+        if (level == levels.size()) {
+            values.insert(values.end(), from.values.begin(), from.values.end());
+            return;
+        }
+        if (const node *next = child(from, levels[level])) {
+            find_patterns(*next, levels, level + 1, values);
+        }
+        if (const node *one = child(from, WILDCARD_ONE)) {
+            find_patterns(*one, levels, level + 1, values);
+        }
+    }
+
+   public:
+    /**
+     * @brief Add a value to a name (a topic, or a pattern)
+     * @param name The name
+     * @param value The value
+     */
+    void insert(const std::string &name, const uint value) {
+        node *current = &root;
+        for (const std::string &level : split(name)) {
+            std::unique_ptr<node> &next = current->children[level];
+            if (!next) {
+                next.reset(new node());
+            }
+            current = next.get();
+        }
+        current->values.push_back(value);
+    }
+
+    /**
+     * @brief Remove a value of a name (the nodes that become empty are
+     * removed too)
+     * @param name The name
+     * @param value The value
+     */
+    void erase(const std::string &name, const uint value) {
+        std::vector<std::string> levels = split(name);
+        std::vector<node *> path(1, &root);
+        for (const std::string &level : levels) {
+            auto it = path.back()->children.find(level);
+            if (it == path.back()->children.end()) {
+                return;
+            }
+            path.push_back(it->second.get());
+        }
+
+        std::vector<uint> &values = path.back()->values;
+        values.erase(std::remove(values.begin(), values.end(), value),
+                     values.end());
+        for (size_t i = levels.size(); i > 0; --i) {
+            if (!path[i]->values.empty() || !path[i]->children.empty()) {
+                break;
+            }
+            path[i - 1]->children.erase(levels[i - 1]);
+        }
+    }
+
+    /**
+     * @brief Get the values of the names that match a pattern
+     * @param pattern The pattern
+     * @param values Will contain the values
+     */
+    void find_matching(const std::string &pattern,
+                       std::vector<uint> &values) const {
+        find_matching(root, split(pattern), 0, values);
+    }
+
+    /**
+     * @brief Get the values of the patterns that match a name
+     * @param name The name (without wildcards)
+     * @param values Will contain the values
+     */
+    void find_patterns(const std::string &name,
+                       std::vector<uint> &values) const {
+        find_patterns(root, split(name), 0, values);
+    }
+
+    /**
+     * @brief Check if a name is a valid pattern (it has wildcards, and "#" is
+     * only used as the last level)
+     * @param name The name
+     */
+    static bool is_pattern(const std::string &name) {
+        std::vector<std::string> levels = split(name);
+        bool wildcards = false;
+        for (size_t i = 0; i < levels.size(); ++i) {
+            if (levels[i] == WILDCARD_ALL && i + 1 != levels.size()) {
+                return false;
+            }
+            wildcards = wildcards || levels[i] == WILDCARD_ALL ||
+                        levels[i] == WILDCARD_ONE;
+        }
+        return wildcards;
+    }
+
+    /**
+     * @brief Check if a topic matches a pattern
+     * @param pattern The pattern
+     * @param name The name of the topic
+     */
+    static bool matches(const std::string &pattern, const std::string &name) {
+        TopicTrie trie;
+        std::vector<uint> values;
+        trie.insert(name, 0);
+        trie.find_matching(pattern, values);
+        return !values.empty();
+    }
+};
+}  // namespace application
\ No newline at end of file
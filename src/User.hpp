@@ -22,13 +22,28 @@
 
 #pragma once
 
-#include <map>
-
+#include "Filters.hpp"
+#include "RateLimit.hpp"
 #include "Utils.hpp"
 
 enum user_status { U_OFFLINE, U_ONLINE };
 
 namespace application {
+/**
+ * @brief A subscription of a user
+ * "next_id" is the "id" of the next message that will be sent to the user on
+ * that topic (the last sent one + 1, so it is 0 when no message was sent), and
+ * "sf" stores whether the client should receive all unsent "messages" while it
+ * was disconnected (packed together with the id). "options" are the other
+ * options of the subscription (see subscription_option)
+ */
+struct subscription {
+    uint topic;
+    uint next_id : 31;
+    uint sf : 1;
+    bint options;
+};
+
 class User {
    private:
     std::string id;
@@ -38,14 +53,40 @@ class User {
     bint status;
 
     /**
-     * @brief This structure stores all the topics this user is subscribed to
-     * The key of the map is the id of the topic
-     * The first element of the value-pair is the "id" of the last message that
-     * was sent to the user on that topic
-     * The second element stores whether to client should receive all unsent
-     * "messages" while it was disconnected
+     * @brief This structure stores all the topics this user is subscribed to,
+     * sorted by the id of the topic (a flat array, searched using binary
+     * search)
      */
-    std::map<uint, std::pair<uint, bint>> topics;
+    std::vector<subscription> topics;
+
+    // The filters of the subscriptions that have one (SUB_FILTER), by topic
+    std::unordered_map<uint, content_filter> filters;
+    // The rate limits of the subscriptions that have one (SUB_LIMIT)
+    std::unordered_map<uint, rate_limit> limits;
+
+    // Find the subscription to a topic (or where it should be inserted)
+    std::vector<subscription>::iterator find(const uint topic) {
+        return std::lower_bound(
+            topics.begin(), topics.end(), topic,
+            [](const subscription& s, const uint t) { return s.topic < t; });
+    }
+
+    std::vector<subscription>::const_iterator find(const uint topic) const {
+        return std::lower_bound(
+            topics.begin(), topics.end(), topic,
+            [](const subscription& s, const uint t) { return s.topic < t; });
+    }
+
+    // Get the subscription to a topic, NULL if there is none
+    subscription* get(const uint topic) {
+        auto it = find(topic);
+        return (it != topics.end() && it->topic == topic) ? &*it : NULL;
+    }
+
+    const subscription* get(const uint topic) const {
+        auto it = find(topic);
+        return (it != topics.end() && it->topic == topic) ? &*it : NULL;
+    }
 
    public:
     // Constructors
@@ -62,7 +103,9 @@ class User {
           socket(other.socket),
           port(other.port),
           status(other.status),
-          topics(other.topics) {}
+          topics(other.topics),
+          filters(other.filters),
+          limits(other.limits) {}
 
     /**
      * @brief Set the status of the user
@@ -89,16 +132,33 @@ class User {
      * later, when he returns
      * @param last_msg The id of the last message sent to the user, on this
      * topic
+     * @param options The other options of the subscription
+     * @param filter The filter of the messages (if options has SUB_FILTER)
+     * @param limit The rate of the messages (if options has SUB_LIMIT)
      */
-    void subscribe(const uint topic, const bool store,
-                   const uint last_msg = 0) {
-        std::pair<uint, bint> p;
-        p = std::make_pair(last_msg, store);
+    void subscribe(const uint topic, const bool store, const long last_msg = 0,
+                   const bint options = 0, const content_filter* filter = NULL,
+                   const rate_limit* limit = NULL) {
+        auto it = find(topic);
 
         // This operation must not change existing values
-        if (!is_subscribed(topic)) {
+        if (it == topics.end() || it->topic != topic) {
             // Add the new subscription
-            topics[topic] = p;
+            subscription s;
+            s.topic = topic;
+            s.next_id = last_msg + 1;
+            s.sf = store;
+            s.options = options & ~(SUB_FILTER | SUB_LIMIT);
+            if ((options & SUB_FILTER) && filter != NULL &&
+                filter->op != FILTER_NONE) {
+                s.options |= SUB_FILTER;
+                filters[topic] = *filter;
+            }
+            if ((options & SUB_LIMIT) && limit != NULL && limit->is_set()) {
+                s.options |= SUB_LIMIT;
+                limits[topic] = rate_limit{limit->rate, limit->every, 0, 0, 0};
+            }
+            topics.insert(it, s);
         }
     }
 
@@ -106,7 +166,26 @@ class User {
      * @brief Unsubscribe the user from a topic
      * @param topic The topic to unsubscribe from
      */
-    void unsubcribe(const uint topic) { topics.erase(topic); }
+    void unsubcribe(const uint topic) {
+        auto it = find(topic);
+        if (it != topics.end() && it->topic == topic) {
+            if (it->options & SUB_FILTER) {
+                filters.erase(topic);
+            }
+            if (it->options & SUB_LIMIT) {
+                limits.erase(topic);
+            }
+            topics.erase(it);
+        }
+    }
+
+    /**
+     * @brief Get all the subscriptions of the user, sorted by topic
+     * @return const std::vector<subscription>& The subscriptions
+     */
+    const std::vector<subscription>& get_subscriptions() const {
+        return topics;
+    }
 
     /**
      * @brief Get the id of the user
@@ -163,10 +242,7 @@ class User {
      * @return true The user is subscribed
      * @return false The user is not subscribed
      */
-    bool is_subscribed(const uint topic) {
-        auto it = topics.find(topic);
-        return it != topics.end();
-    }
+    bool is_subscribed(const uint topic) const { return get(topic) != NULL; }
 
     /**
      * @brief Checks if a user will receive messages that were sent while he was
@@ -175,14 +251,71 @@ class User {
      * @return true Store-forward is activated
      * @return false It will not receive old messages
      */
-    bool is_sf(const uint topic) {
-        auto it = topics.find(topic);
-        if (it != topics.end()) {
-            return it->second.second == 1;
+    bool is_sf(const uint topic) const {
+        const subscription* s = get(topic);
+        if (s != NULL) {
+            return s->sf == 1;
         }
         return false;
     }
 
+    /**
+     * @brief Checks if only the newest message of a topic is kept for the user
+     * (see SUB_CONFLATE)
+     * @param topic The topic
+     * @return true The subscription is conflated
+     * @return false Every message is sent
+     */
+    bool is_conflated(const uint topic) const {
+        const subscription* s = get(topic);
+        return s != NULL && (s->options & SUB_CONFLATE) != 0;
+    }
+
+    /**
+     * @brief Checks if the client acknowledges the messages of a topic (the
+     * last message it has received is only changed by the acknowledgements)
+     * @param topic The topic
+     */
+    bool is_acked(const uint topic) const {
+        const subscription* s = get(topic);
+        return s != NULL && (s->options & SUB_ACK) != 0;
+    }
+
+    /**
+     * @brief Get the filter of the messages of a subscription
+     * @param topic The topic
+     * @return const content_filter* The filter, NULL if every message is sent
+     */
+    const content_filter* get_filter(const uint topic) const {
+        const subscription* s = get(topic);
+        if (s == NULL || !(s->options & SUB_FILTER)) {
+            return NULL;
+        }
+        return &filters.at(topic);
+    }
+
+    /**
+     * @brief Get the rate limit of a subscription. It is kept by the user (so
+     * it is not reset when the user reconnects), and it is changed when the
+     * messages are sent
+     * @param topic The topic
+     * @return rate_limit* The limit, NULL if every message is sent
+     */
+    rate_limit* get_limit(const uint topic) {
+        const subscription* s = get(topic);
+        if (s == NULL || !(s->options & SUB_LIMIT)) {
+            return NULL;
+        }
+        return &limits.at(topic);
+    }
+
+    /**
+     * @brief Get the rate limits of the subscriptions (by topic)
+     */
+    const std::unordered_map<uint, rate_limit>& get_limits() const {
+        return limits;
+    }
+
     /**
      * @brief Checks if the user is online
      * @return true The user is online
@@ -203,7 +336,7 @@ class User {
      * @return false Unsent messages will be "forgot" for this user
      */
     bool get_store(const uint topic) const {
-        if (topics.at(topic).second == 0) {
+        if (get(topic)->sf == 0) {
             return false;
         } else {
             return true;
@@ -213,16 +346,21 @@ class User {
     /**
      * @brief Get the id of the last message the user received on the topic
      * @param topic The topic
-     * @return uint The id
+     * @return long The id, -1 if no message was sent
      */
-    uint get_last_id(const uint topic) const { return topics.at(topic).first; }
+    long get_last_id(const uint topic) const {
+        return (long)get(topic)->next_id - 1;
+    }
 
     /**
      * @brief set the id of the last message sent on the specified topic
      * @param topic The topic
      */
-    void sent_message_set(const uint topic, const uint id) {
-        topics[topic].first = id;
+    void sent_message_set(const uint topic, const long id) {
+        subscription* s = get(topic);
+        if (s != NULL) {
+            s->next_id = id + 1;
+        }
     }
 
     /**
@@ -28,6 +28,7 @@
 #include <netinet/tcp.h>
 #include <sys/select.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <algorithm>
@@ -70,10 +71,42 @@
 
 // Server settings
 #define ENABLE_LOGS false
+#define ENABLE_IO_URING false  // Batch socket and log I/O using io_uring
+#define ENABLE_PIPELINE false  // Run the server stages on separate threads
+#define FANOUT_THREADS 0  // Sender threads for topics with many subscribers
+#define SEND_BACKLOG_LIMIT (16 << 20)  // Bytes kept for a client that doesn't
+                                       // read, before it is dropped
+#define SHARD_COUNT 1  // Threads that each own a part of the topics and clients
+#define VERIFY_REPLAY_CHECKSUMS true  // Check stored records when read
+#define SF_MAX_MESSAGES 0  // Messages replayed to a SF subscription (0 = all)
+#define SF_MAX_BYTES 0     // The size of the replayed messages (0 = no limit)
+#define SF_MAX_AGE 0       // The age (seconds) of the replayed ones (0 = any)
+#define SF_DROP_ON_OVERFLOW false  // Unsubscribe instead of skipping the oldest
+#define QUERY_RATE 10000  // Messages per second sent to a range query (default)
+#define MAX_USER_QUERIES 8  // Range queries a client can have at once
+#define HANDSHAKE_TIMEOUT 10  // Seconds a client has to send CONNECT (0 = any)
+#define HEARTBEAT_INTERVAL 0  // Seconds between heartbeats (0 = no heartbeats)
+#define HEARTBEAT_MISSED 3    // Silent intervals before a client is dropped
+#define MAX_PENDING_HANDSHAKES 512  // Connections that haven't sent CONNECT
+#define ACCEPT_BATCH 64  // Connections accepted in an iteration (at most)
+#define ENABLE_UNIX_SOCKET false  // Also accept local clients on a Unix socket
+#define UNIX_SOCKET_FOLDER "/tmp/"  // Where the Unix socket is created
+#define ENABLE_SHM_RING false  // Also write the messages in shared memory
+#define ENABLE_MULTICAST false  // Also send the broadcast topics to multicast
+#define MULTICAST_TOPICS "#"    // The broadcast topics (a pattern)
+#define MULTICAST_BASE "239.255.0.1"  // The first multicast group
+#define MULTICAST_GROUPS 16  // The groups the broadcast topics are spread on
+#define MULTICAST_TTL 1      // The routers a datagram can cross (1 = none)
+#define MULTICAST_INTERFACE "0.0.0.0"  // The interface of the groups (any)
 #define DATABASE_FOLDER "./data/"
 
+// Subscriber settings
+#define CURSOR_FOLDER "./cursors/"  // The cursors of the acknowledged topics
+#define SHM_POLL_SPINS 100000  // Polls of the shared memory between two selects
+#define SHM_POLL_SLEEP 100     // The select timeout (us) when they are idle
+
 // Server constants
-#define MAX_CLIENTS UINT32_MAX
+#define ACCEPT_BACKLOG 4096  // Connections the kernel keeps until accepted
 #define MAX_STDIN_COMMAND 100
 
 // Message constants
@@ -82,10 +115,15 @@
 #define UDP_PAYLOAD_SIZE 1500
 #define TCP_MSG_SIZE sizeof(tcp_message)
 #define TCP_DATA_DATA 1596
+#define TCP_DATA_TEXT (TCP_DATA_DATA - 2 * sizeof(uint))  // The text of a DATA
 #define TCP_DATA_SUBSCRIBE sizeof(tcp_subscribe)
 #define TCP_DATA_UNSUBSCRIBE sizeof(tcp_unsubscribe)
 #define TCP_DATA_CONFIRM_U sizeof(tcp_confirm_u)
 #define TCP_DATA_TOPICID sizeof(tcp_topic_id)
+#define TCP_DATA_SKIPPED sizeof(tcp_skipped)
+#define TCP_DATA_QUERY sizeof(tcp_query)
+#define TCP_DATA_QUERY_DONE sizeof(tcp_query_done)
+#define TCP_BATCH_DATA 1400  // The entries of a batch message (see tcp_batch)
 #define TCP_DATA_CONNECT 50
 #define UDP_INT_SIZE sizeof(udp_int)
 #define UDP_REAL_SIZE sizeof(udp_real)
@@ -108,6 +146,18 @@ enum udp_msg_type { INT, SHORT_REAL, FLOAT, STRING };
  * CONFIRM_U - server->client - servers confirms that the client was
  * unsubscribed
  * CONNECT_DUP - server->client - notifies that the client is already connected
+ * SKIPPED - server->client - some stored messages were not sent (too many)
+ * SUBSCRIBE_BATCH - client->server - subscribe to many topics at once
+ * UNSUBSCRIBE_BATCH - client->server - unsubscribe from many topics at once
+ * TOPIC_IDS - server->client - contains the ids of many topics
+ * ACK - client->server - the next message the client needs, on the topics it
+ * acknowledges (sent periodically, and right after CONNECT to resume them)
+ * QUERY - client->server - request the stored messages of a topic (a range)
+ * HISTORY - server->client - a message of a range (like DATA)
+ * QUERY_DONE - server->client - all the messages of a range were sent
+ * HEARTBEAT - both - the connection is alive (sent by the server every
+ * HEARTBEAT_INTERVAL, the client replies with one)
+ * The batch messages have a variable size (see tcp_message_size)
  */
 enum tcp_msg_type {
     DATA,
@@ -116,7 +166,35 @@ enum tcp_msg_type {
     TOPIC_ID,
     CONNECT,
     CONFIRM_U,
-    CONNECT_DUP
+    CONNECT_DUP,
+    SKIPPED,
+    SUBSCRIBE_BATCH,
+    UNSUBSCRIBE_BATCH,
+    TOPIC_IDS,
+    ACK,
+    QUERY,
+    HISTORY,
+    QUERY_DONE,
+    HEARTBEAT
+};
+
+/**
+ * @brief The options of a subscription (bits, sent with SUBSCRIBE)
+ * SUB_CONFLATE - only the newest message of the topic is kept, while the client
+ * can't receive it (and only the last one is stored and forwarded)
+ * SUB_SNAPSHOT - the last message of the topic is sent right after TOPIC_ID
+ * SUB_FILTER - only the messages that match the filter are sent (see
+ * content_filter)
+ * SUB_LIMIT - the messages are sent at a limited rate (see rate_limit)
+ * SUB_ACK - the store-forward cursor only advances when the client acknowledges
+ * the messages (ACK), not when they are sent
+ */
+enum subscription_option {
+    SUB_CONFLATE = 1,
+    SUB_SNAPSHOT = 2,
+    SUB_FILTER = 4,
+    SUB_LIMIT = 8,
+    SUB_ACK = 16
 };
 
 // Compute power y of x in O(Log y)
@@ -163,4 +241,75 @@ void nsleep(long nanoseconds) {
     slptm.tv_sec = 0;
     slptm.tv_nsec = nanoseconds;
     nanosleep(&slptm, NULL);
+}
+
+/**
+ * @brief Get the time from a monotonic clock, in nanoseconds
+ * @return lint The time
+ */
+lint time_ns() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (lint)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * @brief Get the time from the real time clock (since the epoch), in
+ * nanoseconds. Unlike time_ns, it can be compared between runs
+ * @return lint The time
+ */
+lint wall_time_ns() {
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (lint)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * @brief Get the path of the Unix socket of the server that listens on a port
+ * @param port The port
+ * @return std::string The path
+ */
+std::string unix_socket_path(const uint port) {
+    return std::string(UNIX_SOCKET_FOLDER) + "topic_server." +
+           std::to_string(port) + ".sock";
+}
+
+/**
+ * @brief Set the adress of a Unix socket
+ * @param path The path of the socket
+ * @param addr The adress
+ * @return true The adress was set
+ * @return false The path is too long
+ */
+bool set_unix_adress(const std::string &path, sockaddr_un &addr) {
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+/**
+ * @brief Get the multicast group of a broadcast topic. The topics are spread
+ * on MULTICAST_GROUPS groups by the hash of their name (FNV-1a), and the
+ * groups use the port after the one of the server
+ * @param topic The name of the topic
+ * @param port The port of the server
+ * @param addr Will contain the adress of the group
+ */
+void multicast_group(const std::string &topic, const uint port,
+                     sockaddr_in &addr) {
+    uint hash = 2166136261u;
+    for (const char c : topic) {
+        hash = (hash ^ (uchar)c) * 16777619u;
+    }
+
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port + 1);
+    inet_aton(MULTICAST_BASE, &addr.sin_addr);
+    addr.sin_addr.s_addr =
+        htonl(ntohl(addr.sin_addr.s_addr) + hash % MULTICAST_GROUPS);
 }
\ No newline at end of file
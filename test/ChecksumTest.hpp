@@ -0,0 +1,228 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+#include "Crc32c.hpp"
+#include "Test.hpp"
+#include "Topic.hpp"
+
+namespace testing {
+class ChecksumTest : public Test {
+   public:
+    bool run_tests() {
+        return test_known_value() && test_implementations() &&
+               test_recovery() && test_ranges() && test_times() &&
+               test_backlog();
+    }
+
+   private:
+    const application::Crc32c& crc = application::Crc32c::get();
+
+    bool test_known_value() {
+        return ASSERT_EQUALS(crc.compute("123456789", 9), 0xe3069283,
+                             "The checksum is not correct\n") &&
+               ASSERT_EQUALS(crc.compute_sw("123456789", 9), 0xe3069283,
+                             "The table checksum is not correct\n");
+    }
+
+    bool test_implementations() {
+        // Long enough to use the 3-way hardware implementation
+        std::string data;
+        for (uint i = 0; i < 2000; ++i) {
+            data += (char)(i * 31 + 7);
+        }
+
+        for (uint len = 0; len <= data.size(); len += 13) {
+            if (crc.compute(data.c_str(), len) !=
+                crc.compute_sw(data.c_str(), len)) {
+                return ASSERT_TRUE(false,
+                                   "The implementations give different "
+                                   "checksums\n");
+            }
+        }
+        return true;
+    }
+
+    bool test_recovery() {
+        std::string name = "checksum_test/topic";
+        std::string path = std::string(DATABASE_FOLDER) + name;
+        application::Filesystem fs;
+
+        {
+            application::Topic topic(0, name);
+            for (uint i = 0; i < 10; ++i) {
+                topic.add_message("message " + std::to_string(i));
+            }
+            topic.save();
+        }
+
+        // Simulate a torn write at the end of the file
+        std::ofstream out(path, std::ios_base::app);
+        out << "10 0000";
+        out.close();
+
+        application::Topic recovered(1, name);
+        std::ifstream in(path);
+        std::string content((std::istreambuf_iterator<char>(in)),
+                            std::istreambuf_iterator<char>());
+        in.close();
+
+        std::vector<std::string> msgs = recovered.get_messages(0, 9);
+        fs.deleteDirectory(std::string(DATABASE_FOLDER) + "checksum_test");
+        application::DataFolder::get().reload();
+
+        return ASSERT_EQUALS(recovered.get_last_id(), 9,
+                             "The valid records were not recovered\n") &&
+               ASSERT_EQUALS(msgs.size(), 10,
+                             "The recovered messages can't be read\n") &&
+               ASSERT_EQUALS(msgs[9], "message 9",
+                             "The recovered message is not correct\n") &&
+               ASSERT_EQUALS(recovered.get_last_message(), "message 9",
+                             "The last message was not recovered\n") &&
+               ASSERT_TRUE(!content.empty() && content.back() == '\n',
+                           "The torn record was not removed\n");
+    }
+
+    bool test_ranges() {
+        std::string name = "checksum_test/range";
+        application::Filesystem fs;
+        std::vector<std::string> texts, recovered_texts;
+        long first;
+
+        {
+            // Some of the messages are moved to the file
+            application::Topic topic(0, name);
+            for (uint i = 0; i < 600; ++i) {
+                topic.add_message("message " + std::to_string(i));
+            }
+            first = topic.read_range(100, 549, texts);
+            topic.save();
+        }
+
+        // The index of the file is rebuilt when it is loaded
+        application::Topic recovered(1, name);
+        recovered.read_range(0, 1000, recovered_texts);
+        fs.deleteDirectory(std::string(DATABASE_FOLDER) + "checksum_test");
+        application::DataFolder::get().reload();
+
+        return ASSERT_EQUALS(first, 100, "The range starts at another id\n") &&
+               ASSERT_EQUALS(texts.size(), 450,
+                             "The range doesn't have all the messages\n") &&
+               ASSERT_EQUALS(texts.front(), "message 100",
+                             "The range was not read from the file\n") &&
+               ASSERT_EQUALS(texts.back(), "message 549",
+                             "The range was not read from the memory\n") &&
+               ASSERT_EQUALS(recovered_texts.size(), 600,
+                             "The range is not limited to the topic\n") &&
+               ASSERT_EQUALS(recovered_texts[321], "message 321",
+                             "The recovered file was not indexed\n");
+    }
+
+    bool test_times() {
+        std::string name = "checksum_test/times";
+        std::string path = std::string(DATABASE_FOLDER) + name;
+        application::Filesystem fs;
+        lint middle = 0;
+        long found;
+
+        {
+            application::Topic topic(0, name);
+            for (uint i = 0; i < 600; ++i) {
+                if (i == 300) {
+                    middle = wall_time_ns();
+                }
+                topic.add_message("message " + std::to_string(i));
+            }
+            found = topic.find_time(middle);
+            topic.save();
+        }
+
+        // Found in the file, and the times are recovered from it
+        application::Topic recovered(1, name);
+        long recovered_found = recovered.find_time(middle);
+        long after = recovered.find_time(wall_time_ns() + 1);
+        fs.deleteDirectory(std::string(DATABASE_FOLDER) + "checksum_test");
+        application::DataFolder::get().reload();
+
+        // A record stored before the messages had a time
+        std::string msg = "0 old message";
+        char checksum[9];
+        snprintf(checksum, sizeof(checksum), "%08x",
+                 crc.compute(msg.c_str(), msg.size()));
+        fs.createDirectory(std::string(DATABASE_FOLDER) + "checksum_test");
+        std::ofstream out(path);
+        out << "0 " << checksum << " old message\n";
+        out.close();
+        application::DataFolder::get().reload();
+
+        application::Topic old(2, name);
+        std::vector<std::string> msgs = old.get_messages(0, 0);
+        fs.deleteDirectory(std::string(DATABASE_FOLDER) + "checksum_test");
+        application::DataFolder::get().reload();
+
+        return ASSERT_EQUALS(found, 300, "The time was not found\n") &&
+               ASSERT_EQUALS(recovered_found, 300,
+                             "The time was not found in the file\n") &&
+               ASSERT_EQUALS(after, 600, "A message is newer than now\n") &&
+               ASSERT_EQUALS(msgs.size(), 1,
+                             "The record without a time is invalid\n") &&
+               ASSERT_EQUALS(msgs[0], "old message",
+                             "The record without a time is not read\n");
+    }
+
+    bool test_backlog() {
+        std::string name = "checksum_test/backlog";
+        std::string path = std::string(DATABASE_FOLDER) + name;
+        application::Filesystem fs;
+        std::vector<std::string> texts;
+        long first;
+
+        {
+            application::Topic topic(0, name);
+            for (uint i = 0; i < 10; ++i) {
+                topic.add_message("message " + std::to_string(i));
+            }
+            topic.save();
+
+            // A record in the middle of the file is damaged
+            std::fstream file(path, std::ios_base::in | std::ios_base::out);
+            std::string content((std::istreambuf_iterator<char>(file)),
+                                std::istreambuf_iterator<char>());
+            file.seekp(content.find("message 4"));
+            file << "massage 4";
+            file.close();
+
+            first = topic.get_backlog(1, texts);
+        }
+        fs.deleteDirectory(std::string(DATABASE_FOLDER) + "checksum_test");
+        application::DataFolder::get().reload();
+
+        return ASSERT_EQUALS(first, 2, "The backlog starts at another id\n") &&
+               ASSERT_EQUALS(texts.size(), 8,
+                             "The invalid record has no placeholder\n") &&
+               ASSERT_TRUE(texts[2].empty(),
+                           "The invalid record was replayed\n") &&
+               ASSERT_EQUALS(texts[3], "message 5",
+                             "The next messages have other ids\n");
+    }
+};
+}  // namespace testing
\ No newline at end of file
@@ -0,0 +1,348 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+#include "Database.hpp"
+#include "Messages.hpp"
+#include "Test.hpp"
+
+namespace testing {
+class DatabaseTest : public Test {
+   public:
+    bool run_tests() {
+        return test_topic_ids() && test_stable_topics() && test_subscribers() &&
+               test_shards() && test_subscriber_lists() && test_backlog() &&
+               test_filters() && test_rate_limits() && test_wildcards() &&
+               test_acks() && test_sockets();
+    }
+
+   private:
+    application::Database db;
+
+    bool test_topic_ids() {
+        uint first = db.add_topic("db_test/a");
+        uint second = db.add_topic("db_test/b");
+
+        return ASSERT_EQUALS(first, 0, "The first id is not correct\n") &&
+               ASSERT_EQUALS(second, 1, "The second id is not correct\n") &&
+               ASSERT_EQUALS(db.add_topic("db_test/a"), first,
+                             "An existing topic was added again\n") &&
+               ASSERT_EQUALS(db.get_topic_id("db_test/b"), 1,
+                             "The topic was not found\n") &&
+               ASSERT_EQUALS(db.get_topic_id("db_test/c"), -1,
+                             "An inexistent topic was found\n") &&
+               ASSERT_FALSE(db.topic_exists(2),
+                            "An inexistent topic was created\n");
+    }
+
+    bool test_stable_topics() {
+        application::Topic& topic = db.get_topic(0);
+        for (uint i = 0; i < 1000; ++i) {
+            db.add_topic("db_test/t" + std::to_string(i));
+        }
+        db.topic_new_message(0, "message");
+
+        return ASSERT_EQUALS(&topic, &db.get_topic(0),
+                             "The topic was moved\n") &&
+               ASSERT_EQUALS(topic.get_last_id(), 0,
+                             "The message was not added\n") &&
+               ASSERT_EQUALS(db.get_topic_name(500), "db_test/t498",
+                             "The topic name is not correct\n");
+    }
+
+    bool test_subscribers() {
+        application::User user("db_user", "127.0.0.1", 10, 123);
+        db.subscribe(user, 1, true);
+        db.subscribe(user, 1, false);
+        bool subscribed = db.get_subscriber_count(1) == 1 && user.is_sf(1);
+
+        db.unsubscribe(user, 1);
+        db.unsubscribe(user, 1);
+
+        return ASSERT_TRUE(subscribed, "The user was not subscribed\n") &&
+               ASSERT_EQUALS(db.get_subscriber_count(1), 0,
+                             "The user was not unsubscribed\n");
+    }
+
+    bool test_shards() {
+        // The second shard (of 4)
+        application::Database shard(1, 4);
+        uint first = shard.add_topic("db_test/s1");
+        uint second = shard.add_topic("db_test/s2");
+        bool ids = first == 1 && second == 5 && shard.topic_exists(5) &&
+                   !shard.topic_exists(2) && shard.get_topic(5).get_id() == 5;
+
+        // A topic of the first shard
+        application::User user("db_user", "127.0.0.1", 10, 123);
+        shard.add_remote_topic(8, "db_test/r", 40);
+        bool remote = shard.subscribe_remote(user, 8, true, 41) &&
+                      !shard.subscribe_remote(user, 8, true, 41) &&
+                      shard.get_subscriber_count(8) == 1 &&
+                      user.get_last_id(8) == 41 &&
+                      shard.get_topic_name(8) == "db_test/r" &&
+                      shard.unsubscribe(user, 8) &&
+                      shard.get_subscriber_count(8) == 0;
+
+        // The users of other shards, subscribed to a topic of this one
+        shard.add_shard_subscriber(5, 0);
+        shard.add_shard_subscriber(5, 0);
+        shard.add_shard_subscriber(5, 3);
+        shard.remove_shard_subscriber(5, 0);
+        lint both = shard.get_subscribed_shards(5);
+        shard.remove_shard_subscriber(5, 0);
+
+        return ASSERT_TRUE(ids, "The ids of the shard are not correct\n") &&
+               ASSERT_TRUE(remote, "The remote topic was not subscribed\n") &&
+               ASSERT_EQUALS(both, 9, "The subscribed shards are wrong\n") &&
+               ASSERT_EQUALS(shard.get_subscribed_shards(5), 8,
+                             "The shard was not removed\n");
+    }
+
+    bool test_subscriber_lists() {
+        application::Database lists;
+        std::atomic<lint> reader(0);
+        lists.add_list_reader(&reader);
+
+        uint id = lists.add_topic("db_test/l");
+        lists.add_user(application::User("l1", "127.0.0.1", 11, 1));
+        lists.add_user(application::User("l2", "127.0.0.1", 12, 2));
+        application::User& first = lists.get_user("l1");
+        application::User& second = lists.get_user("l2");
+
+        // The reader uses the first list, while it is replaced
+        lists.subscribe(first, id, true);
+        const application::subscriber_list* old = lists.get_subscriber_list(id);
+        lint epoch = lists.next_list_epoch();
+        lists.subscribe(second, id, true);
+        const application::subscriber_list* current =
+            lists.get_subscriber_list(id);
+        bool kept = old->sockets.size() == 1 &&
+                    current->sockets.size() == 2 &&
+                    lists.get_retired_lists() == 1;
+
+        // The reader has finished, both old lists are freed
+        reader.store(epoch);
+        lists.topic_new_message(id, "message");
+        lists.user_disconnect(11);
+        lists.publish_lists();
+        bool freed = lists.get_retired_lists() == 0 &&
+                     lists.get_subscriber_list(id)->sockets.size() == 1 &&
+                     first.get_last_id(id) == 0;
+
+        lists.pause_subscription(second, id);
+        bool paused = lists.get_subscriber_list(id) == NULL;
+        lists.resume_subscription("l2", id);
+
+        return ASSERT_TRUE(kept, "The list was freed while it was used\n") &&
+               ASSERT_TRUE(freed, "The old lists were not freed\n") &&
+               ASSERT_TRUE(paused, "The subscription was not paused\n") &&
+               ASSERT_EQUALS(lists.get_subscriber_list(id)->sockets[0], 12,
+                             "The subscription was not resumed\n");
+    }
+
+    bool test_backlog() {
+        application::Database backlog;
+        uint id = backlog.add_topic("db_test/sf");
+        backlog.add_user(application::User("sf", "127.0.0.1", 13, 3));
+        application::User& user = backlog.get_user("sf");
+        backlog.subscribe(user, id, true);
+        backlog.topic_new_message(id, "before");
+        backlog.user_disconnect(13);
+
+        for (uint i = 0; i < 10; ++i) {
+            backlog.topic_new_message(id, "message " + std::to_string(i));
+        }
+        std::pair<lint, lint> missed = backlog.get_backlog(user);
+
+        // The limits are set in "Utils.hpp"
+        std::vector<std::string> texts;
+        application::Topic& topic = backlog.get_topic(id);
+        long first = topic.get_backlog(user.get_last_id(id), texts);
+        lint kept = SF_MAX_MESSAGES > 0 ? std::min(10, SF_MAX_MESSAGES) : 10;
+
+        return ASSERT_EQUALS(missed.first, 10,
+                             "The backlog is not correct\n") &&
+               ASSERT_EQUALS(missed.second, kept,
+                             "The limits were not applied\n") &&
+               ASSERT_EQUALS(texts.size() + first, 11,
+                             "The newest messages were not kept\n") &&
+               ASSERT_TRUE(texts.empty() || texts.back() == "message 9",
+                           "The last message was not kept\n");
+    }
+
+    bool test_filters() {
+        application::content_filter above, prefix, invalid;
+        bool parsed = application::content_filter::parse("gt:20", above) &&
+                      application::content_filter::parse("prefix:ab", prefix) &&
+                      !application::content_filter::parse("in:5:1", invalid);
+
+        application::message_value hot, text;
+        bool decoded =
+            application::decode_message("1.2.3.4:5 - t - FLOAT - 21.5", "t",
+                                        hot) &&
+            application::decode_message("1.2.3.4:5 - t - STRING - abc", "t",
+                                        text);
+        bool matched = above.matches(hot, "") && !prefix.matches(hot, "") &&
+                       !above.matches(text, "1.2.3.4:5 - t - STRING - abc") &&
+                       prefix.matches(text, "1.2.3.4:5 - t - STRING - abc");
+
+        // The users with the same filter are in the same group
+        application::Database filters;
+        uint id = filters.add_topic("db_test/f");
+        for (uint i = 0; i < 3; ++i) {
+            std::string name = "f" + std::to_string(i);
+            filters.add_user(application::User(name, "127.0.0.1", 20 + i, i));
+            filters.subscribe(filters.get_user(name), id, false,
+                              SUB_FILTER,
+                              i < 2 ? &above : &prefix);
+        }
+        const application::subscriber_list* list =
+            filters.get_subscriber_list(id);
+
+        return ASSERT_TRUE(parsed, "The filters were not parsed\n") &&
+               ASSERT_TRUE(decoded, "The messages were not decoded\n") &&
+               ASSERT_TRUE(matched, "The filters were not applied\n") &&
+               ASSERT_TRUE(list->sockets.empty() && list->filtered.size() == 2,
+                           "The filters were not grouped\n") &&
+               ASSERT_EQUALS(list->filtered[0].sockets.size(), 2,
+                             "The group is not correct\n");
+    }
+
+    bool test_rate_limits() {
+        // 2 messages per second, and one of every 2 messages
+        application::rate_limit limit{2, 2, 0, 0, 0};
+        lint now = 10 * NS_PER_SECOND;
+        uint sent = 0;
+        for (uint i = 0; i < 10; ++i) {
+            sent += limit.take(now);
+        }
+        lint skipped = limit.skipped;
+        bool refilled = limit.take(now + NS_PER_SECOND) &&
+                        !limit.take(now + NS_PER_SECOND) &&
+                        limit.take(now + NS_PER_SECOND);
+
+        application::Database limits;
+        uint id = limits.add_topic("db_test/r");
+        limits.add_user(application::User("r", "127.0.0.1", 30, 4));
+        application::User& user = limits.get_user("r");
+        limits.subscribe(user, id, false, SUB_LIMIT, NULL, &limit);
+        const application::subscriber_list* list =
+            limits.get_subscriber_list(id);
+
+        return ASSERT_EQUALS(sent, 2, "The rate was not limited\n") &&
+               ASSERT_EQUALS(skipped, 8,
+                             "The skipped messages were not counted\n") &&
+               ASSERT_TRUE(refilled, "The bucket was not refilled\n") &&
+               ASSERT_TRUE(list->sockets.empty() && list->limited.size() == 1 &&
+                               list->limited[0].limit == user.get_limit(id),
+                           "The subscription was not limited\n");
+    }
+
+    bool test_wildcards() {
+        application::Database wildcards;
+        uint r1 = wildcards.add_topic("w/r1/temp");
+        uint r2 = wildcards.add_topic("w/r2/temp");
+        wildcards.add_topic("w/r2/hum");
+
+        std::vector<uint> temps = wildcards.match_topics("w/+/temp");
+        std::sort(temps.begin(), temps.end());
+        bool topics = temps == std::vector<uint>{r1, r2} &&
+                      wildcards.match_topics("w/#").size() == 3 &&
+                      wildcards.match_topics("w/r1").empty();
+
+        // The patterns that match a topic
+        application::wildcard_subscription any{"#", "u", 0, false, 0, {}, {}};
+        application::wildcard_subscription one{"w/+", "u", 0, false, 0, {},
+                                               {}};
+        application::wildcard_subscription all{"w/#", "u", 0, false, 0, {},
+                                               {}};
+        wildcards.add_wildcard(WILDCARD_ID | 1, any);
+        wildcards.add_wildcard(WILDCARD_ID | 2, one);
+        wildcards.add_wildcard(WILDCARD_ID | 3, all);
+        bool matched = wildcards.match_wildcards("w").size() == 2 &&
+                       wildcards.match_wildcards("w/x").size() == 3 &&
+                       wildcards.match_wildcards("w/x/y").size() == 2 &&
+                       wildcards.match_wildcards("v").size() == 1;
+        wildcards.remove_wildcard(WILDCARD_ID | 3);
+
+        return ASSERT_TRUE(topics, "The topics were not matched\n") &&
+               ASSERT_TRUE(matched, "The patterns were not matched\n") &&
+               ASSERT_EQUALS(wildcards.match_wildcards("w/x").size(), 2,
+                             "The pattern was not removed\n") &&
+               ASSERT_TRUE(application::TopicTrie::is_pattern("a/+/b") &&
+                               !application::TopicTrie::is_pattern("a/#/b") &&
+                               !application::TopicTrie::is_pattern("a/b+"),
+                           "The patterns are not valid\n");
+    }
+
+    bool test_acks() {
+        application::Database acks;
+        uint id = acks.add_topic("db_test/ack");
+        acks.add_user(application::User("a", "127.0.0.1", 40, 4));
+        acks.add_user(application::User("p", "127.0.0.1", 41, 4));
+        application::User& acked = acks.get_user("a");
+        application::User& plain = acks.get_user("p");
+        acks.subscribe(acked, id, true, SUB_ACK);
+        acks.subscribe(plain, id, true);
+
+        // Only the acknowledged messages are known to be received
+        for (uint i = 0; i < 3; ++i) {
+            acks.topic_new_message(id, "db_test/ack " + std::to_string(i));
+        }
+        acked.sent_message_set(id, 0);
+        acks.user_disconnect(40);
+        acks.user_disconnect(41);
+
+        // The cursors of an ACK
+        application::BatchWriter writer(ACK);
+        writer.add_cursor(id, 2);
+        writer.add_cursor(7, 5);
+        const std::string& frame = writer.get_frames();
+        application::tcp_batch batch;
+        bzero(&batch, sizeof(batch));
+        memcpy(&batch, frame.data() + 1, frame.size() - 1);
+        auto cursors = application::read_cursors(batch);
+
+        return ASSERT_EQUALS(acked.get_last_id(id), 0,
+                             "The acknowledged cursor was moved\n") &&
+               ASSERT_EQUALS(plain.get_last_id(id), 2,
+                             "The cursor was not moved\n") &&
+               ASSERT_TRUE(cursors.size() == 2 && cursors[0].first == id &&
+                               cursors[0].second == 2 &&
+                               cursors[1].second == 5,
+                           "The cursors were not read\n");
+    }
+
+    bool test_sockets() {
+        application::Database sockets;
+        sockets.add_user(application::User("s", "127.0.0.1", 50, 5));
+        bool online = sockets.user_exists(50) &&
+                      sockets.get_user(50).get_id() == "s";
+        sockets.user_disconnect(50);
+
+        // The socket is used again by a client that hasn't connected yet
+        return ASSERT_TRUE(online, "The online user was not found\n") &&
+               ASSERT_TRUE(!sockets.user_exists(50),
+                           "The offline user was found by its socket\n");
+    }
+};
+}  // namespace testing
\ No newline at end of file
@@ -23,13 +23,15 @@
 #pragma once
 #include "Filesystem.hpp"
 #include "Test.hpp"
+#include "Topic.hpp"
 
 namespace testing {
 class FilesystemTest : public Test {
    public:
     bool run_tests() {
         return test_newfolder() && test_newfile() && test_deletefile() &&
-               test_deletefolder() && test_path();
+               test_deletefolder() && test_path() && test_data_names() &&
+               test_data_files() && test_open_files();
     }
 
    private:
@@ -59,7 +61,7 @@ class FilesystemTest : public Test {
         std::string name = "./tfolder/t1/t2/t3/t4/t5/file.txt";
         fs.deleteFile(name);
 
-        struct stat buffer;
+        struct stat buffer = {};
         stat(name.c_str(), &buffer);
         return ASSERT_FALSE(S_ISREG(buffer.st_mode), "File was not deleted!\n");
     }
@@ -68,7 +70,7 @@ class FilesystemTest : public Test {
         std::string name = "./tfolder";
         fs.deleteDirectory(name);
 
-        struct stat buffer;
+        struct stat buffer = {};
         stat(name.c_str(), &buffer);
         return ASSERT_FALSE(S_ISDIR(buffer.st_mode),
                             "Folder structure was not deleted!\n");
@@ -89,5 +91,77 @@ class FilesystemTest : public Test {
                             "The path should not be accessible") &&
                ASSERT_FALSE(fs.checkPath(name4), "The path should not exist");
     }
+
+    bool test_data_names() {
+        using application::DataFolder;
+
+        return ASSERT_TRUE(DataFolder::is_valid_name("a/b/c"),
+                           "The name should be valid\n") &&
+               ASSERT_TRUE(DataFolder::is_valid_name("a..b"),
+                           "The name should be valid\n") &&
+               ASSERT_FALSE(DataFolder::is_valid_name("a/../../b"),
+                            "The name should not be valid\n") &&
+               ASSERT_FALSE(DataFolder::is_valid_name("/a"),
+                            "The name should not be valid\n") &&
+               ASSERT_FALSE(DataFolder::is_valid_name("a//b"),
+                            "The name should not be valid\n") &&
+               ASSERT_FALSE(DataFolder::is_valid_name("a/"),
+                            "The name should not be valid\n");
+    }
+
+    bool test_data_files() {
+        application::DataFolder& folder = application::DataFolder::get();
+        std::string name = "fs_test/t1/topic";
+        std::string path = folder.get_path(name);
+        struct stat buffer;
+
+        application::Topic topic(0, name);
+        topic.add_message("message");
+        bool lazy = stat(path.c_str(), &buffer) != 0;
+
+        topic.save();
+        bool created = stat(path.c_str(), &buffer) == 0 &&
+                       S_ISREG(buffer.st_mode) && folder.contains(name);
+
+        // Read relative to the folder, not inherited by child processes
+        int fd = folder.open_read(name);
+        bool readable = fd >= 0 && (fcntl(fd, F_GETFD) & FD_CLOEXEC) &&
+                        folder.stat_file(name, buffer) &&
+                        buffer.st_size > 0 &&
+                        folder.open_read("../" + name) < 0;
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        fs.deleteDirectory(folder.get_path("fs_test"));
+        folder.reload();
+
+        return ASSERT_TRUE(lazy, "The file was created too early\n") &&
+               ASSERT_TRUE(created, "The file was not created\n") &&
+               ASSERT_TRUE(readable, "The file was not opened to read\n") &&
+               ASSERT_FALSE(folder.contains(name),
+                            "The data folder was not reloaded\n");
+    }
+
+    bool test_open_files() {
+        application::DataFolder& folder = application::DataFolder::get();
+        for (uint i = 0; i < DATA_OPEN_FILES + 10; ++i) {
+            folder.append_file("fs_open/" + std::to_string(i), "first\n");
+        }
+        bool bounded = folder.open_files() == DATA_OPEN_FILES;
+
+        // The first file was closed, it is opened again
+        folder.append_file("fs_open/0", "second\n");
+        std::ifstream in(folder.get_path("fs_open/0"));
+        std::string data((std::istreambuf_iterator<char>(in)),
+                         std::istreambuf_iterator<char>());
+
+        fs.deleteDirectory(folder.get_path("fs_open"));
+        folder.reload();
+
+        return ASSERT_TRUE(bounded, "Too many files are open\n") &&
+               ASSERT_EQUALS(data, "first\nsecond\n",
+                             "The closed file was not appended\n");
+    }
 };
 }  // namespace testing
\ No newline at end of file
@@ -0,0 +1,535 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+#include <thread>
+
+#include "Aggregates.hpp"
+#include "Conflation.hpp"
+#include "IoUring.hpp"
+#include "Pipeline.hpp"
+#include "Shards.hpp"
+#include "ShmRing.hpp"
+#include "Test.hpp"
+#include "TimerWheel.hpp"
+
+namespace testing {
+class PipelineTest : public Test {
+   public:
+    bool run_tests() {
+        return test_ring() && test_threads() && test_writer() &&
+               test_fanout() && test_router() && test_conflator() &&
+               test_aggregates() && test_batches() && test_timers() &&
+               test_shm_ring() && test_multicast() && test_io_uring();
+    }
+
+   private:
+    bool test_ring() {
+        application::SpscRing<std::string> ring(5);
+        bool pushed = true;
+        for (uint i = 0; i < 8; ++i) {
+            std::string item = std::to_string(i);
+            pushed = pushed && ring.push(item);
+        }
+        std::string extra = "8";
+        bool full = !ring.push(extra);
+
+        std::string item;
+        bool ordered = true;
+        for (uint i = 0; i < 8; ++i) {
+            ordered = ordered && ring.pop(item) && item == std::to_string(i);
+        }
+
+        return ASSERT_EQUALS(ring.capacity(), 8,
+                             "The capacity is not a power of 2\n") &&
+               ASSERT_TRUE(pushed && full,
+                           "The queue doesn't respect its capacity\n") &&
+               ASSERT_TRUE(ordered, "The elements are not in order\n") &&
+               ASSERT_FALSE(ring.pop(item), "The queue should be empty\n");
+    }
+
+    bool test_threads() {
+        const uint count = 200000;
+        application::SpscRing<uint> ring(64);
+        application::Doorbell bell;
+
+        std::thread producer([&] {
+            for (uint i = 0; i < count; ++i) {
+                uint item = i;
+                while (!ring.push(item)) {
+                    std::this_thread::yield();
+                }
+                bell.ring();
+            }
+        });
+
+        bool ordered = true;
+        uint expected = 0, item;
+        while (expected < count) {
+            if (ring.pop(item)) {
+                ordered = ordered && item == expected;
+                expected++;
+            } else {
+                bell.wait([&] { return !ring.empty(); });
+            }
+        }
+        producer.join();
+
+        return ASSERT_TRUE(ordered,
+                           "The elements were lost or reordered between "
+                           "threads\n");
+    }
+
+    bool test_writer() {
+        std::string path = "./pipeline_test";
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        int sockets[2];
+        socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets);
+
+        application::Pipeline pipeline;
+        pipeline.start(sockets[0]);
+        for (uint i = 0; i < 1000; ++i) {
+            pipeline.append(fd, std::to_string(i) + "\n");
+        }
+        pipeline.drain();
+
+        std::ifstream in(path);
+        std::string line;
+        uint lines = 0;
+        bool ordered = true;
+        while (std::getline(in, line)) {
+            ordered = ordered && line == std::to_string(lines);
+            lines++;
+        }
+
+        pipeline.stop();
+        close(fd);
+        close(sockets[0]);
+        close(sockets[1]);
+        unlink(path.c_str());
+
+        return ASSERT_EQUALS(lines, 1000,
+                             "The appends were not written after drain\n") &&
+               ASSERT_TRUE(ordered, "The appends were reordered\n");
+    }
+
+    bool test_fanout() {
+        const uint clients = 300, messages = 5;
+        std::vector<uint> senders;
+        std::vector<int> receivers;
+        for (uint i = 0; i < clients; ++i) {
+            int sockets[2];
+            socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+            senders.push_back(sockets[0]);
+            receivers.push_back(sockets[1]);
+        }
+
+        application::FanoutPool pool;
+        std::vector<application::fanout_unsent> unsent;
+        bool all_sent = true;
+        pool.start(3);
+        for (uint i = 0; i < messages; ++i) {
+            std::string frame = "message " + std::to_string(i) + ";";
+            std::vector<uint> list = senders;
+            pool.send(frame, list, unsent);
+            all_sent = all_sent && unsent.empty();
+        }
+
+        // A socket that is never read doesn't stop the others
+        std::string big(64 * 1024, 'x');
+        std::vector<uint> list(senders.begin(), senders.begin() + 2);
+        uint rounds = 0;
+        do {
+            pool.send(big, list, unsent);
+            rounds++;
+        } while (unsent.empty() && rounds < 1000);
+        pool.stop();
+        bool reported = !unsent.empty() && unsent[0].sent < big.size();
+
+        std::string expected;
+        for (uint i = 0; i < messages; ++i) {
+            expected += "message " + std::to_string(i) + ";";
+        }
+
+        uint correct = 0;
+        for (uint i = 0; i < clients; ++i) {
+            char buffer[256];
+            ssize_t size = recv(receivers[i], buffer, expected.size(), 0);
+            if (size > 0 && std::string(buffer, size) == expected) {
+                correct++;
+            }
+            close(senders[i]);
+            close(receivers[i]);
+        }
+
+        return ASSERT_EQUALS(correct, clients,
+                             "The messages were not sent to every socket, "
+                             "in order\n") &&
+               ASSERT_TRUE(all_sent, "A socket could not take a message\n") &&
+               ASSERT_TRUE(reported, "A full socket was not reported\n");
+    }
+
+    bool test_router() {
+        // More messages than the queue can hold, the rest wait in the backlog
+        const uint count = SHARD_QUEUE + 1000;
+        application::ShardRouter router(3);
+        for (uint i = 0; i < count; ++i) {
+            application::shard_message msg{};
+            msg.msg_id = i;
+            router.send(2, 1, msg);
+        }
+        bool full = !router.flush(2) && !router.prepare_wait(1);
+
+        uint received = 0;
+        bool ordered = true;
+        application::shard_message msg;
+        while (received < count) {
+            if (!router.receive(1, msg)) {
+                router.flush(2);
+                continue;
+            }
+            ordered = ordered && msg.msg_id == received && msg.from == 2;
+            received++;
+        }
+
+        return ASSERT_TRUE(full, "The backlog was not used\n") &&
+               ASSERT_TRUE(ordered, "The messages were reordered\n") &&
+               ASSERT_TRUE(router.flush(2) && router.prepare_wait(1),
+                           "The queues are not empty\n") &&
+               ASSERT_EQUALS(router.shard_of("a/b"), 0,
+                             "The shard of a key is not correct\n");
+    }
+
+    bool test_conflator() {
+        // Socket 4 waits for 3 messages on topic 1, and one on topic 2
+        application::Conflator conflator;
+        conflator.hold(4, 1, "a1");
+        conflator.hold(4, 2, "b1");
+        conflator.hold(4, 1, "a2");
+        conflator.hold(4, 1, "a3");
+        conflator.set_partial(4, "rest");
+
+        bool partial = conflator.has_partials() &&
+                       *conflator.get_partial(4) == "rest" &&
+                       conflator.get_partial(5) == NULL;
+        conflator.clear_partial(4);
+
+        std::string sent;
+        while (conflator.peek(4) != NULL) {
+            sent += *conflator.peek(4) + " ";
+            conflator.pop(4);
+        }
+
+        return ASSERT_TRUE(partial, "The partial data was not kept\n") &&
+               ASSERT_EQUALS(sent, "a3 b1 ",
+                             "Only the newest messages must be kept\n") &&
+               ASSERT_TRUE(!conflator.holds(4) && !conflator.has_partials(),
+                           "The socket still has data\n");
+    }
+
+    bool test_aggregates() {
+        application::Aggregator aggregator;
+        lint second = NS_PER_SECOND;
+        bool parsed = aggregator.add("t#avg:10s", 100 * second) &&
+                      aggregator.add("t#max:5m", 100 * second) &&
+                      !aggregator.add("t#median:10s", 100 * second) &&
+                      !application::Aggregator::is_aggregate("t/#");
+
+        // Two windows of "avg", the "max" one is still open
+        std::vector<application::aggregate_result> closed;
+        aggregator.update("t", "a - t - INT - 10", 101 * second, closed);
+        aggregator.update("t", "a - t - FLOAT - 20.5", 102 * second, closed);
+        aggregator.update("t", "a - t - STRING - 99", 103 * second, closed);
+        aggregator.update("t", "a - t - INT - -4", 111 * second, closed);
+        bool first = closed.size() == 1 && closed[0].value == 15.25;
+        aggregator.close_windows(125 * second, closed);
+
+        application::udp_message msg;
+        application::Aggregator::make_message(closed.back(), msg);
+        return ASSERT_TRUE(parsed, "The aggregates were not parsed\n") &&
+               ASSERT_TRUE(first, "The first window is not correct\n") &&
+               ASSERT_EQUALS(closed.size(), 2, "The window was not closed\n") &&
+               ASSERT_EQUALS(msg.print(), "t#avg:10s - FLOAT - -4.0000",
+                             "The result is not correct\n") &&
+               ASSERT_EQUALS(aggregator.next_close(), 130 * second,
+                             "The next window is not correct\n");
+    }
+
+    bool test_batches() {
+        // More topics than a message can hold
+        application::BatchWriter writer(TOPIC_IDS);
+        for (uint i = 0; i < 300; ++i) {
+            writer.add("batch_test/" + std::to_string(i), i * 2);
+        }
+        const std::string &frames = writer.get_frames();
+
+        // Split the stream back into messages
+        bool partial = application::tcp_message_size(frames.data(), 2) == 3;
+        size_t pos = 0, size = 0;
+        uint messages = 0, correct = 0;
+        while (pos < frames.size()) {
+            size = application::tcp_message_size(frames.data() + pos,
+                                                 frames.size() - pos);
+            if (size == 0 || pos + size > frames.size()) {
+                break;
+            }
+            application::tcp_batch batch;
+            bzero(&batch, sizeof(batch));
+            memcpy(&batch, frames.data() + pos + 1, size - 1);
+
+            for (auto &entry : application::read_batch(TOPIC_IDS, batch)) {
+                std::string name =
+                    "batch_test/" + std::to_string(entry.second / 2);
+                correct += entry.first == name;
+            }
+            pos += size;
+            messages++;
+        }
+
+        return ASSERT_TRUE(partial, "The header size is not correct\n") &&
+               ASSERT_EQUALS(pos, frames.size(), "The data was not split\n") &&
+               ASSERT_TRUE(messages > 1, "The batch was not split\n") &&
+               ASSERT_EQUALS(correct, 300, "The entries are not correct\n");
+    }
+
+    bool test_timers() {
+        // Timers on every level (up to 100 seconds), a third are cancelled
+        const uint count = 100000;
+        const lint ms = 1000000, start = 12345 * ms;
+        application::TimerWheel wheel(start);
+        std::vector<lint> deadlines, ids;
+        for (uint i = 0; i < count; ++i) {
+            deadlines.push_back(start + (1 + (lint)i * 7919 % count) * ms);
+            ids.push_back(wheel.add(deadlines[i], 0, i));
+        }
+        bool cancelled = true;
+        for (uint i = 0; i < count; i += 3) {
+            cancelled = cancelled && wheel.cancel(ids[i]);
+        }
+        cancelled = cancelled && !wheel.cancel(ids[0]);
+
+        // A timer further than the wheel can hold
+        lint far = start + 10 * 3600 * NS_PER_SECOND;
+        wheel.add(far, 1, 0);
+
+        // Every timer expires in its step (the steps are not aligned to the
+        // slots), in order
+        std::vector<application::timer_event> expired;
+        uint in_time = 0;
+        bool ordered = true;
+        lint previous = 0;
+        for (lint now = start; now <= start + 101 * NS_PER_SECOND;
+             now += 333 * ms) {
+            size_t first = expired.size();
+            wheel.advance(now, expired);
+            for (size_t i = first; i < expired.size(); ++i) {
+                lint deadline = deadlines[expired[i].key];
+                in_time += deadline <= now && deadline + 333 * ms > now;
+                ordered = ordered && deadline >= previous;
+                previous = deadline;
+            }
+        }
+        uint expected = count - (count + 2) / 3;
+        bool left = expired.size() == expected && wheel.size() == 1;
+
+        // The far timer, checked again when it reaches the wheel
+        expired.clear();
+        wheel.advance(far - ms, expired);
+        bool early = !expired.empty();
+        lint next = wheel.next_expiry(far - ms);
+        wheel.advance(far, expired);
+
+        return ASSERT_TRUE(cancelled, "The timers were not cancelled\n") &&
+               ASSERT_EQUALS(in_time, expected,
+                             "The timers didn't expire in time\n") &&
+               ASSERT_TRUE(ordered, "The timers expired out of order\n") &&
+               ASSERT_TRUE(left, "The cancelled timers have expired\n") &&
+               ASSERT_FALSE(early, "The far timer expired early\n") &&
+               ASSERT_EQUALS(next, ms, "The next expiry is not correct\n") &&
+               ASSERT_TRUE(expired.size() == 1 && expired[0].kind == 1 &&
+                               wheel.size() == 0,
+                           "The far timer didn't expire\n");
+    }
+
+    bool test_shm_ring() {
+        // The writer and a reader map the same segment
+        std::string name = "/topic_server_test";
+        application::ShmRing writer, reader;
+        bool opened = writer.create(name, 2) && reader.open(name) &&
+                      reader.get_rings() == 2;
+
+        lint cursor = reader.get_head(), missed = 0;
+        for (uint i = 0; i < 10; ++i) {
+            writer.publish("shm/" + std::to_string(i % 2), i,
+                           "message " + std::to_string(i));
+        }
+        application::shm_message msg;
+        bool ordered = true;
+        uint count = 0;
+        while (reader.read(cursor, msg, missed)) {
+            ordered = ordered && msg.msg_id == count &&
+                      msg.topic == "shm/" + std::to_string(count % 2) &&
+                      msg.text == "message " + std::to_string(count);
+            count++;
+        }
+
+        // The writer laps the reader
+        for (uint i = 0; i < SHM_RING_SLOTS + 100; ++i) {
+            writer.publish("shm/0", 10 + i, "overrun");
+        }
+        bool next = reader.read(cursor, msg, missed);
+
+        // The segment of a running writer is not replaced, and only its user
+        // can read it
+        application::ShmRing other;
+        bool kept = !other.create(name, 1) && reader.get_rings() == 2;
+        struct stat info;
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        bool private_mode = fd >= 0 && fstat(fd, &info) == 0 &&
+                            (info.st_mode & 0777) == 0600;
+        close(fd);
+
+        return ASSERT_TRUE(opened, "The ring was not shared\n") &&
+               ASSERT_EQUALS(count, 10, "The messages were not read\n") &&
+               ASSERT_TRUE(ordered, "The messages are not correct\n") &&
+               ASSERT_TRUE(next && missed == 101 && msg.msg_id == 111,
+                           "The overrun was not detected\n") &&
+               ASSERT_TRUE(kept,
+                           "The ring of a running writer was replaced\n") &&
+               ASSERT_TRUE(private_mode, "Other users can read the ring\n");
+    }
+
+    bool test_multicast() {
+        application::udp_multicast msg;
+        size_t size = application::write_multicast("mc/topic", 42, "text", msg);
+        std::string topic, text;
+        uint id = 0;
+        bool read = application::read_multicast((char *)&msg, size, topic, id,
+                                                text);
+        bool truncated = !application::read_multicast((char *)&msg, 10, topic,
+                                                      id, text);
+
+        // A topic always has the same group, one of MULTICAST_GROUPS
+        sockaddr_in first, second, base;
+        multicast_group("mc/topic", 9000, first);
+        multicast_group("mc/topic", 9000, second);
+        inet_aton(MULTICAST_BASE, &base.sin_addr);
+        uint offset = ntohl(first.sin_addr.s_addr) -
+                      ntohl(base.sin_addr.s_addr);
+
+        return ASSERT_TRUE(read && topic == "mc/topic" && id == 42 &&
+                               text == "text",
+                           "The datagram was not read\n") &&
+               ASSERT_TRUE(truncated, "A short datagram was read\n") &&
+               ASSERT_TRUE(first.sin_addr.s_addr == second.sin_addr.s_addr &&
+                               offset < MULTICAST_GROUPS &&
+                               ntohs(first.sin_port) == 9001,
+                           "The group is not correct\n");
+    }
+
+    /**
+     * @brief Connect two TCP sockets on the loopback interface
+     */
+    static bool loopback_pair(int &client, int &peer) {
+        int listener = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr;
+        bzero(&addr, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        bool ok = bind(listener, (sockaddr *)&addr, len) == 0 &&
+                  listen(listener, 1) == 0 &&
+                  getsockname(listener, (sockaddr *)&addr, &len) == 0;
+
+        client = socket(AF_INET, SOCK_STREAM, 0);
+        ok = ok && connect(client, (sockaddr *)&addr, len) == 0;
+        peer = ok ? accept(listener, NULL, NULL) : -1;
+        close(listener);
+        return ok && peer >= 0;
+    }
+
+    bool test_io_uring() {
+        application::IoUring io;
+        if (!io.init()) {
+            // The kernel doesn't have io_uring (the server uses normal I/O)
+            return true;
+        }
+
+        // The sends of a socket arrive in order
+        int client, peer;
+        bool connected = loopback_pair(client, peer);
+        io.send(peer, "hello ", 6);
+        io.send(peer, "world", 5);
+        io.submit();
+        io.drain();
+
+        char buffer[16];
+        ssize_t received = 0, res;
+        while (received < 11 && (res = recv(client, buffer + received,
+                                            11 - received, 0)) > 0) {
+            received += res;
+        }
+        bool sent = std::string(buffer, received) == "hello world";
+
+        // Small appends use a slot, bigger ones their own buffer
+        char path[] = "/tmp/io_uring_testXXXXXX";
+        int fd = mkstemp(path);
+        io.append(fd, "first ");
+        io.append(fd, std::string(IO_URING_SLOT_SIZE + 100, 'x'));
+        io.drain();
+        std::ifstream in(path);
+        std::string written((std::istreambuf_iterator<char>(in)),
+                            std::istreambuf_iterator<char>());
+        bool appended =
+            written == "first " + std::string(IO_URING_SLOT_SIZE + 100, 'x');
+        close(fd);
+        unlink(path);
+
+        // A client that doesn't read: its sends stay in flight, the next ones
+        // wait until there are too many, and forgetting it doesn't wait
+        const int small = 4096;
+        setsockopt(peer, SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+        std::string frame(IO_URING_SLOT_SIZE, 'f');
+        uint queued = 0;
+        while (queued < 4 * IO_URING_OUTBOX_SLOTS &&
+               io.send(peer, frame.data(), frame.size())) {
+            if (++queued % 256 == 0) {
+                io.submit();
+            }
+        }
+        std::vector<int> stalled = io.take_stalled();
+        io.forget_socket(peer);
+        io.drain();
+        close(peer);
+        close(client);
+
+        return ASSERT_TRUE(connected, "The sockets didn't connect\n") &&
+               ASSERT_TRUE(sent, "The data was not sent\n") &&
+               ASSERT_TRUE(appended, "The data was not appended\n") &&
+               ASSERT_TRUE(queued < 4 * IO_URING_OUTBOX_SLOTS &&
+                               stalled.size() == 1 && stalled[0] == peer,
+                           "The stalled socket was not reported\n") &&
+               ASSERT_FALSE(io.has_pending(peer),
+                            "The stalled socket was not forgotten\n");
+    }
+};
+}  // namespace testing
\ No newline at end of file
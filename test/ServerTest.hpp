@@ -0,0 +1,348 @@
+/**
+ * Copyright (c) 2020 Grama Nicolae
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+#include <sys/wait.h>
+
+#include "Server.hpp"
+#include "Test.hpp"
+
+namespace testing {
+class ServerTest : public Test {
+   public:
+    bool run_tests() { return test_local() && test_handshakes(); }
+
+   private:
+    uint port = 0;
+
+    /**
+     * @brief Find a port that is free (for the TCP and the UDP socket of the
+     * server)
+     * @return uint The port
+     */
+    static uint free_port() {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr;
+        bzero(&addr, sizeof(addr));
+        addr.sin_family = AF_INET;
+        socklen_t len = sizeof(addr);
+        bool found = bind(sock, (sockaddr *)&addr, len) == 0 &&
+                     getsockname(sock, (sockaddr *)&addr, &len) == 0;
+        close(sock);
+        return found ? ntohs(addr.sin_port) : 0;
+    }
+
+    /**
+     * @brief Run a server in a child process, until "exit" is written to its
+     * input (its output is discarded)
+     * @param input Will contain the input of the server
+     * @param local If it also listens on its Unix socket
+     * @return pid_t The child process
+     */
+    pid_t start_server(int &input, const bool local) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            return -1;
+        }
+
+        std::cout.flush();
+        std::cerr.flush();
+        pid_t pid = fork();
+        if (pid == 0) {
+            int null = open("/dev/null", O_WRONLY);
+            dup2(fds[0], STDIN_FILENO);
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+            close(fds[1]);
+            {
+                application::Server server(port);
+                if (local) {
+                    server.listen_local();
+                }
+                server.run();
+            }
+            _exit(0);
+        }
+
+        close(fds[0]);
+        input = fds[1];
+        return pid;
+    }
+
+    /**
+     * @brief Wait until a server has stopped (it is killed if it still runs
+     * after 5 seconds)
+     * @param pid The process of the server
+     * @param input Its input (closed, "exit" is written to it before if the
+     * server must be stopped)
+     * @param stop If the server must be stopped
+     * @return int Its exit status (-1 if it didn't exit)
+     */
+    static int wait_server(const pid_t pid, const int input, const bool stop) {
+        if (stop) {
+            CERR(write(input, "exit\n", 5) != 5);
+        }
+
+        int status = 0;
+        pid_t done = 0;
+        for (uint i = 0; i < 500 && done == 0; ++i) {
+            done = waitpid(pid, &status, WNOHANG);
+            usleep(done == 0 ? 10000 : 0);
+        }
+        close(input);
+        if (done == 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            return -1;
+        }
+        return done == pid && WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+
+    /**
+     * @brief Connect to the server (it may still be starting)
+     * @param addr Its adress
+     * @param len The size of the adress
+     * @return int The socket (-1 if nothing listens on it)
+     */
+    static int connect_server(const sockaddr *addr, const socklen_t len) {
+        for (uint i = 0; i < 200; ++i) {
+            int sock = socket(addr->sa_family, SOCK_STREAM, 0);
+            if (connect(sock, addr, len) == 0) {
+                timeval timeout = {2, 0};
+                setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                           sizeof(timeout));
+                return sock;
+            }
+            close(sock);
+            usleep(10000);
+        }
+        return -1;
+    }
+
+    /**
+     * @brief Connect to the Unix socket of the server
+     * @param path The path of the socket
+     * @return int The socket (-1 if nothing listens on it)
+     */
+    static int connect_local(const std::string &path) {
+        sockaddr_un addr;
+        set_unix_adress(path, addr);
+        return connect_server((sockaddr *)&addr, sizeof(addr));
+    }
+
+    /**
+     * @brief Connect to the TCP port of the server
+     * @return int The socket (-1 if nothing listens on it)
+     */
+    int connect_tcp() {
+        sockaddr_in addr;
+        bzero(&addr, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        return connect_server((sockaddr *)&addr, sizeof(addr));
+    }
+
+    /**
+     * @brief Check if the server has closed a connection
+     * @param sock The socket
+     * @return true The connection was closed (or reset)
+     */
+    static bool is_closed(const int sock) {
+        char byte;
+        ssize_t res = recv(sock, &byte, 1, 0);
+        return res == 0 || (res < 0 && errno == ECONNRESET);
+    }
+
+    /**
+     * @brief Send a message to the server
+     * @param sock The socket
+     * @param type The type of the message
+     * @param data The payload
+     * @param size The size of the payload
+     * @return true The message was sent
+     */
+    static bool send_message(const int sock, const bint type,
+                             const void *data, const size_t size) {
+        std::string msg(1, (char)type);
+        msg.append((const char *)data, size);
+        return send(sock, msg.data(), msg.size(), 0) == (ssize_t)msg.size();
+    }
+
+    /**
+     * @brief Receive the next message from the server (see tcp_message_size)
+     * @param sock The socket
+     * @param msg Will contain the message
+     * @return true A message was received
+     * @return false The connection was closed, or nothing arrived in time
+     */
+    static bool receive_message(const int sock,
+                                application::tcp_message &msg) {
+        char *data = (char *)&msg;
+        size_t received = 0, size = 1;
+        while (received < size) {
+            ssize_t res = recv(sock, data + received, size - received, 0);
+            if (res <= 0) {
+                return false;
+            }
+            received += res;
+            size = application::tcp_message_size(data, received);
+            if (size == 0 || size > sizeof(msg)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief Publish an INT message on a topic of the server
+     * @param topic The topic
+     * @param value The value
+     */
+    void publish(const std::string &topic, const uint value) {
+        application::udp_message msg;
+        bzero(&msg, sizeof(msg));
+        memcpy(msg.topic, topic.c_str(), topic.size());
+        msg.type = INT;
+        *(uint *)(msg.payload + 1) = htonl(value);
+
+        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+        sockaddr_in addr;
+        bzero(&addr, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        CERR(sendto(sock, &msg, TOPIC_LENGTH + 1 + 5, 0, (sockaddr *)&addr,
+                    sizeof(addr)) < 0);
+        close(sock);
+    }
+
+    bool test_local() {
+        port = free_port();
+        std::string path = unix_socket_path(port);
+        sockaddr_un addr;
+        set_unix_adress(path, addr);
+
+        // The socket of a previous run (nothing listens on it) is replaced
+        int old = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool stale = bind(old, (sockaddr *)&addr, sizeof(addr)) == 0;
+        close(old);
+
+        int input;
+        pid_t pid = start_server(input, true);
+        int client = connect_local(path);
+
+        application::tcp_connect connect_data;
+        bzero(&connect_data, sizeof(connect_data));
+        strcpy(connect_data.name, "server_test");
+        application::tcp_subscribe subscribe;
+        bzero(&subscribe, sizeof(subscribe));
+        strcpy(subscribe.topic, "server_test/local");
+        bool sent =
+            send_message(client, CONNECT, &connect_data,
+                         sizeof(connect_data)) &&
+            send_message(client, SUBSCRIBE, &subscribe, sizeof(subscribe));
+
+        // The messages of the topic are delivered on the local connection
+        application::tcp_message msg;
+        bool subscribed = false, delivered = false;
+        while (!delivered && receive_message(client, msg)) {
+            if (msg.type == TOPIC_ID && !subscribed) {
+                subscribed = true;
+                publish("server_test/local", 42);
+            } else if (msg.type == DATA) {
+                auto data = (application::tcp_data *)msg.payload;
+                std::string text(data->payload);
+                delivered = text.find("server_test/local - INT - 42") !=
+                            std::string::npos;
+            }
+        }
+        close(client);
+        int status = wait_server(pid, input, true);
+        bool removed = access(path.c_str(), F_OK) != 0;
+
+        // A server doesn't replace the socket of another one that is running
+        int live = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool listening = bind(live, (sockaddr *)&addr, sizeof(addr)) == 0 &&
+                         listen(live, 4) == 0;
+        pid = start_server(input, true);
+        int refused = wait_server(pid, input, false);
+        int other = connect_local(path);
+        bool kept = other >= 0;
+        close(other);
+        close(live);
+        unlink(path.c_str());
+
+        application::Filesystem fs;
+        fs.deleteDirectory(std::string(DATABASE_FOLDER) + "server_test");
+        application::DataFolder::get().reload();
+
+        return ASSERT_TRUE(stale && client >= 0 && sent,
+                           "The server doesn't listen on its Unix socket\n") &&
+               ASSERT_TRUE(subscribed, "The local client can't subscribe\n") &&
+               ASSERT_TRUE(delivered,
+                           "The message was not sent to the local client\n") &&
+               ASSERT_TRUE(status == 0 && removed,
+                           "The server didn't remove its Unix socket\n") &&
+               ASSERT_TRUE(listening && refused > 0 && kept,
+                           "The socket of a running server was replaced\n");
+    }
+
+    bool test_handshakes() {
+        port = free_port();
+        int input;
+        pid_t pid = start_server(input, false);
+
+        // The clients send only a part of their CONNECT, so they stay in the
+        // handshakes (accepted in batches of ACCEPT_BATCH)
+        std::vector<int> clients;
+        bool connected = true;
+        for (uint i = 0; i <= MAX_PENDING_HANDSHAKES && connected; ++i) {
+            int sock = connect_tcp();
+            bint type = CONNECT;
+            connected = sock >= 0 && send(sock, &type, 1, 0) == 1;
+            clients.push_back(sock);
+
+            // The oldest one is only dropped for the last client
+            if (i + 1 == MAX_PENDING_HANDSHAKES) {
+                usleep(200000);
+            }
+        }
+
+        // The oldest handshake was dropped for the newest one
+        bool evicted = connected && is_closed(clients[0]);
+        char byte;
+        bool kept = connected &&
+                    recv(clients[1], &byte, 1, MSG_DONTWAIT) < 0 &&
+                    errno == EAGAIN;
+        for (int sock : clients) {
+            close(sock);
+        }
+        int status = wait_server(pid, input, true);
+
+        return ASSERT_TRUE(connected, "The clients couldn't connect\n") &&
+               ASSERT_TRUE(evicted, "The oldest handshake was not dropped\n") &&
+               ASSERT_TRUE(kept, "A newer handshake was dropped\n") &&
+               ASSERT_EQUALS(status, 0, "The server didn't stop\n");
+    }
+};
+}  // namespace testing
\ No newline at end of file
@@ -30,7 +30,8 @@ class UserTest : public Test {
     bool run_tests() {
         return test_offline() && test_online() && test_id() &&
                test_subscribe() && test_store() && test_unsubscribe() &&
-               test_id() && test_ip() && test_port() && test_id_change();
+               test_id() && test_ip() && test_port() && test_id_change() &&
+               test_subscriptions();
     }
 
    private:
@@ -92,5 +93,33 @@ class UserTest : public Test {
         return ASSERT_EQUALS(user.get_port(), port,
                              "The user port is not corect\n");
     }
+
+    bool test_subscriptions() {
+        application::User other("many", "127.0.0.1", 11, port);
+        for (uint i = 0; i < 3000; ++i) {
+            other.subscribe((i * 7919) % 3000, i % 2, (long)i - 1);
+        }
+        other.subscribe(0, true, 100);
+        other.unsubcribe(1500);
+        other.sent_message_set(2999, lastmessage);
+        other.sent_message_set(1500, lastmessage);
+
+        const auto& subs = other.get_subscriptions();
+        bool sorted = true;
+        for (uint i = 1; i < subs.size(); ++i) {
+            sorted = sorted && subs[i - 1].topic < subs[i].topic;
+        }
+
+        return ASSERT_EQUALS(subs.size(), 2999,
+                             "The number of subscriptions is not correct\n") &&
+               ASSERT_TRUE(sorted, "The subscriptions are not sorted\n") &&
+               ASSERT_EQUALS(other.get_last_id(0), -1,
+                             "An existing subscription was changed\n") &&
+               ASSERT_FALSE(other.is_sf(0), "The sf flag is not correct\n") &&
+               ASSERT_EQUALS(other.get_last_id(2999), lastmessage,
+                             "The last message id was not set\n") &&
+               ASSERT_FALSE(other.is_subscribed(1500),
+                            "The user should not be subscribed\n");
+    }
 };
 }  // namespace testing
\ No newline at end of file
@@ -23,7 +23,11 @@
 #include <iostream>
 #include <vector>
 
+#include "ChecksumTest.hpp"
+#include "DatabaseTest.hpp"
 #include "FilesystemTest.hpp"
+#include "PipelineTest.hpp"
+#include "ServerTest.hpp"
 #include "UserTest.hpp"
 
 /**
@@ -37,6 +41,10 @@ int main() {
     // Add tests to be run
     tests.push_back(new testing::FilesystemTest());
     tests.push_back(new testing::UserTest());
+    tests.push_back(new testing::ChecksumTest());
+    tests.push_back(new testing::DatabaseTest());
+    tests.push_back(new testing::PipelineTest());
+    tests.push_back(new testing::ServerTest());
 
     // Do not change code from here
     // If it has any tests to run